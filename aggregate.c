@@ -0,0 +1,262 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include "aggregate.h"
+#include "metrics.h"
+
+typedef struct aggregate_field_struct
+{
+    float  min;
+    float  max;
+    double sum;                                 // mean = sum / count, kept in double over long windows
+    float  last;
+}aggregate_field_t;
+
+typedef struct aggregate_window_struct
+{
+    int64_t start;                              // ms since the epoch, a multiple of the window length
+    int     count;                              // readings so far, 0 while no window is open
+    int64_t arrived;                            // wall clock ms of the latest reading
+    aggregate_field_t power;
+    aggregate_field_t soc;
+}aggregate_window_t;
+
+// Private data, readings arrive on the ingest threads and idle windows are closed by the flush thread
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static pthread_t thread1;
+static bool started = false;
+static bool terminate1 = false;
+static int64_t window_ms = 0;                   // 0 = readings are forwarded as they are
+static float jump = 0;                          // SoC change that is forwarded at once, 0 = none
+static aggregate_forward_t forward = NULL;
+static aggregate_window_t window;
+static bool have_soc = false;                   // soc holds the previous reading, across windows
+static float soc = 0;
+
+static int64_t _now_ms();
+static void    _field_add(aggregate_field_t* field, float value, bool first);
+static int     _field_json(char* buf, int size, const char* name, const aggregate_field_t* field, int count);
+static int     _close(char* buf, int size);
+static int     _event(char* buf, int size, const reading_t* reading);
+static void*   _thread_handler(void* ptr);
+
+
+int64_t _now_ms()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+//
+// Folds one value into a field, O(1) whatever the length of the window
+//
+void _field_add(aggregate_field_t* field, float value, bool first)
+{
+    if ( first )
+    {
+        field->min = value;
+        field->max = value;
+        field->sum = 0;
+    }
+    else if ( value < field->min )
+    {
+        field->min = value;
+    }
+    else if ( value > field->max )
+    {
+        field->max = value;
+    }
+    field->sum += value;
+    field->last = value;
+}
+
+int _field_json(char* buf, int size, const char* name, const aggregate_field_t* field, int count)
+{
+    return snprintf(buf, size, "\"%s\": { \"min\": %g, \"max\": %g, \"mean\": %g, \"last\": %g }",
+                    name, field->min, field->max, field->sum / count, field->last);
+}
+
+//
+// Renders the open window into buf and closes it, returns the length or 0 if no window is open.
+// Called with the mutex held
+//
+int _close(char* buf, int size)
+{
+    int n;
+
+    if ( window.count == 0 )
+    {
+        return 0;
+    }
+    n = snprintf(buf, size, "{ \"aggregate\": { \"start\": %lld, \"end\": %lld, \"count\": %d, ",
+                 (long long)window.start, (long long)(window.start + window_ms), window.count);
+    n += _field_json(buf + n, size - n, "powerDeliveredkW", &window.power, window.count);
+    n += snprintf(buf + n, size - n, ", ");
+    n += _field_json(buf + n, size - n, "stateOfCharge", &window.soc, window.count);
+    n += snprintf(buf + n, size - n, " } }");
+    window.count = 0;
+    metrics_add(MetricAggregateWindows, 1);
+    return n < size ? n : 0;
+}
+
+//
+// Renders a state of charge jump, returns the length or 0 if the reading is not one. Called with the
+// mutex held
+//
+int _event(char* buf, int size, const reading_t* reading)
+{
+    float delta = reading->state_of_charge - soc;
+    int n = 0;
+
+    if ( jump > 0 && have_soc && (delta >= jump || -delta >= jump) )
+    {
+        n = snprintf(buf, size, "{ \"event\": \"stateOfChargeJump\", \"timestamp\": %lld, \"from\": %g, \"to\": %g }",
+                     (long long)reading->timestamp, soc, reading->state_of_charge);
+        metrics_add(MetricAggregateEvents, 1);
+    }
+    soc = reading->state_of_charge;
+    have_soc = true;
+    return n < size ? n : 0;
+}
+
+//
+// Closes a window once no reading has arrived for a whole window length, the gateway stopped reporting.
+// Arrival time rather than the reading timestamps, a backlog of old readings still aggregates
+//
+void* _thread_handler(void* ptr)
+{
+    char buf[AGGREGATE_JSON_SIZE];
+    struct timespec ts;
+    int64_t deadline;
+    int n;
+
+    pthread_mutex_lock(&mutex);
+    while ( !terminate1 )
+    {
+        deadline = (window.count ? window.arrived : _now_ms()) + window_ms;
+        ts.tv_sec = deadline / 1000;
+        ts.tv_nsec = (deadline % 1000) * 1000000;
+        if ( pthread_cond_timedwait(&cond, &mutex, &ts) != ETIMEDOUT || window.count == 0 ||
+             _now_ms() < window.arrived + window_ms )
+        {
+            continue;
+        }
+        n = _close(buf, sizeof(buf));
+        pthread_mutex_unlock(&mutex);
+        if ( n > 0 )
+        {
+            forward(buf, n + 1);
+        }
+        pthread_mutex_lock(&mutex);
+    }
+    pthread_mutex_unlock(&mutex);
+    return 0;
+}
+
+/*
+***************************************************************************************************************
+ \fn      aggregate_start(unsigned int window_seconds, float soc_jump, aggregate_forward_t forward_function)
+ \brief   forwards one aggregate per window of window_seconds instead of every reading
+
+ Windows are aligned to the epoch and follow the reading timestamps, not the arrival time. Each reading
+ updates the min, max, sum and last of powerDeliveredkW and stateOfCharge of the open window; a reading
+ past its end closes it and the aggregate goes to forward_function as a JSON document. Late readings count towards
+ the open window. A state of charge that moves by soc_jump or more from the previous reading is forwarded
+ at once as an event, 0 disables events. A window that receives no reading for a whole window length is
+ closed without waiting for the next one.
+
+ \note    returns -1 if the flush thread cannot be started
+**************************************************************************************************************
+*/
+int aggregate_start(unsigned int window_seconds, float soc_jump, aggregate_forward_t forward_function)
+{
+    if ( window_seconds == 0 || started )
+    {
+        return 0;
+    }
+    window_ms = (int64_t)window_seconds * 1000;
+    jump = soc_jump;
+    forward = forward_function;
+    terminate1 = false;
+    if ( pthread_create(&thread1, NULL, _thread_handler, NULL) != 0 )
+    {
+        printf("%s unable to start the flush thread\n", __PRETTY_FUNCTION__);
+        window_ms = 0;
+        return -1;
+    }
+    started = true;
+    return 0;
+}
+
+//
+// Forwards the open window and stops the flush thread
+//
+void aggregate_stop()
+{
+    char buf[AGGREGATE_JSON_SIZE];
+    int n;
+
+    if ( !started )
+    {
+        return;
+    }
+    pthread_mutex_lock(&mutex);
+    terminate1 = true;
+    pthread_cond_signal(&cond);
+    n = _close(buf, sizeof(buf));
+    pthread_mutex_unlock(&mutex);
+    pthread_join(thread1, NULL);
+    started = false;
+    if ( n > 0 )
+    {
+        forward(buf, n + 1);
+    }
+}
+
+bool aggregate_enabled()
+{
+    return window_ms > 0;
+}
+
+//
+// Folds a reading into its window, forwarding the window it closes and the event it raises if any
+//
+void aggregate_add(const reading_t* reading)
+{
+    char closed[AGGREGATE_JSON_SIZE], event[AGGREGATE_JSON_SIZE];
+    int64_t start = reading->timestamp - ((reading->timestamp % window_ms) + window_ms) % window_ms;
+    int n, m;
+    bool wake;
+
+    pthread_mutex_lock(&mutex);
+    n = window.count && start > window.start ? _close(closed, sizeof(closed)) : 0;
+    m = _event(event, sizeof(event), reading);
+    wake = window.count == 0;
+    if ( wake )
+    {
+        window.start = start;
+    }
+    _field_add(&window.power, reading->power_kw, window.count == 0);
+    _field_add(&window.soc, reading->state_of_charge, window.count == 0);
+    window.arrived = _now_ms();
+    window.count++;
+    if ( wake )
+    {
+        pthread_cond_signal(&cond);             // the flush thread waits for the new window to go idle
+    }
+    pthread_mutex_unlock(&mutex);
+
+    if ( n > 0 )
+    {
+        forward(closed, n + 1);
+    }
+    if ( m > 0 )
+    {
+        forward(event, m + 1);
+    }
+}
@@ -0,0 +1,24 @@
+/*
+ * Copyright © kiwipower 2017
+ *
+ * Header file for the windowed aggregation of readings on their way to the uplink
+ */
+#ifndef AGGREGATE_DOT_H
+#define AGGREGATE_DOT_H
+
+#include <stdbool.h>
+#include "readings.h"
+
+#define AGGREGATE_JSON_SIZE     512           // one window or event rendered as JSON
+
+typedef void (*aggregate_forward_t)(const char* json, int length);
+
+//
+// Public functions
+//
+int  aggregate_start(unsigned int window_seconds, float soc_jump, aggregate_forward_t forward_function);
+void aggregate_stop();
+bool aggregate_enabled();
+void aggregate_add(const reading_t* reading);
+
+#endif
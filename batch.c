@@ -0,0 +1,477 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include "batch.h"
+#include "regmap.h"
+
+#define BATCH_MAX_SCHEDULES     64
+#define BATCH_TRAJECTORY_MAGIC  "BSIMTRJ1"
+
+enum BatchParam
+{
+    BatchParamRating = 0,
+    BatchParamCharge,
+    BatchParamDischarge,
+    BatchParamCount
+};
+
+enum BatchState
+{
+    BatchStateIdle = 0,
+    BatchStateCharging,
+    BatchStateDischarging
+};
+
+typedef struct batch_step_struct
+{
+    double  time;                               // seconds from the start of the run
+    int32_t setpoint;                           // kW
+}batch_step_t;
+
+typedef struct batch_schedule_struct
+{
+    const char *filename;
+    batch_step_t *steps;
+    int count;
+}batch_schedule_t;
+
+typedef struct batch_range_struct
+{
+    float from;
+    float to;
+    float step;
+}batch_range_t;
+
+//
+// One binary trajectory record, the file starts with BATCH_TRAJECTORY_MAGIC
+//
+typedef struct batch_record_struct
+{
+    double  time;
+    int32_t setpoint;
+    float   state_of_charge;
+    uint8_t state;
+}__attribute__((packed))batch_record_t;
+
+typedef struct batch_summary_struct
+{
+    float final_soc;
+    float min_soc;
+    float max_soc;
+    double time_full;                           // seconds asked to charge a full battery
+    double time_empty;                          // seconds asked to discharge an empty battery
+}batch_summary_t;
+
+// Private data
+static const char *param_names[BatchParamCount] = { "rating", "charge", "discharge" };
+static batch_range_t ranges[BatchParamCount] =
+{
+    { BATTERY_POWER_RATING_DEFAULT,   BATTERY_POWER_RATING_DEFAULT,   0 },
+    { BATTERY_TIME_CHARGE_DEFAULT,    BATTERY_TIME_CHARGE_DEFAULT,    0 },
+    { BATTERY_TIME_DISCHARGE_DEFAULT, BATTERY_TIME_DISCHARGE_DEFAULT, 0 }
+};
+static batch_schedule_t schedules[BATCH_MAX_SCHEDULES];
+static int schedule_count = 0;
+static const char *output = NULL;
+static int jobs = 0;
+static float step = 1.0;
+
+static int   _range_count(const batch_range_t* range);
+static void  _scenario_params(int index, battery_param_t* param);
+static void  _scenario_output(int index, int count, char* buf, int size);
+static void  _write_setpoint(init_param_t* param, const batch_target_t* target, int32_t setpoint);
+static int   _run_scenario(init_param_t* param, const batch_target_t* target, const batch_schedule_t* schedule,
+                           const char* filename, batch_summary_t* summary);
+static int   _compare_steps(const void* a, const void* b);
+
+
+int _compare_steps(const void* a, const void* b)
+{
+    const batch_step_t *x = a, *y = b;
+    return (x->time > y->time) - (x->time < y->time);
+}
+
+//
+// Reads a set point schedule: one "<seconds> <kW>" pair per line, comma or white space separated,
+// '#' starts a comment. The run ends at the time of the last entry.
+//
+int batch_add_schedule(const char* filename)
+{
+    FILE *fp;
+    char line[256];
+    int capacity = 0;
+    batch_schedule_t *schedule;
+
+    if ( schedule_count == BATCH_MAX_SCHEDULES )
+    {
+        printf("%s too many schedules, max %d\n", __PRETTY_FUNCTION__, BATCH_MAX_SCHEDULES);
+        return -1;
+    }
+    fp = fopen(filename, "r");
+    if ( fp == NULL )
+    {
+        printf("%s unable to open %s: %s\n", __PRETTY_FUNCTION__, filename, strerror(errno));
+        return -1;
+    }
+    schedule = &schedules[schedule_count];
+    schedule->filename = filename;
+    while ( fgets(line, sizeof(line), fp) )
+    {
+        char *p;
+        double t;
+        int setpoint;
+
+        if ( (p = strchr(line, '#')) != NULL ) *p = '\0';
+        for ( p = line; *p; p++ )
+        {
+            if ( *p == ',' || *p == ';' ) *p = ' ';
+        }
+        if ( sscanf(line, "%lf %d", &t, &setpoint) != 2 )
+        {
+            continue;
+        }
+        if ( schedule->count == capacity )
+        {
+            capacity = capacity ? capacity * 2 : 256;
+            schedule->steps = realloc(schedule->steps, capacity * sizeof(batch_step_t));
+        }
+        schedule->steps[schedule->count].time = t;
+        schedule->steps[schedule->count].setpoint = setpoint;
+        schedule->count++;
+    }
+    fclose(fp);
+    if ( schedule->count == 0 )
+    {
+        printf("%s %s has no set points\n", __PRETTY_FUNCTION__, filename);
+        return -1;
+    }
+    qsort(schedule->steps, schedule->count, sizeof(batch_step_t), _compare_steps);
+    schedule_count++;
+    return 0;
+}
+
+//
+// Battery parameter as key=value or a sweep as key=from:to:step. Keys: rating (kW), charge and
+// discharge (seconds from 0 to 100% and back)
+//
+int batch_add_param(const char* spec)
+{
+    int i;
+    const char *value = strchr(spec, '=');
+    batch_range_t range;
+
+    if ( value == NULL )
+    {
+        return -1;
+    }
+    for ( i = 0; i < BatchParamCount; i++ )
+    {
+        if ( strncmp(spec, param_names[i], value - spec) == 0 && strlen(param_names[i]) == (size_t)(value - spec) )
+        {
+            break;
+        }
+    }
+    if ( i == BatchParamCount )
+    {
+        printf("%s unknown battery parameter %s\n", __PRETTY_FUNCTION__, spec);
+        return -1;
+    }
+    switch ( sscanf(value + 1, "%f:%f:%f", &range.from, &range.to, &range.step) )
+    {
+    case 1:
+        range.to = range.from;
+        range.step = 0;
+        break;
+    case 3:
+        if ( range.step > 0 && range.to >= range.from )
+        {
+            break;
+        }
+        // fall through
+    default:
+        printf("%s invalid value %s\n", __PRETTY_FUNCTION__, spec);
+        return -1;
+    }
+    if ( range.from <= 0 )
+    {
+        printf("%s %s must be positive\n", __PRETTY_FUNCTION__, param_names[i]);
+        return -1;
+    }
+    ranges[i] = range;
+    return 0;
+}
+
+void batch_set_output(const char* filename)
+{
+    output = filename;
+}
+
+void batch_set_jobs(int count)
+{
+    jobs = count;
+}
+
+void batch_set_step(float seconds)
+{
+    step = seconds;
+}
+
+bool batch_enabled()
+{
+    return schedule_count > 0;
+}
+
+//
+// The first value of every parameter, used when running live
+//
+void batch_params(battery_param_t* param)
+{
+    _scenario_params(0, param);
+}
+
+int _range_count(const batch_range_t* range)
+{
+    if ( range->step <= 0 )
+    {
+        return 1;
+    }
+    return (int)((range->to - range->from) / range->step + 1e-4) + 1;
+}
+
+void _scenario_params(int index, battery_param_t* param)
+{
+    float value[BatchParamCount];
+    int i;
+
+    for ( i = 0; i < BatchParamCount; i++ )
+    {
+        int count = _range_count(&ranges[i]);
+        value[i] = ranges[i].from + (index % count) * ranges[i].step;
+        index /= count;
+    }
+    param->power_rating   = value[BatchParamRating];
+    param->time_charge    = value[BatchParamCharge];
+    param->time_discharge = value[BatchParamDischarge];
+}
+
+//
+// out.csv stays out.csv for a single scenario and becomes out.<n>.csv for a sweep
+//
+void _scenario_output(int index, int count, char* buf, int size)
+{
+    const char *ext = strrchr(output, '.');
+
+    if ( count == 1 )
+    {
+        snprintf(buf, size, "%s", output);
+    }
+    else if ( ext == NULL || strchr(ext, '/') )
+    {
+        snprintf(buf, size, "%s.%d", output, index);
+    }
+    else
+    {
+        snprintf(buf, size, "%.*s.%d%s", (int)(ext - output), output, index, ext);
+    }
+}
+
+void _write_setpoint(init_param_t* param, const batch_target_t* target, int32_t setpoint)
+{
+    uint8_t data[4];
+
+    if ( target->setpoint_scale != 0 )
+    {
+        setpoint = (int32_t)(setpoint / target->setpoint_scale);
+    }
+    if ( target->setpoint_quantity == 2 )
+    {
+        data[0] = (uint32_t)setpoint >> 24;
+        data[1] = (uint32_t)setpoint >> 16;
+        data[2] = (uint32_t)setpoint >> 8;
+        data[3] = (uint32_t)setpoint;
+        target->write_multiple_addresses(target->setpoint_address, 2, data);
+    }
+    else
+    {
+        regmap_write16(param->modbus_mapping, target->setpoint_address, (uint16_t)setpoint);
+        target->process_handler(target->setpoint_address, (uint16_t)setpoint);
+    }
+}
+
+int _run_scenario(init_param_t* param, const batch_target_t* target, const batch_schedule_t* schedule,
+                  const char* filename, batch_summary_t* summary)
+{
+    FILE *fp = NULL;
+    bool binary = false;
+    const double end = schedule->steps[schedule->count - 1].time;
+    double t = 0;
+    long k;
+    int next = 0;
+
+    if ( filename )
+    {
+        const char *ext = strrchr(filename, '.');
+        binary = ext && strcmp(ext, ".bin") == 0;
+        fp = fopen(filename, binary ? "wb" : "w");
+        if ( fp == NULL )
+        {
+            printf("%s unable to open %s: %s\n", __PRETTY_FUNCTION__, filename, strerror(errno));
+            return -1;
+        }
+        if ( binary )
+        {
+            fwrite(BATCH_TRAJECTORY_MAGIC, 8, 1, fp);
+        }
+        else
+        {
+            fprintf(fp, "time,setpoint,soc,state\n");
+        }
+    }
+
+    param->headless = true;
+    target->init(param);
+    if ( target->enable_address )
+    {
+        regmap_write16(param->modbus_mapping, target->enable_address, target->enable_value);
+        target->process_handler(target->enable_address, target->enable_value);
+    }
+    summary->min_soc = 100.0;
+    summary->max_soc = 0.0;
+    summary->time_full = summary->time_empty = 0;
+
+    for ( k = 0; ; k++ )
+    {
+        battery_t *battery = param->battery;
+        uint8_t state;
+
+        t = k * (double)step;
+        while ( next < schedule->count && schedule->steps[next].time <= t )
+        {
+            _write_setpoint(param, target, schedule->steps[next++].setpoint);
+        }
+
+        state = battery->charging ? BatchStateCharging : battery->discharging ? BatchStateDischarging : BatchStateIdle;
+        if ( fp && binary )
+        {
+            batch_record_t record = { t, battery->setpoint, battery->state_of_charge, state };
+            fwrite(&record, sizeof(record), 1, fp);
+        }
+        else if ( fp )
+        {
+            fprintf(fp, "%.3f,%d,%.4f,%d\n", t, battery->setpoint, battery->state_of_charge, state);
+        }
+        if ( battery->state_of_charge < summary->min_soc ) summary->min_soc = battery->state_of_charge;
+        if ( battery->state_of_charge > summary->max_soc ) summary->max_soc = battery->state_of_charge;
+        if ( t >= end )
+        {
+            summary->final_soc = battery->state_of_charge;
+            break;
+        }
+        if ( battery->state_of_charge >= 100.0 && battery->setpoint < 0 ) summary->time_full += step;
+        if ( battery->state_of_charge <= 0.0 && battery->setpoint > 0 ) summary->time_empty += step;
+        target->tick(step);
+    }
+    if ( fp )
+    {
+        fclose(fp);
+    }
+    return 0;
+}
+
+/*
+***************************************************************************************************************
+ \fn      batch_run(init_param_t* param, const batch_target_t* target)
+ \brief   runs every schedule against every battery parameter combination
+
+ Each scenario runs the vendor model without sockets or threads, advancing it by the tick step as fast as
+ the CPU allows. Scenarios are forked into up to `jobs` worker processes (default one per core) since the
+ vendor models keep their state in file scope. One summary line per scenario is printed to stdout.
+
+ \note    Returns the process exit status: 0 when every scenario ran.
+**************************************************************************************************************
+*/
+int batch_run(init_param_t* param, const batch_target_t* target)
+{
+    int grid = 1, count, i, running = 0, failed = 0;
+
+    for ( i = 0; i < BatchParamCount; i++ )
+    {
+        grid *= _range_count(&ranges[i]);
+    }
+    count = grid * schedule_count;
+    if ( jobs < 1 )
+    {
+        jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if ( step <= 0 )
+    {
+        step = 1.0;
+    }
+
+    printf("scenario,schedule,rating,charge,discharge,final_soc,min_soc,max_soc,time_full,time_empty\n");
+    fflush(stdout);
+    for ( i = 0; i < count || running; )
+    {
+        int status;
+        pid_t pid;
+
+        if ( i < count && running < jobs )
+        {
+            pid = fork();
+            if ( pid == 0 )
+            {
+                char filename[512];
+                char line[512];
+                batch_summary_t summary;
+                const batch_schedule_t *schedule = &schedules[i % schedule_count];
+
+                _scenario_params(i / schedule_count, &param->battery_param);
+                if ( output )
+                {
+                    _scenario_output(i, count, filename, sizeof(filename));
+                }
+                if ( _run_scenario(param, target, schedule, output ? filename : NULL, &summary) != 0 )
+                {
+                    _exit(1);
+                }
+                // one write() per line so lines from parallel workers never interleave
+                snprintf(line, sizeof(line), "%d,%s,%g,%g,%g,%.4f,%.4f,%.4f,%.1f,%.1f\n", i, schedule->filename,
+                         param->battery_param.power_rating, param->battery_param.time_charge,
+                         param->battery_param.time_discharge, summary.final_soc, summary.min_soc,
+                         summary.max_soc, summary.time_full, summary.time_empty);
+                write(STDOUT_FILENO, line, strlen(line));
+                _exit(0);
+            }
+            if ( pid < 0 )
+            {
+                printf("%s fork failed: %s\n", __PRETTY_FUNCTION__, strerror(errno));
+                failed++;
+            }
+            else
+            {
+                running++;
+            }
+            i++;
+            continue;
+        }
+        pid = wait(&status);
+        if ( pid < 0 )
+        {
+            break;
+        }
+        running--;
+        if ( !WIFEXITED(status) || WEXITSTATUS(status) != 0 )
+        {
+            failed++;
+        }
+    }
+    if ( failed )
+    {
+        printf("%d of %d scenarios failed\n", failed, count);
+    }
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,42 @@
+/*
+ * Copyright © kiwipower 2017
+ *
+ * Header file to run set point schedules headless
+ */
+#ifndef BATCH_DOT_H
+#define BATCH_DOT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "typedefs.h"
+#include "battery.h"
+
+//
+// How a batch run drives one of the vendor simulators
+//
+typedef struct batch_target_struct
+{
+    void (*init)(init_param_t *);
+    void (*tick)(float seconds);
+    int  (*process_handler)(uint16_t address, uint16_t data);
+    int  (*write_multiple_addresses)(uint16_t start_address, uint16_t quantity, uint8_t* pdata);
+    uint16_t setpoint_address;                  // register the schedule writes
+    uint16_t setpoint_quantity;                 // 1 = single register write, 2 = 32 bit multiple register write
+    float    setpoint_scale;                    // kW per register unit, 0 = 1
+    uint16_t enable_address;                    // written with enable_value before the run, 0 = none
+    uint16_t enable_value;
+}batch_target_t;
+
+//
+// Public functions
+//
+int   batch_add_schedule(const char* filename);
+int   batch_add_param(const char* spec);
+void  batch_set_output(const char* filename);
+void  batch_set_jobs(int jobs);
+void  batch_set_step(float seconds);
+bool  batch_enabled();
+void  batch_params(battery_param_t* param);
+int   batch_run(init_param_t* param, const batch_target_t* target);
+
+#endif
@@ -0,0 +1,97 @@
+#include <stdio.h>
+#include <string.h>
+#include "battery.h"
+
+static const float battery_fully_charged        = 100.00;
+static const float battery_fully_discharged     = 0.0;
+
+
+void battery_param_default(battery_param_t* param)
+{
+    param->power_rating   = BATTERY_POWER_RATING_DEFAULT;
+    param->time_charge    = BATTERY_TIME_CHARGE_DEFAULT;
+    param->time_discharge = BATTERY_TIME_DISCHARGE_DEFAULT;
+}
+
+void battery_init(battery_t* battery, const battery_param_t* param)
+{
+    memset(battery, 0, sizeof(battery_t));
+    battery_configure(battery, param);
+    battery_reset(battery);
+}
+
+//
+// New parameters for a running battery, the state of charge and set point are kept
+//
+void battery_configure(battery_t* battery, const battery_param_t* param)
+{
+    battery->charge_resolution    = 100.00 / (param->power_rating * param->time_charge);
+    battery->discharge_resolution = 100.00 / (param->power_rating * param->time_discharge);
+    battery_setpoint(battery, battery->setpoint);
+}
+
+//
+// Back to the default state of charge, the set point is kept
+//
+void battery_reset(battery_t* battery)
+{
+    battery->state_of_charge = BATTERY_STATE_OF_CHARGE_DEFAULT;
+}
+
+//
+// Real power command in kW: negative charges, positive discharges, zero idles
+//
+void battery_setpoint(battery_t* battery, int32_t power)
+{
+    battery->setpoint = power;
+    if ( power < 0 )
+    {
+        battery->charging = true;
+        battery->discharging = false;
+        battery->charge_increment = (-power * battery->charge_resolution);
+    }
+    else if ( power > 0 )
+    {
+        battery->discharging = true;
+        battery->charging = false;
+        battery->discharge_decrement = (power * battery->discharge_resolution);
+    }
+    else
+    {
+        battery->discharging = false;
+        battery->charging = false;
+    }
+}
+
+//
+// Advances the state of charge by the given number of seconds
+//
+void battery_tick(battery_t* battery, float seconds)
+{
+    if (battery->charging)
+    {
+        float increment = battery->charge_increment * seconds;
+        if ( (battery->state_of_charge + increment) <= battery_fully_charged )
+        {
+            battery->state_of_charge += increment;
+        }
+        else
+        {
+            battery->state_of_charge = battery_fully_charged;
+            battery->charging = false;
+        }
+    }
+    else if (battery->discharging)
+    {
+        float decrement = battery->discharge_decrement * seconds;
+        if ( (battery->state_of_charge - decrement) >= battery_fully_discharged )
+        {
+            battery->state_of_charge -= decrement;
+        }
+        else
+        {
+            battery->state_of_charge = battery_fully_discharged;
+            battery->discharging = false;
+        }
+    }
+}
@@ -0,0 +1,46 @@
+/*
+ * Copyright © kiwipower 2017
+ *
+ * Header file to simulate battery charge/discharge profile
+ */
+#ifndef BATTERY_DOT_H
+#define BATTERY_DOT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define BATTERY_POWER_RATING_DEFAULT            230           // kW
+#define BATTERY_TIME_CHARGE_DEFAULT             3000          // seconds from 0 to 100%
+#define BATTERY_TIME_DISCHARGE_DEFAULT          2800          // seconds from 100 to 0%
+#define BATTERY_STATE_OF_CHARGE_DEFAULT         50.0          // %
+
+typedef struct battery_param_struct
+{
+    float power_rating;                         // kW
+    float time_charge;                          // seconds to charge from 0 to 100%
+    float time_discharge;                       // seconds to discharge from 100 to 0%
+}battery_param_t;
+
+typedef struct battery_struct
+{
+    float   state_of_charge;                    // %
+    int32_t setpoint;                           // kW, negative charges the battery
+    bool    charging;
+    bool    discharging;
+    float   charge_increment;                   // % increase in charge per second
+    float   discharge_decrement;                // % decrease in charge per second
+    float   charge_resolution;                  // % increase in charge per kW per second
+    float   discharge_resolution;               // % decrease in charge per kW per second
+}battery_t;
+
+//
+// Public functions
+//
+void  battery_param_default(battery_param_t* param);
+void  battery_init(battery_t* battery, const battery_param_t* param);
+void  battery_configure(battery_t* battery, const battery_param_t* param);
+void  battery_reset(battery_t* battery);
+void  battery_setpoint(battery_t* battery, int32_t power);
+void  battery_tick(battery_t* battery, float seconds);
+
+#endif
@@ -0,0 +1,202 @@
+/*
+ * Copyright © kiwipower 2017
+ *
+ * battlog - converts the telemetry segments written by battsim -g.
+ *
+ * Segments are read in the order given, shell globs sort them already. The rows are printed as CSV, or
+ * with -f columns appended to one raw file per column, the layout the segments use, for tools that load
+ * columns straight into arrays. Rows still being written when the simulator stopped are skipped.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "telemetry.h"
+
+// Private data
+static const char* column_names[TelemetryColumnCount] =
+{
+    [TelemetryColumnTimestamp] = "timestamp",
+    [TelemetryColumnDevice]    = "device",
+    [TelemetryColumnKind]      = "event",
+    [TelemetryColumnState]     = "state",
+    [TelemetryColumnSetpoint]  = "setpoint",
+    [TelemetryColumnSoc]       = "soc",
+    [TelemetryColumnHeartbeat] = "heartbeat"
+};
+
+static void usage(const char *app_name);
+static const telemetry_header_t* _open(const char* filename, size_t* size);
+static void _csv(const telemetry_header_t* header, uint32_t row);
+
+
+static void usage(const char *app_name)
+{
+    printf("Usage:\n");
+    printf("%s [option <value>] ... <segment> ...\n", app_name);
+    printf("\nOptions:\n");
+    printf(" -f \t\t # Output format, csv or columns (Default csv)\n");
+    printf(" -o \t\t # Output prefix for -f columns, one file per column\n");
+    printf(" -d \t\t # Only the rows of this device (the modbus port)\n");
+    printf(" -h \t\t # Print this help menu\n");
+    printf("\nExamples:\n");
+    printf("%s fleet.*.tlm > fleet.csv \t # Every segment of the run as CSV\n", app_name);
+    printf("%s -f columns -o fleet fleet.*.tlm \t # fleet.timestamp, fleet.soc, ...\n\n", app_name);
+    exit(1);
+}
+
+const telemetry_header_t* _open(const char* filename, size_t* size)
+{
+    const telemetry_header_t *header;
+    struct stat st;
+    int fd, i;
+
+    fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if ( fd < 0 || fstat(fd, &st) != 0 )
+    {
+        printf("%s unable to open %s: %s\n", __PRETTY_FUNCTION__, filename, strerror(errno));
+        if ( fd >= 0 ) close(fd);
+        return NULL;
+    }
+    header = st.st_size >= (off_t)sizeof(telemetry_header_t) ?
+             mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+    close(fd);
+    if ( header == MAP_FAILED )
+    {
+        printf("%s %s is not a battsim telemetry segment\n", __PRETTY_FUNCTION__, filename);
+        return NULL;
+    }
+    *size = st.st_size;
+    for ( i = 0; i < TelemetryColumnCount; i++ )
+    {
+        if ( header->offset[i] + (uint64_t)header->capacity * header->width[i] > (uint64_t)st.st_size )
+        {
+            break;
+        }
+    }
+    if ( memcmp(header->magic, TELEMETRY_MAGIC, sizeof(header->magic)) != 0 ||
+         header->version != TELEMETRY_VERSION || i < TelemetryColumnCount )
+    {
+        printf("%s %s is not a battsim telemetry segment\n", __PRETTY_FUNCTION__, filename);
+        munmap((void*)header, st.st_size);
+        return NULL;
+    }
+    return header;
+}
+
+#define COLUMN(header, type, column, row) (((const type*)((const uint8_t*)(header) + (header)->offset[column]))[row])
+
+void _csv(const telemetry_header_t* header, uint32_t row)
+{
+    int64_t timestamp = COLUMN(header, int64_t, TelemetryColumnTimestamp, row);
+    int8_t state = COLUMN(header, int8_t, TelemetryColumnState, row);
+    float heartbeat = COLUMN(header, float, TelemetryColumnHeartbeat, row);
+
+    printf("%lld.%03lld,%u,%s,%d,%.4f,%s,", (long long)(timestamp / 1000000000),
+           (long long)(timestamp % 1000000000) / 1000000,
+           COLUMN(header, uint16_t, TelemetryColumnDevice, row),
+           COLUMN(header, uint8_t, TelemetryColumnKind, row) == TelemetrySetpoint ? "setpoint" : "tick",
+           COLUMN(header, int32_t, TelemetryColumnSetpoint, row),
+           COLUMN(header, float, TelemetryColumnSoc, row),
+           state > 0 ? "charging" : state < 0 ? "discharging" : "idle");
+    if ( heartbeat >= 0 )
+    {
+        printf("%.1f", heartbeat);
+    }
+    printf("\n");
+}
+
+int main(int argc, char* argv[])
+{
+    const telemetry_header_t *header;
+    const char *output = NULL;
+    FILE *fp[TelemetryColumnCount] = { NULL };
+    char filename[1024];
+    size_t size;
+    uint64_t rows = 0, dropped = 0;
+    uint32_t row, count;
+    int opt, i, f, device = -1;
+    int columns = 0;
+
+    while ((opt = getopt(argc, argv, "f:o:d:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'f':
+            if ( strcmp(optarg, "columns") == 0 ) columns = 1;
+            else if ( strcmp(optarg, "csv") != 0 ) usage(*argv);
+            break;
+        case 'o':
+            output = optarg;
+            break;
+        case 'd':
+            device = atoi(optarg);
+            break;
+        default:
+            usage(*argv);
+        }
+    }
+    if ( optind >= argc || (columns && output == NULL) )
+    {
+        usage(*argv);
+    }
+
+    if ( columns )
+    {
+        for ( i = 0; i < TelemetryColumnCount; i++ )
+        {
+            snprintf(filename, sizeof(filename), "%s.%s", output, column_names[i]);
+            fp[i] = fopen(filename, "wb");
+            if ( fp[i] == NULL )
+            {
+                printf("%s unable to open %s: %s\n", __PRETTY_FUNCTION__, filename, strerror(errno));
+                return 1;
+            }
+        }
+    }
+    else
+    {
+        printf("timestamp,device,event,setpoint,soc,state,heartbeat\n");
+    }
+    for ( f = optind; f < argc; f++ )
+    {
+        header = _open(argv[f], &size);
+        if ( header == NULL )
+        {
+            return 1;
+        }
+        count = header->rows < header->capacity ? header->rows : header->capacity;
+        dropped += header->dropped;
+        for ( row = 0; row < count; row++ )
+        {
+            if ( COLUMN(header, uint8_t, TelemetryColumnKind, row) == TelemetryNone ||
+                 (device >= 0 && COLUMN(header, uint16_t, TelemetryColumnDevice, row) != device) )
+            {
+                continue;
+            }
+            rows++;
+            if ( !columns )
+            {
+                _csv(header, row);
+                continue;
+            }
+            for ( i = 0; i < TelemetryColumnCount; i++ )
+            {
+                fwrite((const uint8_t*)header + header->offset[i] + (size_t)row * header->width[i],
+                       header->width[i], 1, fp[i]);
+            }
+        }
+        munmap((void*)header, size);
+    }
+    for ( i = 0; columns && i < TelemetryColumnCount; i++ )
+    {
+        fclose(fp[i]);
+    }
+    fprintf(stderr, "%llu rows, %llu dropped\n", (unsigned long long)rows, (unsigned long long)dropped);
+    return 0;
+}
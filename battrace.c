@@ -0,0 +1,135 @@
+/*
+ * Copyright © kiwipower 2017
+ *
+ * battrace - decodes a binary event trace written by battsim -x.
+ *
+ * Each thread's events are stored in order but threads are flushed independently, so the events of all
+ * threads are merged by timestamp before they are printed.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include "trace.h"
+
+static void usage(const char *app_name);
+static int  _compare(const void* a, const void* b);
+
+
+static void usage(const char *app_name)
+{
+    printf("Usage:\n");
+    printf("%s -f <trace> [option <value>] ...\n", app_name);
+    printf("\nOptions:\n");
+    printf(" -f \t\t # Trace written by battsim -x\n");
+    printf(" -e \t\t # Only print events with this id\n");
+    printf(" -n \t\t # Print the event counts per id instead of the events\n");
+    printf(" -h \t\t # Print this help menu\n");
+    printf("\nExamples:\n");
+    printf("%s -f battsim.trace -e 2 \t # Print the modbus requests only\n\n", app_name);
+    exit(1);
+}
+
+int _compare(const void* a, const void* b)
+{
+    const trace_event_t *x = a, *y = b;
+
+    if ( x->timestamp != y->timestamp )
+    {
+        return x->timestamp < y->timestamp ? -1 : 1;
+    }
+    return (int)x->thread - (int)y->thread;
+}
+
+int main(int argc, char* argv[])
+{
+    const char *filename = NULL;
+    trace_header_t header;
+    trace_event_t *events = NULL;
+    uint64_t counts[TraceEventCount + 1] = { 0 };
+    size_t count = 0, capacity = 0, i;
+    int opt, only = -1;
+    int summary = 0;
+    char line[160];
+    FILE *fp;
+
+    while ((opt = getopt(argc, argv, "f:e:n")) != -1)
+    {
+        switch (opt)
+        {
+        case 'f':
+            filename = optarg;
+            break;
+        case 'e':
+            only = atoi(optarg);
+            break;
+        case 'n':
+            summary = 1;
+            break;
+        default:
+            usage(*argv);
+        }
+    }
+    if ( filename == NULL )
+    {
+        usage(*argv);
+    }
+
+    fp = fopen(filename, "rb");
+    if ( fp == NULL )
+    {
+        printf("%s unable to open %s: %s\n", __PRETTY_FUNCTION__, filename, strerror(errno));
+        return 1;
+    }
+    if ( fread(&header, sizeof(header), 1, fp) != 1 ||
+         memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0 ||
+         header.version != TRACE_VERSION || header.event_size != sizeof(trace_event_t) )
+    {
+        printf("%s %s is not a battsim trace\n", __PRETTY_FUNCTION__, filename);
+        fclose(fp);
+        return 1;
+    }
+    for (;;)
+    {
+        if ( count == capacity )
+        {
+            trace_event_t *p;
+            capacity = capacity ? capacity * 2 : 65536;
+            p = realloc(events, capacity * sizeof(trace_event_t));
+            if ( p == NULL )
+            {
+                printf("%s out of memory\n", __PRETTY_FUNCTION__);
+                return 1;
+            }
+            events = p;
+        }
+        if ( fread(&events[count], sizeof(trace_event_t), 1, fp) != 1 )
+        {
+            break;
+        }
+        count++;
+    }
+    fclose(fp);
+
+    qsort(events, count, sizeof(trace_event_t), _compare);
+    for ( i = 0; i < count; i++ )
+    {
+        counts[events[i].id < TraceEventCount ? events[i].id : TraceEventCount]++;
+        if ( summary || (only >= 0 && events[i].id != only) )
+        {
+            continue;
+        }
+        trace_format(&events[i], line, sizeof(line));
+        puts(line);
+    }
+    if ( summary )
+    {
+        for ( i = 0; i <= TraceEventCount; i++ )
+        {
+            if ( counts[i] ) printf("%2zu %llu\n", i, (unsigned long long)counts[i]);
+        }
+    }
+    free(events);
+    return 0;
+}
@@ -0,0 +1,189 @@
+/*
+ * Copyright © kiwipower 2017
+ *
+ * battshm - reads the registers and battery state battsim -E exports in shared memory.
+ *
+ * The segment is mapped read only and read with the sequence protocol described in shmexport.h, the
+ * simulator never notices the reader. Each sample is printed as one CSV line: the time in ms, the state
+ * of charge, the set point and the registers asked for.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <time.h>
+#include <getopt.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "shmexport.h"
+
+#define BATTSHM_MAX_TRIES       1000000       // a writer that died half way leaves the sequence odd
+
+static void usage(const char *app_name);
+static const shmexport_header_t* _attach(const char* name);
+static int  _read(const shmexport_header_t* header, int offset, int quantity, uint16_t* registers);
+
+
+static void usage(const char *app_name)
+{
+    printf("Usage:\n");
+    printf("%s -n <segment> [option <value>] ...\n", app_name);
+    printf("\nOptions:\n");
+    printf(" -n \t\t # Segment given to battsim -E\n");
+    printf(" -a \t\t # First register (Default 0)\n");
+    printf(" -q \t\t # Number of registers (Default 8)\n");
+    printf(" -i \t\t # Sample every this many ms instead of once\n");
+    printf(" -c \t\t # Stop after this many samples\n");
+    printf(" -h \t\t # Print this help menu\n");
+    printf("\nExamples:\n");
+    printf("%s -n tesla -a 100 -q 4 -i 10 \t # Registers 100 to 103 a hundred times a second\n\n", app_name);
+    exit(1);
+}
+
+//
+// Maps the segment read only and checks it holds a register map this build understands
+//
+const shmexport_header_t* _attach(const char* name)
+{
+    const shmexport_header_t *header;
+    struct stat st;
+    char path[256];
+    int fd;
+
+    snprintf(path, sizeof(path), "%s%s", name[0] == '/' ? "" : "/", name);
+    fd = shm_open(path, O_RDONLY | O_CLOEXEC, 0);
+    if ( fd < 0 || fstat(fd, &st) != 0 )
+    {
+        printf("%s unable to open %s: %s\n", __PRETTY_FUNCTION__, path, strerror(errno));
+        if ( fd >= 0 ) close(fd);
+        return NULL;
+    }
+    header = st.st_size >= (off_t)sizeof(shmexport_header_t) ?
+             mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+    close(fd);
+    if ( header == MAP_FAILED || memcmp(header->magic, SHMEXPORT_MAGIC, sizeof(header->magic)) != 0 ||
+         header->version != SHMEXPORT_VERSION || header->battery_size != sizeof(battery_t) ||
+         header->header_size + header->nb_registers * sizeof(uint16_t) > (size_t)st.st_size )
+    {
+        printf("%s %s is not a battsim register export\n", __PRETTY_FUNCTION__, path);
+        return NULL;
+    }
+    return header;
+}
+
+//
+// Copies quantity registers from offset, again until no write overlapped the copy. Returns -1 if the
+// sequence stays odd
+//
+int _read(const shmexport_header_t* header, int offset, int quantity, uint16_t* registers)
+{
+    const uint32_t *sequence = (const uint32_t*)((const uint8_t*)header + header->sequence_offset);
+    const uint16_t *map = (const uint16_t*)((const uint8_t*)header + header->header_size);
+    uint32_t before;
+    int tries;
+
+    for ( tries = 0; tries < BATTSHM_MAX_TRIES; tries++ )
+    {
+        before = __atomic_load_n(sequence, __ATOMIC_ACQUIRE);
+        if ( before & 1 )
+        {
+            sched_yield();
+            continue;
+        }
+        memcpy(registers, map + offset, quantity * sizeof(uint16_t));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if ( __atomic_load_n(sequence, __ATOMIC_RELAXED) == before )
+        {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+int main(int argc, char* argv[])
+{
+    const shmexport_header_t *header;
+    const char *name = NULL;
+    uint16_t *registers;
+    struct timespec ts;
+    long interval = 0, count = -1, sample;
+    int opt, i, address = 0, quantity = 8;
+
+    while ((opt = getopt(argc, argv, "n:a:q:i:c:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'n':
+            name = optarg;
+            break;
+        case 'a':
+            address = atoi(optarg);
+            break;
+        case 'q':
+            quantity = atoi(optarg);
+            break;
+        case 'i':
+            interval = atol(optarg);
+            break;
+        case 'c':
+            count = atol(optarg);
+            break;
+        default:
+            usage(*argv);
+        }
+    }
+    if ( name == NULL || quantity < 1 )
+    {
+        usage(*argv);
+    }
+    header = _attach(name);
+    if ( header == NULL )
+    {
+        return 1;
+    }
+    if ( address < (int)header->start_registers ||
+         address + quantity > (int)(header->start_registers + header->nb_registers) )
+    {
+        printf("%s registers %d to %d are outside the map\n", __PRETTY_FUNCTION__, address, address + quantity - 1);
+        return 1;
+    }
+    if ( kill(header->pid, 0) != 0 && errno == ESRCH )
+    {
+        printf("%s the %s simulator that wrote %s has exited\n", __PRETTY_FUNCTION__, header->target, name);
+    }
+    registers = malloc(quantity * sizeof(uint16_t));
+    if ( registers == NULL )
+    {
+        return 1;
+    }
+
+    for ( sample = 0; count < 0 ? interval > 0 || sample == 0 : sample < count; sample++ )
+    {
+        if ( _read(header, address - header->start_registers, quantity, registers) != 0 )
+        {
+            printf("%s the register map stays locked\n", __PRETTY_FUNCTION__);
+            return 1;
+        }
+        clock_gettime(CLOCK_REALTIME, &ts);
+        printf("%lld,%.4f,%d", (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000,
+               header->battery.state_of_charge, header->battery.setpoint);
+        for ( i = 0; i < quantity; i++ )
+        {
+            printf(",%u", registers[i]);
+        }
+        printf("\n");
+        fflush(stdout);
+        if ( interval > 0 )
+        {
+            ts.tv_sec = interval / 1000;
+            ts.tv_nsec = (interval % 1000) * 1000000;
+            nanosleep(&ts, NULL);
+        }
+    }
+    free(registers);
+    return 0;
+}
@@ -0,0 +1,223 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+#include <unistd.h>
+#include "bench.h"
+
+#define BENCH_MAX_BASELINE      64
+
+typedef struct baseline_struct
+{
+    char   name[64];
+    double ns_per_op;
+    int    threshold;                           // % slower that fails, 0 = the -t default
+}baseline_t;
+
+// Private data
+static const bench_t benches[] =
+{
+    { "query_read",              bench_query_read },
+    { "query_write",             bench_query_write },
+    { "query_write_multiple",    bench_query_write_multiple },
+    { "query_write_read",        bench_query_write_read },
+    { "tesla_write_multiple",    bench_tesla_write_multiple },
+    { "nec_write_multiple",      bench_nec_write_multiple },
+    { "queue_contention",        bench_queue_contention },
+    { "parse_json_single",       bench_parse_json_single },
+    { "parse_json_multiple",     bench_parse_json_multiple },
+    { "parse_binary_multiple",   bench_parse_binary_multiple },
+    { "soc_tick",                bench_soc_tick }
+};
+
+static baseline_t baseline[BENCH_MAX_BASELINE];
+static int baseline_count = 0;
+
+static void        usage(const char *app_name);
+static int         _load(const char* filename);
+static baseline_t* _find(const char* name);
+static double      _measure(const bench_t* bench, uint64_t* iterations);
+
+
+uint64_t bench_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void usage(const char *app_name)
+{
+    printf("Usage:\n");
+    printf("%s [option <value>] ...\n", app_name);
+    printf("\nOptions:\n");
+    printf(" -b \t\t # Baseline to compare with, a run slower than the threshold exits with 1\n");
+    printf(" -w \t\t # Write the results as a new baseline\n");
+    printf(" -t \t\t # Threshold in %% slower than the baseline (Default %d)\n", BENCH_THRESHOLD);
+    printf(" -d \t\t # Directory holding the test readings JSON (Default .)\n");
+    printf(" -f \t\t # Only run benchmarks whose name contains this string\n");
+    printf(" -h \t\t # Print this help menu\n");
+    printf("\nExamples:\n");
+    printf("%s -b bench/baseline.csv \t # Compare with the stored baseline\n", app_name);
+    printf("%s -w bench/baseline.csv \t # Record a new baseline on this machine\n\n", app_name);
+    exit(1);
+}
+
+//
+// Baseline lines are "<benchmark>,<ns per op>[,<threshold %>]", # starts a comment
+//
+int _load(const char* filename)
+{
+    FILE *fp = fopen(filename, "r");
+    char line[256];
+    baseline_t *b;
+
+    if ( fp == NULL )
+    {
+        printf("%s unable to open %s\n", __PRETTY_FUNCTION__, filename);
+        return -1;
+    }
+    while ( fgets(line, sizeof(line), fp) && baseline_count < BENCH_MAX_BASELINE )
+    {
+        b = &baseline[baseline_count];
+        b->threshold = 0;
+        if ( line[0] != '#' && sscanf(line, "%63[^,],%lf,%d", b->name, &b->ns_per_op, &b->threshold) >= 2 )
+        {
+            baseline_count++;
+        }
+    }
+    fclose(fp);
+    return 0;
+}
+
+baseline_t* _find(const char* name)
+{
+    int i;
+
+    for ( i = 0; i < baseline_count; i++ )
+    {
+        if ( strcmp(baseline[i].name, name) == 0 )
+        {
+            return &baseline[i];
+        }
+    }
+    return NULL;
+}
+
+//
+// Grows the iteration count until a run lasts BENCH_MIN_TIME, then keeps the fastest of BENCH_REPEAT runs
+//
+double _measure(const bench_t* bench, uint64_t* iterations)
+{
+    uint64_t n = 1, elapsed;
+    double best = 0, ns;
+    int i;
+
+    while ( (elapsed = bench->run(n)) < BENCH_MIN_TIME )
+    {
+        n = elapsed < BENCH_MIN_TIME / 100 ? n * 10 : n * BENCH_MIN_TIME / (elapsed ? elapsed : 1) + 1;
+    }
+    for ( i = 0; i < BENCH_REPEAT; i++ )
+    {
+        ns = (double)bench->run(n) / n;
+        if ( i == 0 || ns < best ) best = ns;
+    }
+    *iterations = n;
+    return best;
+}
+
+/*
+***************************************************************************************************************
+ \fn      main(int argc, char* argv[])
+ \brief   runs the hot path microbenchmarks and compares them with a baseline
+
+ Prints one CSV line per benchmark: name, iterations per measurement, nanoseconds per operation, the baseline,
+ the change in % and ok, regressed or new. A baseline is only meaningful on the machine and build it was
+ recorded with, record a fresh one with -w after changing either.
+**************************************************************************************************************
+*/
+int main(int argc, char* argv[])
+{
+    const char *compare = NULL, *output = NULL, *directory = ".", *filter = NULL;
+    int opt, i, threshold = BENCH_THRESHOLD, regressed = 0;
+    uint64_t iterations;
+    double ns, change;
+    baseline_t *b;
+    FILE *fp = NULL;
+
+    while ((opt = getopt(argc, argv, "b:w:t:d:f:h")) != -1)
+    {
+        switch (opt)
+        {
+        case 'b':
+            compare = optarg;
+            break;
+        case 'w':
+            output = optarg;
+            break;
+        case 't':
+            threshold = atoi(optarg);
+            break;
+        case 'd':
+            directory = optarg;
+            break;
+        case 'f':
+            filter = optarg;
+            break;
+        default:
+            usage(*argv);
+        }
+    }
+    if ( compare && _load(compare) != 0 )
+    {
+        return 2;
+    }
+    if ( output && compare == NULL && access(output, R_OK) == 0 )
+    {
+        _load(output);                        // keeps the per benchmark thresholds of the baseline it replaces
+    }
+    if ( output && (fp = fopen(output, "w")) == NULL )
+    {
+        printf("unable to create %s\n", output);
+        return 2;
+    }
+    bench_query_init();
+    if ( bench_json_init(directory) != 0 )
+    {
+        return 2;
+    }
+
+    if ( fp ) fprintf(fp, "# benchmark,ns_per_op[,threshold %%]\n");
+    printf("benchmark,iterations,ns_per_op,baseline_ns,change_pct,result\n");
+    for ( i = 0; i < sizeof(benches) / sizeof(benches[0]); i++ )
+    {
+        if ( filter && strstr(benches[i].name, filter) == NULL )
+        {
+            continue;
+        }
+        ns = _measure(&benches[i], &iterations);
+        b = _find(benches[i].name);
+        if ( b == NULL )
+        {
+            printf("%s,%llu,%.1f,,,new\n", benches[i].name, (unsigned long long)iterations, ns);
+        }
+        else
+        {
+            change = (ns - b->ns_per_op) * 100.0 / b->ns_per_op;
+            if ( compare && change > (b->threshold ? b->threshold : threshold) )
+            {
+                regressed++;
+            }
+            printf("%s,%llu,%.1f,%.1f,%+.1f,%s\n", benches[i].name, (unsigned long long)iterations, ns,
+                   b->ns_per_op, change, change > (b->threshold ? b->threshold : threshold) ? "regressed" : "ok");
+        }
+        if ( fp )
+        {
+            fprintf(fp, b && b->threshold ? "%s,%.1f,%d\n" : "%s,%.1f\n", benches[i].name, ns, b ? b->threshold : 0);
+        }
+        fflush(stdout);
+    }
+    if ( fp ) fclose(fp);
+    return regressed ? 1 : 0;
+}
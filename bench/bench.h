@@ -0,0 +1,45 @@
+/*
+ * Copyright © kiwipower 2017
+ *
+ * Header file for the hot path microbenchmarks
+ */
+#ifndef BENCH_DOT_H
+#define BENCH_DOT_H
+
+#include <stdint.h>
+
+#define BENCH_MIN_TIME          50000000ULL   // nanoseconds a measurement lasts at least
+#define BENCH_REPEAT            5             // measurements per benchmark, the fastest is reported
+#define BENCH_THRESHOLD         25            // % slower than the baseline that fails
+
+//
+// One benchmark: run() performs iterations operations and returns the nanoseconds they took
+//
+typedef struct bench_struct
+{
+    const char *name;
+    uint64_t  (*run)(uint64_t iterations);
+}bench_t;
+
+//
+// Public functions
+//
+uint64_t bench_now();
+
+void     bench_query_init();
+uint64_t bench_query_read(uint64_t iterations);
+uint64_t bench_query_write(uint64_t iterations);
+uint64_t bench_query_write_multiple(uint64_t iterations);
+uint64_t bench_query_write_read(uint64_t iterations);
+uint64_t bench_tesla_write_multiple(uint64_t iterations);
+uint64_t bench_nec_write_multiple(uint64_t iterations);
+uint64_t bench_soc_tick(uint64_t iterations);
+
+uint64_t bench_queue_contention(uint64_t iterations);
+
+int      bench_json_init(const char* directory);
+uint64_t bench_parse_json_single(uint64_t iterations);
+uint64_t bench_parse_json_multiple(uint64_t iterations);
+uint64_t bench_parse_binary_multiple(uint64_t iterations);
+
+#endif
@@ -0,0 +1,130 @@
+//
+// The ENGIENL readings parsers. engienl.c is compiled in so the static _parse_json() can be called directly,
+// the binary decoder runs on the same readings as multiple_test_readings.json.
+//
+#include "../engienl.c"
+
+#include "bench.h"
+
+#define BENCH_SINGLE_READINGS   "single_test_readings.json"
+#define BENCH_MULTIPLE_READINGS "multiple_test_readings.json"
+#define BENCH_BINARY_READINGS   9             // records in multiple_test_readings.json
+
+// Private data
+static battery_t bench_battery;
+static char *single_readings = NULL;
+static char *multiple_readings = NULL;
+static uint8_t binary_readings[READINGS_HEADER_SIZE + BENCH_BINARY_READINGS * READINGS_RECORD_SIZE];
+
+static char*    _read(const char* directory, const char* filename);
+static uint64_t _parse(const char* readings, uint64_t iterations);
+static void     _put(uint8_t* p, uint64_t value, int bytes);
+
+
+char* _read(const char* directory, const char* filename)
+{
+    char path[MAX_PATH];
+    FILE *fp;
+    long size;
+    char *buf;
+
+    snprintf(path, sizeof(path), "%s/%s", directory, filename);
+    fp = fopen(path, "r");
+    if ( fp == NULL )
+    {
+        printf("%s unable to open %s\n", __PRETTY_FUNCTION__, path);
+        return NULL;
+    }
+    fseek(fp, 0, SEEK_END);
+    size = ftell(fp);
+    rewind(fp);
+    buf = malloc(size + 1);
+    if ( buf && fread(buf, 1, size, fp) == size )
+    {
+        buf[size] = '\0';
+    }
+    else
+    {
+        free(buf);
+        buf = NULL;
+    }
+    fclose(fp);
+    return buf;
+}
+
+void _put(uint8_t* p, uint64_t value, int bytes)
+{
+    while ( bytes-- )
+    {
+        p[bytes] = value;
+        value >>= 8;
+    }
+}
+
+int bench_json_init(const char* directory)
+{
+    uint8_t *record = binary_readings + READINGS_HEADER_SIZE;
+    int i;
+
+    memcpy(binary_readings, READINGS_MAGIC, 4);
+    _put(binary_readings + 4, BENCH_BINARY_READINGS, 4);
+    for ( i = 0; i < BENCH_BINARY_READINGS; i++, record += READINGS_RECORD_SIZE )
+    {
+        _put(record, 1512049649158ULL + i, 8);
+        _put(record + 8, 58217, 4);
+        _put(record + 12, (10 + i) * 100, 2);
+        _put(record + 14, 0, 2);
+    }
+    battery = &bench_battery;
+    single_readings = _read(directory, BENCH_SINGLE_READINGS);
+    multiple_readings = _read(directory, BENCH_MULTIPLE_READINGS);
+    return single_readings && multiple_readings ? 0 : -1;
+}
+
+uint64_t _parse(const char* readings, uint64_t iterations)
+{
+    uint64_t i, start;
+
+    reading_t reading;
+
+    start = bench_now();
+    for ( i = 0; i < iterations; i++ )
+    {
+        _parse_json(readings, &reading);
+    }
+    return bench_now() - start;
+}
+
+uint64_t bench_parse_json_single(uint64_t iterations)
+{
+    return _parse(single_readings, iterations);
+}
+
+uint64_t bench_parse_json_multiple(uint64_t iterations)
+{
+    return _parse(multiple_readings, iterations);
+}
+
+//
+// What the ingest endpoint does with a binary upload: check it, then decode every record in place
+//
+uint64_t bench_parse_binary_multiple(uint64_t iterations)
+{
+    volatile float soc = 0;
+    reading_t reading;
+    uint64_t i, start;
+    int j, count;
+
+    start = bench_now();
+    for ( i = 0; i < iterations; i++ )
+    {
+        count = readings_count(binary_readings, sizeof(binary_readings));
+        for ( j = 0; j < count; j++ )
+        {
+            readings_decode(binary_readings, sizeof(binary_readings), j, &reading);
+            soc = reading.state_of_charge;
+        }
+    }
+    (void)soc;
+    return bench_now() - start;
+}
@@ -0,0 +1,158 @@
+//
+// Benchmarks that drive the simulator the way the modbus loop does. main.c is compiled in so query_handler()
+// runs against the real vendor function pointers, register map and reply path.
+//
+#define main battsim_main
+#include "../main.c"
+#undef main
+
+#include <pthread.h>
+#include "bench.h"
+
+#define BENCH_BLOCK_QUANTITY    100           // registers in the write multiple benchmarks
+#define BENCH_BLOCK_ADDRESS     100           // a TESLA range without computed registers
+
+// Private data
+static int sockets[2];
+static pthread_t drain_thread;
+
+static const uint8_t read_request[] =         // FC 0x03, 10 registers from realMode
+    { 0x00, 0x01, 0x00, 0x00, 0x00, 0x06, 0xff, 0x03, 0x03, 0xe8, 0x00, 0x0a };
+static const uint8_t write_request[] =        // FC 0x06, alwaysActive = 1
+    { 0x00, 0x01, 0x00, 0x00, 0x00, 0x06, 0xff, 0x06, 0x03, 0xe9, 0x00, 0x01 };
+static const uint8_t write_multiple_request[] = // FC 0x10, directPower = 100 kW
+    { 0x00, 0x01, 0x00, 0x00, 0x00, 0x0b, 0xff, 0x10, 0x03, 0xfc, 0x00, 0x02, 0x04, 0x00, 0x00, 0x00, 0x64 };
+static const uint8_t write_read_request[] =   // FC 0x17, directPower = 100 kW then 10 registers from realMode
+    { 0x00, 0x01, 0x00, 0x00, 0x00, 0x0f, 0xff, 0x17, 0x03, 0xe8, 0x00, 0x0a, 0x03, 0xfc, 0x00, 0x02, 0x04,
+      0x00, 0x00, 0x00, 0x64 };
+
+static void*    _drain(void* ptr);
+static uint64_t _query(const uint8_t* request, int length, uint64_t iterations);
+
+
+//
+// Reads and discards the replies so the socket never fills up
+//
+void* _drain(void* ptr)
+{
+    uint8_t buf[4096];
+
+    while ( read(sockets[1], buf, sizeof(buf)) > 0 )
+    ;
+    return NULL;
+}
+
+void bench_query_init()
+{
+    init = tesla_init;
+    dispose = tesla_dispose;
+    disconnect = tesla_disconnect;
+    process_handler = tesla_process_single_register;
+    process_read_registers = tesla_read_registers;
+    process_write_multiple_addresses = tesla_write_multiple_addresses;
+    target_name = "TESLA";
+
+    param.battery = &battery;
+    param.device = &device;
+    param.headless = true;                    // nothing ticks behind the benchmark's back
+    battery_param_default(&param.battery_param);
+    modbus_mem_init(-1);
+    regmap_shadow(param.modbus_mapping);      // reads are sent from the shadow, as when serving
+    nec_init(&param);                         // for nec_write_multiple_addresses()
+    init(&param);
+
+    param.ctx = modbus_new_tcp("127.0.0.1", MODBUS_DEFAULT_PORT);
+    if ( param.ctx == NULL || socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) != 0 )
+    {
+        printf("%s unable to create the reply socket\n", __PRETTY_FUNCTION__);
+        exit(2);
+    }
+    modbus_set_socket(param.ctx, sockets[0]);
+    pthread_create(&drain_thread, NULL, _drain, NULL);
+}
+
+uint64_t _query(const uint8_t* request, int length, uint64_t iterations)
+{
+    uint8_t buf[MODBUS_TCP_MAX_ADU_LENGTH];
+    uint64_t i, start;
+
+    start = bench_now();
+    for ( i = 0; i < iterations; i++ )
+    {
+        memcpy(buf, request, length);        // modbus_receive() hands over a fresh buffer too
+        query_handler((modbus_pdu_t*)buf);
+    }
+    return bench_now() - start;
+}
+
+uint64_t bench_query_read(uint64_t iterations)
+{
+    return _query(read_request, sizeof(read_request), iterations);
+}
+
+uint64_t bench_query_write(uint64_t iterations)
+{
+    return _query(write_request, sizeof(write_request), iterations);
+}
+
+uint64_t bench_query_write_multiple(uint64_t iterations)
+{
+    return _query(write_multiple_request, sizeof(write_multiple_request), iterations);
+}
+
+uint64_t bench_query_write_read(uint64_t iterations)
+{
+    return _query(write_read_request, sizeof(write_read_request), iterations);
+}
+
+uint64_t bench_tesla_write_multiple(uint64_t iterations)
+{
+    uint8_t data[BENCH_BLOCK_QUANTITY * 2];
+    uint64_t i, start;
+
+    for ( i = 0; i < sizeof(data); i++ ) data[i] = i;
+    start = bench_now();
+    for ( i = 0; i < iterations; i++ )
+    {
+        tesla_write_multiple_addresses(BENCH_BLOCK_ADDRESS, BENCH_BLOCK_QUANTITY, data);
+    }
+    return bench_now() - start;
+}
+
+//
+// The whole NEC control block, every register goes through its handler after the copy
+//
+uint64_t bench_nec_write_multiple(uint64_t iterations)
+{
+    const uint16_t quantity = ackalarams - RealPowerSetPoint + 1;
+    uint8_t data[(ackalarams - RealPowerSetPoint + 1) * 2];
+    uint64_t i, start;
+
+    memset(data, 0, sizeof(data));
+    start = bench_now();
+    for ( i = 0; i < iterations; i++ )
+    {
+        nec_write_multiple_addresses(RealPowerSetPoint, quantity, data);
+    }
+    return bench_now() - start;
+}
+
+//
+// One 100 ms tesla_tick() with the battery discharging, refilled before it runs empty
+//
+uint64_t bench_soc_tick(uint64_t iterations)
+{
+    uint64_t i, start;
+
+    start = bench_now();
+    for ( i = 0; i < iterations; i++ )
+    {
+        if ( (i & 1023) == 0 )
+        {
+            battery.state_of_charge = BATTERY_STATE_OF_CHARGE_DEFAULT;
+            battery_setpoint(&battery, 100);
+        }
+        tesla_tick(0.1);
+    }
+    return bench_now() - start;
+}
@@ -0,0 +1,80 @@
+//
+// The uplink queue as curl_handler.c uses it: producers push under the mutex, one consumer pops under it
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "../queue.h"
+#include "bench.h"
+
+#define BENCH_PRODUCERS         4
+
+typedef struct producer_struct
+{
+    link_t  *items;
+    uint64_t count;
+}producer_t;
+
+// Private data
+static queue_t queue;
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void* _produce(void* ptr);
+
+
+void* _produce(void* ptr)
+{
+    producer_t *producer = (producer_t*)ptr;
+    uint64_t i;
+
+    for ( i = 0; i < producer->count; i++ )
+    {
+        producer->items[i].next = NULL;
+        pthread_mutex_lock(&mutex);
+        queue_item_push(&queue, &producer->items[i]);
+        pthread_mutex_unlock(&mutex);
+    }
+    return NULL;
+}
+
+//
+// iterations items pushed by BENCH_PRODUCERS threads and popped by the calling thread
+//
+uint64_t bench_queue_contention(uint64_t iterations)
+{
+    pthread_t threads[BENCH_PRODUCERS];
+    producer_t producers[BENCH_PRODUCERS];
+    link_t *items = malloc(sizeof(link_t) * (iterations + BENCH_PRODUCERS));
+    uint64_t popped = 0, start, elapsed, per_thread = (iterations + BENCH_PRODUCERS - 1) / BENCH_PRODUCERS;
+    int i;
+
+    if ( items == NULL )
+    {
+        printf("%s out of memory\n", __PRETTY_FUNCTION__);
+        exit(2);
+    }
+    queue_item_init(&queue);
+    start = bench_now();
+    for ( i = 0; i < BENCH_PRODUCERS; i++ )
+    {
+        producers[i].items = items + i * per_thread;
+        producers[i].count = per_thread;
+        pthread_create(&threads[i], NULL, _produce, &producers[i]);
+    }
+    while ( popped < per_thread * BENCH_PRODUCERS )
+    {
+        pthread_mutex_lock(&mutex);
+        if ( queue_item_pop(&queue) )
+        {
+            popped++;
+        }
+        pthread_mutex_unlock(&mutex);
+    }
+    elapsed = bench_now() - start;
+    for ( i = 0; i < BENCH_PRODUCERS; i++ )
+    {
+        pthread_join(threads[i], NULL);
+    }
+    free(items);
+    return elapsed;
+}
@@ -0,0 +1,182 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include "checkpoint.h"
+#include "typedefs.h"
+
+// Private data
+static checkpoint_header_t *header = NULL;
+static modbus_mapping_t *mb_mapping = NULL;
+static size_t map_size = 0;
+
+static size_t _page_align(size_t size);
+static void   _reset(const char* target, int nb_registers, int defaults);
+
+
+size_t _page_align(size_t size)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    return (size + page - 1) & ~(page - 1);
+}
+
+//
+// Starts a fresh checkpoint, the registers from the defaults image (see regstore_defaults()) if any
+//
+void _reset(const char* target, int nb_registers, int defaults)
+{
+    uint16_t *registers = (uint16_t*)((uint8_t*)header + _page_align(sizeof(checkpoint_header_t)));
+
+    header->valid = 0;
+    memset(registers, 0, nb_registers * sizeof(uint16_t));
+    if ( defaults >= 0 && pread(defaults, registers, nb_registers * sizeof(uint16_t), 0) < 0 )
+    {
+        printf("%s unable to read the register defaults: %s\n", __PRETTY_FUNCTION__, strerror(errno));
+    }
+    memset(header, 0, sizeof(checkpoint_header_t));
+    memcpy(header->magic, CHECKPOINT_MAGIC, sizeof(header->magic));
+    header->version = CHECKPOINT_VERSION;
+    header->nb_registers = nb_registers;
+    header->battery_size = sizeof(battery_t);
+    strncpy(header->target, target, sizeof(header->target) - 1);
+}
+
+/*
+***************************************************************************************************************
+ \fn      checkpoint_open(const char* filename, const char* target, int nb_registers, int defaults)
+ \brief   maps the checkpoint file and returns the holding register map stored in it
+
+ The file is mapped shared. The register map, the battery state (see checkpoint_battery()) and the device
+ state (see checkpoint_device()) live in it,
+ so every write to them is part of the checkpoint, with no copy and no system call. The page cache
+ keeps the state across a crash or a supervisor restart, and the kernel writes it back to disk in the
+ background. Starting up is an mmap() and a header check.
+
+ A file written by another simulator, a different register count or an older layout is started afresh.
+
+ \note    defaults is a file descriptor from regstore_defaults() or -1, only used for a fresh checkpoint
+**************************************************************************************************************
+*/
+modbus_mapping_t* checkpoint_open(const char* filename, const char* target, int nb_registers, int defaults)
+{
+    size_t offset = _page_align(sizeof(checkpoint_header_t));
+    int fd;
+
+    map_size = offset + _page_align(nb_registers * sizeof(uint16_t));
+    fd = open(filename, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if ( fd < 0 || ftruncate(fd, map_size) != 0 )
+    {
+        printf("%s unable to open %s: %s\n", __PRETTY_FUNCTION__, filename, strerror(errno));
+        if ( fd >= 0 ) close(fd);
+        return NULL;
+    }
+    header = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if ( header == MAP_FAILED )
+    {
+        header = NULL;
+        return NULL;
+    }
+
+    if ( memcmp(header->magic, CHECKPOINT_MAGIC, sizeof(header->magic)) != 0 ||
+         header->version != CHECKPOINT_VERSION ||
+         header->nb_registers != (uint32_t)nb_registers ||
+         header->battery_size != sizeof(battery_t) ||
+         strncmp(header->target, target, sizeof(header->target) - 1) != 0 )
+    {
+        printf("%s %s does not hold %s state, starting afresh\n", __PRETTY_FUNCTION__, filename, target);
+        _reset(target, nb_registers, defaults);
+    }
+
+    mb_mapping = calloc(1, sizeof(modbus_mapping_t));
+    if ( mb_mapping == NULL )
+    {
+        checkpoint_close();
+        return NULL;
+    }
+    mb_mapping->start_registers = 0;
+    mb_mapping->nb_registers = nb_registers;
+    mb_mapping->tab_registers = (uint16_t*)((uint8_t*)header + offset);
+    return mb_mapping;
+}
+
+battery_t* checkpoint_battery()
+{
+    return header ? &header->battery : NULL;
+}
+
+device_state_t* checkpoint_device()
+{
+    return header ? &header->device : NULL;
+}
+
+//
+// Called before the simulator initialises, which resets the battery and the device state. Keeps a copy of
+// the state to resume and returns false when there is none
+//
+bool checkpoint_begin(battery_t* saved, device_state_t* saved_device)
+{
+    if ( header == NULL || !header->valid )
+    {
+        return false;
+    }
+    memcpy(saved, &header->battery, sizeof(battery_t));
+    memcpy(saved_device, &header->device, sizeof(device_state_t));
+    return true;
+}
+
+//
+// Called once the simulator has initialised. Replays the debug and dispatch registers so the simulator
+// rebuilds the state it derives from them, then puts the battery and the device state, the set point
+// and heartbeat timeout last written among others, back where they were
+//
+void checkpoint_restore(const battery_t* saved, const device_state_t* saved_device, uint16_t dispatch_address,
+                        int (*process_handler)(uint16_t, uint16_t))
+{
+    if ( header == NULL )
+    {
+        return;
+    }
+    if ( saved )
+    {
+        process_handler(enableDebugTrace, mb_mapping->tab_registers[enableDebugTrace]);
+        if ( dispatch_address )
+        {
+            process_handler(dispatch_address, mb_mapping->tab_registers[dispatch_address]);
+        }
+        battery_setpoint(&header->battery, saved->setpoint);  // increments from the current parameters
+        header->battery.state_of_charge = saved->state_of_charge;
+        header->battery.charging = saved->charging;
+        header->battery.discharging = saved->discharging;
+        memcpy(&header->device, saved_device, sizeof(device_state_t));
+        printf("%s resumed %s at %.2f%% SoC, set point %d kW\n", __PRETTY_FUNCTION__, header->target,
+               header->battery.state_of_charge, header->battery.setpoint);
+    }
+    header->valid = 1;
+}
+
+//
+// Schedules the write back of the whole checkpoint, without waiting for it
+//
+void checkpoint_sync()
+{
+    if ( header )
+    {
+        msync(header, map_size, MS_ASYNC);
+    }
+}
+
+void checkpoint_close()
+{
+    if ( header )
+    {
+        msync(header, map_size, MS_SYNC);
+        munmap(header, map_size);
+        header = NULL;
+    }
+    free(mb_mapping);
+    mb_mapping = NULL;
+}
@@ -0,0 +1,45 @@
+/*
+ * Copyright © kiwipower 2017
+ *
+ * Header file for the memory mapped simulator state checkpoint
+ */
+#ifndef CHECKPOINT_DOT_H
+#define CHECKPOINT_DOT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <modbus/modbus.h>
+#include "battery.h"
+#include "typedefs.h"
+
+#define CHECKPOINT_MAGIC        "BSIMCKP1"
+#define CHECKPOINT_VERSION      2
+
+//
+// First page of the checkpoint file, the register map follows on the next page
+//
+typedef struct checkpoint_header_struct
+{
+    char     magic[8];
+    uint32_t version;
+    uint32_t nb_registers;
+    uint32_t battery_size;                      // sizeof(battery_t), catches a layout change
+    uint32_t valid;                             // non zero once a simulator has initialised the state
+    char     target[32];                        // simulator the state belongs to
+    battery_t battery;                          // live model state, updated in place
+    device_state_t device;                      // heartbeat and set point state, updated in place
+}checkpoint_header_t;
+
+//
+// Public functions
+//
+modbus_mapping_t* checkpoint_open(const char* filename, const char* target, int nb_registers, int defaults);
+battery_t*        checkpoint_battery();
+device_state_t*   checkpoint_device();
+bool              checkpoint_begin(battery_t* saved, device_state_t* saved_device);
+void              checkpoint_restore(const battery_t* saved, const device_state_t* saved_device, uint16_t dispatch_address,
+                                     int (*process_handler)(uint16_t, uint16_t));
+void              checkpoint_sync();
+void              checkpoint_close();
+
+#endif
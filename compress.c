@@ -0,0 +1,208 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdbool.h>
+#include <zlib.h>
+#ifdef BATTSIM_ZSTD
+#include <zstd.h>
+#endif
+#include "compress.h"
+
+#define COMPRESS_GZIP_LEVEL     9             // bodies are small, the metered link costs more than the CPU
+#define COMPRESS_ZSTD_LEVEL     19
+
+// Private data, the uplink thread is the only user
+static z_stream gzip;
+static bool gzip_ready = false;
+#ifdef BATTSIM_ZSTD
+static ZSTD_CCtx *zstd = NULL;
+#endif
+static uint8_t *buffer = NULL;                  // output, grown to the largest body so far
+static size_t capacity = 0;
+
+static uint8_t* _reserve(size_t size);
+static int      _gzip(const uint8_t* data, int length);
+static int      _zstd(const uint8_t* data, int length);
+
+
+uint8_t* _reserve(size_t size)
+{
+    uint8_t *p;
+
+    if ( size > capacity )
+    {
+        p = realloc(buffer, size);
+        if ( p == NULL )
+        {
+            return NULL;
+        }
+        buffer = p;
+        capacity = size;
+    }
+    return buffer;
+}
+
+//
+// One gzip member per body, the deflate state is reset rather than rebuilt
+//
+int _gzip(const uint8_t* data, int length)
+{
+    if ( !gzip_ready )
+    {
+        if ( deflateInit2(&gzip, COMPRESS_GZIP_LEVEL, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK )
+        {
+            printf("%s deflateInit2 failed\n", __PRETTY_FUNCTION__);
+            return -1;
+        }
+        gzip_ready = true;
+    }
+    else
+    {
+        deflateReset(&gzip);
+    }
+    if ( _reserve(deflateBound(&gzip, length)) == NULL )
+    {
+        return -1;
+    }
+    gzip.next_in = (Bytef*)data;
+    gzip.avail_in = length;
+    gzip.next_out = buffer;
+    gzip.avail_out = capacity;
+    if ( deflate(&gzip, Z_FINISH) != Z_STREAM_END )
+    {
+        return -1;
+    }
+    return gzip.total_out;
+}
+
+int _zstd(const uint8_t* data, int length)
+{
+#ifdef BATTSIM_ZSTD
+    size_t n;
+
+    if ( zstd == NULL && (zstd = ZSTD_createCCtx()) == NULL )
+    {
+        return -1;
+    }
+    if ( _reserve(ZSTD_compressBound(length)) == NULL )
+    {
+        return -1;
+    }
+    n = ZSTD_compressCCtx(zstd, buffer, capacity, data, length, COMPRESS_ZSTD_LEVEL);
+    return ZSTD_isError(n) ? -1 : (int)n;
+#else
+    return -1;
+#endif
+}
+
+//
+// Encoding named in the configuration: none, gzip or zstd. -1 if unknown or not built in
+//
+int compress_parse(const char* name)
+{
+    if ( strcasecmp(name, "none") == 0 || strcasecmp(name, "identity") == 0 )
+    {
+        return CompressNone;
+    }
+    if ( strcasecmp(name, "gzip") == 0 )
+    {
+        return CompressGzip;
+    }
+#ifdef BATTSIM_ZSTD
+    if ( strcasecmp(name, "zstd") == 0 )
+    {
+        return CompressZstd;
+    }
+#endif
+    return -1;
+}
+
+//
+// Content-Encoding token
+//
+const char* compress_name(int encoding)
+{
+    switch ( encoding )
+    {
+    case CompressGzip: return "gzip";
+    case CompressZstd: return "zstd";
+    default:           return "identity";
+    }
+}
+
+/*
+***************************************************************************************************************
+ \fn      compress_accepted(const char* accept_encoding, int failed)
+ \brief   picks the encoding to fall back to after a destination refused failed
+
+ A server that answers 415 Unsupported Media Type to an encoded body may list what it does accept in an
+ Accept-Encoding header (RFC 7694). The best one this build supports other than failed is returned, zstd
+ before gzip; entries with q=0 are refused ones. Without a usable entry bodies go out unencoded.
+**************************************************************************************************************
+*/
+int compress_accepted(const char* accept_encoding, int failed)
+{
+    char list[256], *token, *save = NULL, *q;
+    int encoding, best = CompressNone;
+
+    if ( accept_encoding == NULL )
+    {
+        return CompressNone;
+    }
+    strncpy(list, accept_encoding, sizeof(list) - 1);
+    list[sizeof(list) - 1] = '\0';
+    for ( token = strtok_r(list, ", \t", &save); token; token = strtok_r(NULL, ", \t", &save) )
+    {
+        q = strchr(token, ';');
+        if ( q )
+        {
+            *q++ = '\0';
+            q = strstr(q, "q=");
+            if ( q && atof(q + 2) == 0 )
+            {
+                continue;
+            }
+        }
+        encoding = compress_parse(token);
+        if ( encoding > best && encoding != failed )
+        {
+            best = encoding;
+        }
+    }
+    return best;
+}
+
+/*
+***************************************************************************************************************
+ \fn      compress_body(int* encoding, const uint8_t* data, int length, const uint8_t** out)
+ \brief   compresses an uplink body with *encoding
+
+ The compressor contexts and the output buffer are kept between bodies, only the uplink thread may call it.
+ *out points at the encoded body until the next call. When compression fails or would not make the body
+ any smaller, *out is data and *encoding becomes CompressNone, identity is always acceptable.
+
+ \note    returns the length of *out
+**************************************************************************************************************
+*/
+int compress_body(int* encoding, const uint8_t* data, int length, const uint8_t** out)
+{
+    int n = -1;
+
+    if ( *encoding == CompressGzip )
+    {
+        n = _gzip(data, length);
+    }
+    else if ( *encoding == CompressZstd )
+    {
+        n = _zstd(data, length);
+    }
+    if ( n < 0 || n >= length )
+    {
+        *encoding = CompressNone;
+        *out = data;
+        return length;
+    }
+    *out = buffer;
+    return n;
+}
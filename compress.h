@@ -0,0 +1,26 @@
+/*
+ * Copyright © kiwipower 2017
+ *
+ * Header file to compress uplink request bodies
+ */
+#ifndef COMPRESS_DOT_H
+#define COMPRESS_DOT_H
+
+#include <stdint.h>
+
+enum CompressEncoding
+{
+    CompressNone = 0,                           // identity, no Content-Encoding
+    CompressGzip,
+    CompressZstd                                // only when built with BATTSIM_ZSTD
+};
+
+//
+// Public functions
+//
+int         compress_parse(const char* name);
+const char* compress_name(int encoding);
+int         compress_accepted(const char* accept_encoding, int failed);
+int         compress_body(int* encoding, const uint8_t* data, int length, const uint8_t** out);
+
+#endif
@@ -0,0 +1,247 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "config.h"
+#include "compress.h"
+
+typedef struct config_reader_struct
+{
+    _Atomic uint64_t epoch;                     // epoch the read section started in, 0 = outside
+    char pad[56];                               // one cache line per reader
+}config_reader_t;
+
+// Private data
+static _Atomic(config_t*) current = NULL;
+static _Atomic uint64_t epoch = 1;
+static config_reader_t readers[CONFIG_MAX_READERS];
+static _Atomic int reader_count = 0;
+static _Atomic int overflow = 0;                // read sections of threads without a slot
+static __thread int slot = -1;
+static const char *config_file = NULL;
+static void (*config_apply)(const config_t*) = NULL;
+static pthread_t thread1;
+
+static int   _parse(const char* filename, config_t* config);
+static void  _publish(config_t* config);
+static void  _synchronize();
+static void* _thread_handler(void* ptr);
+
+
+int _parse(const char* filename, config_t* config)
+{
+    FILE *fp;
+    char line[256], key[64], value[160];
+    int lineno = 0, retval = 0;
+
+    fp = fopen(filename, "r");
+    if ( fp == NULL )
+    {
+        printf("%s unable to open %s: %s\n", __PRETTY_FUNCTION__, filename, strerror(errno));
+        return -1;
+    }
+    while ( fgets(line, sizeof(line), fp) )
+    {
+        lineno++;
+        if ( line[0] == '#' || sscanf(line, " %63[^= \t] = %159s", key, value) != 2 )
+        {
+            continue;
+        }
+        if      ( strcmp(key, "powerToDeliverURL") == 0 ) strncpy(config->powerToDeliverURL, value, sizeof(config->powerToDeliverURL) - 1);
+        else if ( strcmp(key, "submitReadingsURL") == 0 ) strncpy(config->submitReadingsURL, value, sizeof(config->submitReadingsURL) - 1);
+        else if ( strcmp(key, "debug")     == 0 ) config->debug = atoi(value);
+        else if ( strcmp(key, "rating")    == 0 ) config->battery_param.power_rating = atof(value);
+        else if ( strcmp(key, "charge")    == 0 ) config->battery_param.time_charge = atof(value);
+        else if ( strcmp(key, "discharge") == 0 ) config->battery_param.time_discharge = atof(value);
+        else if ( strcmp(key, "uplinkEncoding") == 0 ) config->uplink_encoding = compress_parse(value);
+        else
+        {
+            printf("%s %s line %d: unknown key %s\n", __PRETTY_FUNCTION__, filename, lineno, key);
+            retval = -1;
+        }
+    }
+    fclose(fp);
+    if ( config->battery_param.power_rating <= 0 || config->battery_param.time_charge <= 0 ||
+         config->battery_param.time_discharge <= 0 )
+    {
+        printf("%s %s: battery parameters must be positive\n", __PRETTY_FUNCTION__, filename);
+        retval = -1;
+    }
+    if ( config->uplink_encoding < 0 )
+    {
+        printf("%s %s: uplinkEncoding must be none, gzip or zstd (if built in)\n", __PRETTY_FUNCTION__, filename);
+        retval = -1;
+    }
+    return retval;
+}
+
+//
+// Waits until every read section that may still hold the previous configuration has ended. Readers that
+// started after the swap are not waited for
+//
+void _synchronize()
+{
+    struct timespec ts = { 0, 1000000 };
+    uint64_t target = atomic_fetch_add(&epoch, 1) + 1;
+    int i, count = atomic_load(&reader_count);
+
+    for ( i = 0; i < count && i < CONFIG_MAX_READERS; i++ )
+    {
+        uint64_t e;
+        while ( (e = atomic_load(&readers[i].epoch)) != 0 && e < target )
+        {
+            nanosleep(&ts, NULL);
+        }
+    }
+    while ( atomic_load(&overflow) )
+    {
+        nanosleep(&ts, NULL);
+    }
+}
+
+void _publish(config_t* config)
+{
+    config_t *old = atomic_exchange(&current, config);
+
+    if ( old )
+    {
+        _synchronize();
+        free(old);
+    }
+}
+
+void config_init(const init_param_t* param)
+{
+    config_t *config = calloc(1, sizeof(config_t));
+
+    if ( config == NULL )
+    {
+        return;
+    }
+    strncpy(config->powerToDeliverURL, param->powerToDeliverURL, sizeof(config->powerToDeliverURL) - 1);
+    strncpy(config->submitReadingsURL, param->submitReadingsURL, sizeof(config->submitReadingsURL) - 1);
+    config->debug = -1;
+    config->battery_param = param->battery_param;
+    config->uplink_encoding = param->uplink_encoding;
+    _publish(config);
+}
+
+/*
+***************************************************************************************************************
+ \fn      config_read_lock()
+ \brief   returns the active configuration, valid until config_read_unlock()
+
+ Read sections are wait free: the reader records the current epoch in its own slot and loads the
+ pointer. A reload builds a new configuration, swaps the pointer and only frees the old one once every
+ reader that could have seen it has left its read section. Requests never block on a reload.
+
+ \note    read sections must not nest and should be short, copy what is needed out of the configuration
+**************************************************************************************************************
+*/
+const config_t* config_read_lock()
+{
+    if ( slot < 0 )
+    {
+        slot = atomic_fetch_add(&reader_count, 1);
+        if ( slot >= CONFIG_MAX_READERS )
+        {
+            slot = CONFIG_MAX_READERS;
+        }
+    }
+    if ( slot == CONFIG_MAX_READERS )
+    {
+        atomic_fetch_add(&overflow, 1);
+    }
+    else
+    {
+        atomic_store(&readers[slot].epoch, atomic_load(&epoch));
+    }
+    return atomic_load(&current);
+}
+
+void config_read_unlock()
+{
+    if ( slot == CONFIG_MAX_READERS )
+    {
+        atomic_fetch_sub(&overflow, 1);
+    }
+    else
+    {
+        atomic_store_explicit(&readers[slot].epoch, 0, memory_order_release);
+    }
+}
+
+//
+// Re-reads the configuration file on top of the active configuration and applies it. A file that does
+// not parse leaves the active configuration untouched
+//
+int config_reload()
+{
+    const config_t *active;
+    config_t *config;
+
+    if ( config_file == NULL || (config = malloc(sizeof(config_t))) == NULL )
+    {
+        return -1;
+    }
+    active = config_read_lock();
+    memcpy(config, active, sizeof(config_t));
+    config_read_unlock();
+    if ( _parse(config_file, config) != 0 )
+    {
+        printf("%s %s not applied\n", __PRETTY_FUNCTION__, config_file);
+        free(config);
+        return -1;
+    }
+    _publish(config);
+    if ( config_apply )
+    {
+        config_apply(config);                   // only this thread publishes, config stays valid
+    }
+    printf("%s %s applied\n", __PRETTY_FUNCTION__, config_file);
+    return 0;
+}
+
+//
+// SIGHUP is only ever delivered to the reload thread. Must be called before any other thread is created
+//
+void config_block_signals()
+{
+    sigset_t set;
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+}
+
+int config_start(const char* filename, void (*apply)(const config_t*))
+{
+    config_file = filename;
+    config_apply = apply;
+    if ( config_reload() != 0 )
+    {
+        return -1;
+    }
+    return pthread_create(&thread1, NULL, _thread_handler, NULL);
+}
+
+//
+// Thread handler
+//
+void* _thread_handler(void* ptr)
+{
+    sigset_t set;
+    int sig;
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGHUP);
+    while ( sigwait(&set, &sig) == 0 )
+    {
+        config_reload();
+    }
+    return 0;
+}
@@ -0,0 +1,35 @@
+/*
+ * Copyright © kiwipower 2017
+ *
+ * Header file for the run time configuration reloaded on SIGHUP
+ */
+#ifndef CONFIG_DOT_H
+#define CONFIG_DOT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "typedefs.h"
+#include "battery.h"
+
+#define CONFIG_MAX_READERS          32            // threads with their own read side slot
+
+typedef struct config_struct
+{
+    char powerToDeliverURL[128];
+    char submitReadingsURL[128];
+    int  debug;                                 // -1 = leave the debug register alone
+    int  uplink_encoding;                       // preferred Content-Encoding of uplink bodies, see compress.h
+    battery_param_t battery_param;
+}config_t;
+
+//
+// Public functions
+//
+void            config_init(const init_param_t* param);
+void            config_block_signals();
+int             config_start(const char* filename, void (*apply)(const config_t*));
+int             config_reload();
+const config_t* config_read_lock();
+void            config_read_unlock();
+
+#endif
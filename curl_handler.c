@@ -1,10 +1,12 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <string.h>
+#include <strings.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <sys/socket.h>
 #include <pthread.h>
+#include <time.h>
 #include <stdbool.h>
 #include <sys/syscall.h>
 #include <fcntl.h>
@@ -14,22 +16,74 @@
 #include "typedefs.h"
 #include "queue.h"
 #include "curl_handler.h"
+#include "config.h"
+#include "metrics.h"
+#include "rt.h"
+#include "compress.h"
+#include "readings.h"
 
 #define SUBMIT_READINGS_FILE      ".submitReadings.json"
 #define MAX_POWER_PAYLOAD 32
+#define MAX_DESTINATIONS          8           // readings URLs with a negotiated encoding
+#define HTTP_UNSUPPORTED_MEDIA_TYPE 415
+#define CONTROL_TIMEOUT_MS        2000        // a set point that cannot be delivered by then is overtaken
+#define LANE_WAIT_SECONDS         1           // how often an idle lane checks for termination
 
+//
+// Set points and readings go out on separate lanes, each with its own queue, thread and connection, so a
+// backlog of readings uploads never holds up a set point
+//
+enum UplinkLane
+{
+    UplinkControl = 0,                          // powerToDeliver PUTs
+    UplinkBulk,                                 // readings PUTs
+    UplinkLaneCount
+};
+
+typedef struct lane_struct
+{
+    const char      *name;
+    int             depth;                      // MetricCounter gauge
+    int             queue_time;                 // MetricHistogram
+    int             latency;                    // MetricHistogram
+    queue_t         queue;
+    pthread_mutex_t mutex;
+    pthread_cond_t  cond;
+    CURL            *curl;                      // reused, libcurl keeps its connection open between transfers
+}lane_t;
+
+typedef struct destination_struct
+{
+    char url[128];
+    int  preferred;                             // configured encoding the negotiation started from
+    int  encoding;                              // what the destination accepts
+}destination_t;
 
-static char powerURL[128];
-static char readingsURL[128];
-static queue_t queue;
-static pthread_mutex_t  mutex;
-static CURL* curl;
+static lane_t lanes[UplinkLaneCount] =
+{
+    { "control", MetricQueueDepthControl, MetricQueueTimeControl, MetricCurlLatencyControl, { NULL },
+      PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL },
+    { "bulk",    MetricQueueDepthBulk,    MetricQueueTimeBulk,    MetricCurlLatencyBulk,    { NULL },
+      PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL }
+};
+static uint8_t *terminate = NULL;
+static destination_t destinations[MAX_DESTINATIONS];
+static int destination_count = 0;
+static char accept_encoding[256];             // Accept-Encoding of the last response
 
 //
 // Private function
 //
-static void  _send_text_plain(const char* payload);
-static void  _send_application_json(const char* payload, int length);
+static void  _push(lane_t* lane, queue_item_t* pdata);
+static queue_item_t* _pop(lane_t* lane);
+static void  _send_text_plain(lane_t* lane, const char* payload);
+static void  _send_application_json(lane_t* lane, const char* payload, int length);
+static void  _send_binary_readings(lane_t* lane, const uint8_t* readings, int length);
+static long  _perform(lane_t* lane);
+static destination_t* _destination(const char* url, int preferred);
+static size_t _header_callback(char* buffer, size_t size, size_t nitems, void* userdata);
+static long  _put_json(lane_t* lane, const char* url, const uint8_t* body, int length, int* encoding);
+static void* _lane_handler(void* ptr);
 
 
 void curl_sendPowerToDeliver(uint16_t power)
@@ -54,9 +108,8 @@ void curl_sendPowerToDeliver(uint16_t power)
             sprintf(pdata->payload,"/powerToDeliver/%d", power);
         }
         pdata->type = CURL_PLAIN_TEXT;
-        pthread_mutex_lock(&mutex);
-        queue_item_push(&queue, pdata);
-        pthread_mutex_unlock(&mutex);
+        pdata->enqueued = metrics_now();
+        _push(&lanes[UplinkControl], pdata);
     }
 }
 
@@ -75,32 +128,169 @@ void curl_sendReadings(const char* readings, int length)
         pdata->length = length;
         memcpy(payload, readings, length);
         pdata->type = CURL_APPLICATION_JSON;
-        pthread_mutex_lock(&mutex);
-        queue_item_push(&queue, pdata);
-        pthread_mutex_unlock(&mutex);
+        pdata->enqueued = metrics_now();
+        _push(&lanes[UplinkBulk], pdata);
+    }
+}
+
+//
+// Queues a binary readings upload as it came in, the uplink thread renders it as JSON
+//
+void curl_sendBinaryReadings(const uint8_t* readings, int length)
+{
+    queue_item_t* pdata;
+    char *payload;
+
+    pdata = malloc(sizeof(queue_item_t));
+    payload = malloc(length);
+
+    if (pdata && payload)
+    {
+        pdata->link.next = NULL;  // !!! Don't forget to NULL next item before queue.
+        pdata->payload = payload;
+        pdata->length = length;
+        memcpy(payload, readings, length);
+        pdata->type = CURL_READINGS_BINARY;
+        pdata->enqueued = metrics_now();
+        _push(&lanes[UplinkBulk], pdata);
+    }
+}
+
+void _push(lane_t* lane, queue_item_t* pdata)
+{
+    pthread_mutex_lock(&lane->mutex);
+    queue_item_push(&lane->queue, pdata);
+    pthread_cond_signal(&lane->cond);
+    pthread_mutex_unlock(&lane->mutex);
+    metrics_add(lane->depth, 1);
+}
+
+//
+// Waits for the next message of the lane, NULL once the uplink terminates. A set point overtakes the ones
+// queued before it, each carries the whole power to deliver so only the newest needs to go out
+//
+queue_item_t* _pop(lane_t* lane)
+{
+    queue_item_t *pdata = NULL, *next;
+    struct timespec ts;
+
+    pthread_mutex_lock(&lane->mutex);
+    while ( queue_item_count(&lane->queue) == 0 && *terminate == false )
+    {
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += LANE_WAIT_SECONDS;
+        pthread_cond_timedwait(&lane->cond, &lane->mutex, &ts);
+    }
+    if ( *terminate == false )
+    {
+        pdata = (queue_item_t*) queue_item_pop(&lane->queue);
+        while ( pdata->type == CURL_PLAIN_TEXT && queue_item_count(&lane->queue) > 0 )
+        {
+            next = (queue_item_t*) queue_item_pop(&lane->queue);
+            metrics_add(lane->depth, -1);
+            free(pdata->payload);
+            free(pdata);
+            pdata = next;
+        }
+    }
+    pthread_mutex_unlock(&lane->mutex);
+    return pdata;
+}
+
+//
+// Runs one transfer and accounts for its latency and outcome, returns the HTTP status or 0 if none came back
+//
+long _perform(lane_t* lane)
+{
+    uint64_t start = metrics_now();
+    long status = 0;
+
+    metrics_add(MetricCurlRequests, 1);
+    if ( curl_easy_perform(lane->curl) != CURLE_OK )
+    {
+        metrics_add(MetricCurlErrors, 1);
+    }
+    else
+    {
+        curl_easy_getinfo(lane->curl, CURLINFO_RESPONSE_CODE, &status);
+    }
+    metrics_observe(lane->latency, metrics_now() - start);
+    return status;
+}
+
+//
+// Encoding state of a readings URL. A changed configuration restarts the negotiation from its preference
+//
+destination_t* _destination(const char* url, int preferred)
+{
+    destination_t *d;
+    int i;
+
+    for ( i = 0; i < destination_count; i++ )
+    {
+        d = &destinations[i];
+        if ( strcmp(d->url, url) == 0 )
+        {
+            if ( d->preferred != preferred )
+            {
+                d->preferred = d->encoding = preferred;
+            }
+            return d;
+        }
     }
+    d = &destinations[destination_count < MAX_DESTINATIONS ? destination_count++ : MAX_DESTINATIONS - 1];
+    strncpy(d->url, url, sizeof(d->url) - 1);
+    d->url[sizeof(d->url) - 1] = '\0';
+    d->preferred = d->encoding = preferred;
+    return d;
 }
 
+//
+// Keeps the Accept-Encoding header of the response for the 415 fallback
+//
+size_t _header_callback(char* buffer, size_t size, size_t nitems, void* userdata)
+{
+    size_t length = size * nitems, n;
+    const char name[] = "Accept-Encoding:";
+
+    if ( length > sizeof(name) - 1 && strncasecmp(buffer, name, sizeof(name) - 1) == 0 )
+    {
+        n = length - (sizeof(name) - 1);
+        if ( n > sizeof(accept_encoding) - 1 )
+        {
+            n = sizeof(accept_encoding) - 1;
+        }
+        memcpy(accept_encoding, buffer + sizeof(name) - 1, n);
+        accept_encoding[n] = '\0';
+        accept_encoding[strcspn(accept_encoding, "\r\n")] = '\0';
+    }
+    return length;
+}
 
-void _send_text_plain(const char* payload)
+void _send_text_plain(lane_t* lane, const char* payload)
 {
     const int payloadLength = 128;
     struct curl_slist *headers = NULL;
-    curl = curl_easy_init();
+    CURL *curl = lane->curl;
 
     if (curl)
     {
         char buf[payloadLength];
-        sprintf(buf, "%s%s", powerURL, payload);
-        curl_slist_append(headers, "Content-Type: text/plain");
-        curl_slist_append(headers, "charsets: utf-8");
+        const config_t *config = config_read_lock();
+        snprintf(buf, sizeof(buf), "%s%s", config->powerToDeliverURL, payload);
+        config_read_unlock();
+        headers = curl_slist_append(headers, "Content-Type: text/plain");
+        headers = curl_slist_append(headers, "charsets: utf-8");
         curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
         curl_easy_setopt(curl, CURLOPT_URL, buf);
         curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, "PUT");
-        curl_easy_perform(curl);
+        curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, (long)CONTROL_TIMEOUT_MS);
+        curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+        curl_easy_setopt(curl, CURLOPT_TCP_NODELAY, 1L);
+        _perform(lane);
+        curl_easy_reset(curl);
         curl_slist_free_all(headers);
     }
-    curl_easy_cleanup(curl);
 }
 
 
@@ -119,65 +309,152 @@ static size_t read_callback(void *ptr, size_t size, size_t nitems, void *stream)
     return len;
 }
 
-void _send_application_json(const char* payload, int length)
+//
+// PUTs one readings body, compressed with *encoding where that makes it smaller, *encoding is set to what was
+// sent. Returns the HTTP status
+//
+long _put_json(lane_t* lane, const char* url, const uint8_t* body, int length, int* encoding)
 {
-	readarg_t rarg = {.buf = (char*)payload, .len = strlen(payload), .pos = 0};
+    CURL *curl = lane->curl;
+    readarg_t rarg = {.buf = NULL, .len = 0, .pos = 0};
     struct curl_slist *headers = NULL;
+    const uint8_t *wire;
+    char content_encoding[64];
+    long status = 0;
+
+    rarg.len = compress_body(encoding, body, length, &wire);
+    rarg.buf = (char*)wire;
     headers = curl_slist_append(headers, "Accept: application/json");
     curl_slist_append(headers, "Content-Type: application/json");
     curl_slist_append(headers, "charsets: utf-8");
+    if ( *encoding != CompressNone )
+    {
+        snprintf(content_encoding, sizeof(content_encoding), "Content-Encoding: %s", compress_name(*encoding));
+        curl_slist_append(headers, content_encoding);
+    }
+    accept_encoding[0] = '\0';
 
-    curl = curl_easy_init();
     if (curl)
     {
         curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
-        curl_easy_setopt(curl, CURLOPT_URL, readingsURL);
+        curl_easy_setopt(curl, CURLOPT_URL, url);
         //curl_easy_setopt(curl, CURLOPT_VERBOSE, 1L);
         curl_easy_setopt(curl, CURLOPT_READFUNCTION, read_callback);
         curl_easy_setopt(curl, CURLOPT_UPLOAD, 1L);
         curl_easy_setopt(curl, CURLOPT_PUT, 1L);
         curl_easy_setopt(curl, CURLOPT_READDATA, &rarg);
         curl_easy_setopt(curl, CURLOPT_INFILESIZE_LARGE, (curl_off_t)rarg.len);
-        curl_easy_perform(curl);
+        curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, _header_callback);
+        status = _perform(lane);
+        metrics_add(MetricUplinkBodyBytes, length);
+        metrics_add(MetricUplinkWireBytes, rarg.len);
+        curl_easy_reset(curl);
     }
-    curl_easy_cleanup(curl);
+    curl_slist_free_all(headers);
+    return status;
 }
 
+//
+// Readings go out with the configured Content-Encoding until a destination refuses it with 415. It is then
+// sent again at once with whatever the refusal's Accept-Encoding offers, or unencoded, and the destination
+// keeps that encoding until the configuration changes
+//
+void _send_application_json(lane_t* lane, const char* payload, int length)
+{
+    destination_t *destination;
+    char readingsURL[128];
+    int preferred, encoding;
+    const config_t *config = config_read_lock();
+    strcpy(readingsURL, config->submitReadingsURL);
+    preferred = config->uplink_encoding;
+    config_read_unlock();
 
-void *curl_handler( void *ptr )
+    destination = _destination(readingsURL, preferred);
+    encoding = destination->encoding;
+    if ( _put_json(lane, readingsURL, (const uint8_t*)payload, strlen(payload), &encoding) == HTTP_UNSUPPORTED_MEDIA_TYPE &&
+         encoding != CompressNone )
+    {
+        destination->encoding = compress_accepted(accept_encoding, encoding);
+        printf("%s %s refused %s, sending %s\n", __PRETTY_FUNCTION__, readingsURL,
+               compress_name(encoding), compress_name(destination->encoding));
+        encoding = destination->encoding;
+        _put_json(lane, readingsURL, (const uint8_t*)payload, strlen(payload), &encoding);
+    }
+}
+
+
+//
+// The destination takes JSON whatever the gateway uploaded, the rendering is done here off the ingest path
+//
+void _send_binary_readings(lane_t* lane, const uint8_t* readings, int length)
 {
-    int count = 0;
-    curl_thread_param_t* param = (curl_thread_param_t*) ptr;
-    uint8_t *terminate = param->terminate;
-    strcpy(powerURL, param->powerToDeliverURL);
-    strcpy(readingsURL, param->submitReadingsURL);
-    free(param);
+    int count = readings_count(readings, length);
+    size_t size = (size_t)count * READINGS_JSON_RECORD + 32;
+    char *json;
 
-    pthread_mutex_init(&mutex, NULL);
-    queue_item_init(&queue);
+    if ( count < 0 || (json = malloc(size)) == NULL )
+    {
+        return;
+    }
+    if ( readings_json(readings, length, json, size) >= 0 )
+    {
+        _send_application_json(lane, json, strlen(json));
+    }
+    free(json);
+}
+
+//
+// Sends the messages of one lane in order over the lane's connection
+//
+void* _lane_handler(void* ptr)
+{
+    lane_t *lane = (lane_t*) ptr;
+    queue_item_t *pdata;
 
-    while (*terminate == false)
+    lane->curl = curl_easy_init();
+    while ( (pdata = _pop(lane)) != NULL )
     {
-        count = queue_item_count(&queue);
-        if (count )
+        metrics_add(lane->depth, -1);
+        metrics_observe(lane->queue_time, metrics_now() - pdata->enqueued);
+        if ( pdata->type == CURL_PLAIN_TEXT )
         {
-            queue_item_t *pdata;
-            pthread_mutex_lock(&mutex);
-            pdata = (queue_item_t*) queue_item_pop(&queue);
-            pthread_mutex_unlock(&mutex);
-            if ( pdata->type == CURL_PLAIN_TEXT )
-            {
-                _send_text_plain(pdata->payload);
-            }
-            else
-            {
-                _send_application_json(pdata->payload, pdata->length);
-            }
-            free(pdata->payload);
-            free(pdata);
+            _send_text_plain(lane, pdata->payload);
+        }
+        else if ( pdata->type == CURL_READINGS_BINARY )
+        {
+            _send_binary_readings(lane, (const uint8_t*)pdata->payload, pdata->length);
+        }
+        else
+        {
+            _send_application_json(lane, pdata->payload, pdata->length);
         }
-        sleep(1);
+        free(pdata->payload);
+        free(pdata);
+    }
+    curl_easy_cleanup(lane->curl);
+    lane->curl = NULL;
+    return 0;
+}
+
+//
+// The uplink thread runs the bulk lane and starts a thread for the control lane, which inherits its CPUs
+// and scheduling (see rt_apply())
+//
+void *curl_handler( void *ptr )
+{
+    pthread_t control;
+    curl_thread_param_t* param = (curl_thread_param_t*) ptr;
+    terminate = param->terminate;
+    free(param);                              // the URLs are read from the active configuration
+    rt_apply(RtUplink);
+
+    if ( pthread_create(&control, NULL, _lane_handler, &lanes[UplinkControl]) != 0 )
+    {
+        printf("%s unable to start the control lane\n", __PRETTY_FUNCTION__);
+        return 0;
     }
+    _lane_handler(&lanes[UplinkBulk]);
+    pthread_join(control, NULL);
 
     return 0;
 }
@@ -3,6 +3,7 @@
 
 void  curl_sendPowerToDeliver(uint16_t power);
 void  curl_sendReadings(const char* readings, int length);
+void  curl_sendBinaryReadings(const uint8_t* readings, int length);
 void *curl_handler( void *ptr );
 
 #endif
@@ -24,23 +24,33 @@
 #include <sys/socket.h>
 #include <microhttpd.h>
 #include <string.h>
+#include <strings.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
 #include <stdbool.h>
 #include <json.h>
 #include <sys/syscall.h>
 #include <stdbool.h>
 #include <pthread.h>
 #include "typedefs.h"
+#include "battery.h"
+#include "regmap.h"
 #include "curl_handler.h"
+#include "metrics.h"
+#include "readings.h"
+#include "aggregate.h"
+#include "rt.h"
+#include "telemetry.h"
 
 #define MAX_PATH 1024
+#define MAX_INGEST_BODY (1 << 20)             // readings uploads larger than this are refused
 
 // Private data
 static modbus_mapping_t *mb_mapping;
 static modbus_t* ctx;
-static unsigned short stateOfCharge;
-static unsigned short stateOfChargeDefault = 50;
+static battery_t *battery;
+static bool headless = false;
 
 static pthread_t thread1;
 static uint8_t terminate1;
@@ -54,21 +64,57 @@ static int   _getStateOfCharge ();
 static int   _setPowerToDeliver (uint16_t );
 
 static void  _remove_character(char *buffer, int character);
+
+static const read_hook_t read_hooks[] =
+{
+    { StateOfCharge, 1, _getStateOfCharge }
+};
+
 static void *_microhttpd_handler( void *ptr );
-static void  _parse_json(const char* str);
+static int   _parse_json(const char* str, reading_t* reading);
+static bool  _json_reading(struct json_object* element, reading_t* reading);
+static void  _apply_reading(const reading_t* reading);
+static int   _ingest(struct MHD_Connection* connection, post_data_t* post);
 static int   _ahc_echo(void * cls, struct MHD_Connection * connection, const char * url,
                        const char * method, const char * version, const char * upload_data,
                         size_t * upload_data_size, void ** ptr);
 
-void _parse_json(const char* str)
+//
+// One element of the readings array, false unless it is an object with all three fields. The fields are
+// looked up in place, an element of any size is never printed or copied
+//
+bool _json_reading(struct json_object* element, reading_t* reading)
+{
+    struct json_object *timestamp, *power, *soc;
+
+    if ( json_object_get_type(element) != json_type_object ||
+         !json_object_object_get_ex(element, "timestamp", &timestamp) ||
+         !json_object_object_get_ex(element, "powerDeliveredkW", &power) ||
+         !json_object_object_get_ex(element, "stateOfCharge", &soc) )
+    {
+        return false;
+    }
+    reading->timestamp = json_object_get_int64(timestamp);
+    reading->power_kw = json_object_get_double(power);
+    reading->state_of_charge = json_object_get_double(soc);
+    return true;
+}
+
+//
+// Reads the last of the readings in a JSON upload, returns -1 if it is not JSON. While aggregating every
+// reading of the upload is folded into the aggregates
+//
+int _parse_json(const char* str, reading_t* reading)
 {
     struct json_object *object, *tmp, *jobj;
-    int length;
-    char buf[128];
-    float p,s;
-    long int t;
+    int i, length, retval = -1;
 
     jobj = json_tokener_parse(str);
+    if ( jobj == NULL )
+    {
+        metrics_add(MetricIngestErrors, 1);
+        return -1;
+    }
 
     // key and val don't exist outside of this bloc
     json_object_object_foreach(jobj, key, val)
@@ -77,14 +123,90 @@ void _parse_json(const char* str)
         {
             case json_type_array:
                 length = json_object_array_length(val);
-                tmp = json_object_array_get_idx(val, length -1);
-                strcpy(buf, json_object_to_json_string(tmp));
-                sscanf(buf,"{ \"timestamp\": %ld, \"powerDeliveredkW\": %f, \"stateOfCharge\": %f }", &t, &p, &s);
-                stateOfCharge = (uint16_t)s;
+                for ( i = aggregate_enabled() ? 0 : length - 1; i < length; i++ )
+                {
+                    tmp = json_object_array_get_idx(val, i);
+                    if ( _json_reading(tmp, reading) )
+                    {
+                        retval = 0;
+                        if ( aggregate_enabled() )
+                        {
+                            aggregate_add(reading);
+                        }
+                    }
+                }
                 break;
         }
     }
     json_object_put(jobj);
+    return retval;
+}
+
+//
+// The gateway reports the state of charge it measured, the model continues from it
+//
+void _apply_reading(const reading_t* reading)
+{
+    battery->state_of_charge = (uint16_t)reading->state_of_charge;
+    telemetry_record(TelemetryTick, battery, -1);
+}
+
+//
+// Handles a complete readings upload, binary when its Content-Type says so and JSON otherwise. Binary
+// records are decoded in place and forwarded as JSON by the uplink thread. With -A only the aggregates go
+// upstream, see aggregate.c. Returns the HTTP status
+//
+int _ingest(struct MHD_Connection* connection, post_data_t* post)
+{
+    const char *type = MHD_lookup_connection_value(connection, MHD_HEADER_KIND, MHD_HTTP_HEADER_CONTENT_TYPE);
+    uint64_t start = metrics_now();
+    reading_t reading;
+    int i, count;
+
+    metrics_add(MetricIngestRequests, 1);
+    if ( post->overflow )
+    {
+        metrics_add(MetricIngestErrors, 1);
+        return MHD_HTTP_PAYLOAD_TOO_LARGE;
+    }
+    if ( type && strncasecmp(type, READINGS_CONTENT_TYPE, strlen(READINGS_CONTENT_TYPE)) == 0 )
+    {
+        count = readings_count((const uint8_t*)post->buff, post->length);
+        if ( count < 0 )
+        {
+            metrics_add(MetricIngestErrors, 1);
+            return MHD_HTTP_BAD_REQUEST;
+        }
+        for ( i = aggregate_enabled() ? 0 : count - 1; i >= 0 && i < count; i++ )
+        {
+            readings_decode((const uint8_t*)post->buff, post->length, i, &reading);
+            if ( aggregate_enabled() )
+            {
+                aggregate_add(&reading);
+            }
+        }
+        if ( count > 0 )
+        {
+            _apply_reading(&reading);
+        }
+        metrics_observe(MetricIngestParse, metrics_now() - start);
+        if ( !aggregate_enabled() )
+        {
+            curl_sendBinaryReadings((const uint8_t*)post->buff, post->length);
+        }
+        return MHD_HTTP_OK;
+    }
+
+    if ( post->buff && _parse_json(post->buff, &reading) == 0 )
+    {
+        _apply_reading(&reading);
+    }
+    metrics_observe(MetricIngestParse, metrics_now() - start);
+    if ( post->buff && !aggregate_enabled() )
+    {
+        curl_sendReadings(post->buff, post->length + 1);
+    }
+    return MHD_HTTP_OK;
 }
 
 int _ahc_echo(void * cls,
@@ -98,9 +220,10 @@ int _ahc_echo(void * cls,
 {
     const char * page = cls;
     struct MHD_Response * response;
-    int reply_status;
+    int reply_status = MHD_HTTP_OK;
     int ret;
     post_data_t *post = NULL;
+    char *buff;
 
     if (0 != strcmp(method, "PUT"))
     {
@@ -109,7 +232,7 @@ int _ahc_echo(void * cls,
     post = (post_data_t*)*ptr;
     if(post == NULL)
     {
-        post = malloc(sizeof(post_data_t));
+        post = calloc(1, sizeof(post_data_t));
         post->status = false;
         *ptr = post;
     }
@@ -120,20 +243,28 @@ int _ahc_echo(void * cls,
     }
     else
     {
-        static int length = 0;
         if(*upload_data_size != 0)
         {
-            length = *upload_data_size + 1;         // add space for null character
+            // the body arrives in as many calls as it takes, append until the final one with no data
+            buff = post->length + *upload_data_size <= MAX_INGEST_BODY ?
+                   realloc(post->buff, post->length + *upload_data_size + 1) : NULL;
+            if ( buff )
+            {
+                memcpy(buff + post->length, upload_data, *upload_data_size);
+                post->length += *upload_data_size;
+                buff[post->length] = '\0';         // JSON is parsed as a string
+                post->buff = buff;
+            }
+            else
+            {
+                post->overflow = true;
+            }
             *upload_data_size = 0;
-            post->buff = malloc(length);
-            post->buff[length] = '\0';             // ensure null termination
-            snprintf(post->buff, length,"%s",upload_data);
             return MHD_YES;
         }
         else
         {
-            _parse_json((const char*)post->buff);
-            curl_sendReadings((const char*)post->buff, length);
+            reply_status = _ingest(connection, post);
             free(post->buff);
         }
     }
@@ -142,7 +273,7 @@ int _ahc_echo(void * cls,
         free(post);
     }
     response = MHD_create_response_from_buffer (0, NULL,MHD_RESPMEM_PERSISTENT);
-    ret = MHD_queue_response(connection, MHD_HTTP_OK, response);
+    ret = MHD_queue_response(connection, reply_status, response);
     MHD_destroy_response(response);
     return ret;
 }
@@ -156,13 +287,9 @@ int _DebugEnable(uint16_t data)
 
 int _getStateOfCharge ()
 {
-    uint16_t *address;
-    uint16_t address_offset;
     int retval = MODBUS_SUCCESS; // need to figure out what this constant is
 
-    address_offset = mb_mapping->start_registers + StateOfCharge;
-    address = mb_mapping->tab_registers + address_offset;
-    *address =  stateOfCharge;
+    regmap_write16(mb_mapping, StateOfCharge, (uint16_t)battery->state_of_charge);
 
     return retval;
 }
@@ -171,7 +298,12 @@ int _setPowerToDeliver (uint16_t data )
 {
     int retval = MODBUS_SUCCESS;
 
-    curl_sendPowerToDeliver(data);
+    battery_setpoint(battery, (int16_t)data);
+    telemetry_record(TelemetrySetpoint, battery, -1);
+    if ( !headless )
+    {
+        curl_sendPowerToDeliver(data);
+    }
     return retval;
 }
 
@@ -184,6 +316,7 @@ void *_microhttpd_handler( void *ptr )
     free(param);
     struct MHD_Daemon *d;
 
+    rt_apply(RtHttp);                       // the daemon's polling thread inherits it
     d = MHD_start_daemon (MHD_USE_AUTO | MHD_USE_INTERNAL_POLLING_THREAD ,
                           8888,
                           NULL, NULL, &_ahc_echo, NULL,
@@ -198,7 +331,9 @@ void *_microhttpd_handler( void *ptr )
     }
 
     while (*terminate == false)
-    ;
+    {
+        usleep(100000);                     // spinning here took a whole CPU away from the modbus loop
+    }
     MHD_stop_daemon (d);
     return 0;
 }
@@ -208,8 +343,14 @@ void engienl_init(init_param_t* param)
     mhttpd_thread_param_t* mhttpd_thread_param;
     curl_thread_param_t* curl_thread_param;
 
-    engienl_disconnect();
+    battery = param->battery;
+    battery_init(battery, &param->battery_param);
     mb_mapping = param->modbus_mapping;
+    headless = param->headless;
+    if ( headless )
+    {
+        return;                     // no asset to talk to, engienl_tick() integrates the power locally
+    }
     terminate1 = FALSE;
     mhttpd_thread_param = malloc(sizeof (mhttpd_thread_param_t));
     mhttpd_thread_param -> terminate = &terminate1;
@@ -221,11 +362,14 @@ void engienl_init(init_param_t* param)
     strcpy(curl_thread_param->powerToDeliverURL, param->powerToDeliverURL);
     strcpy(curl_thread_param->submitReadingsURL, param->submitReadingsURL);
     pthread_create( &thread2, NULL, curl_handler, curl_thread_param);
+
+    aggregate_start(param->aggregate_window, param->aggregate_jump, curl_sendReadings);
 }
 
 void engienl_dispose()
 {
     printf("%s entry\n", __PRETTY_FUNCTION__ );
+    aggregate_stop();
     terminate1 = true;
     pthread_join(thread1, NULL);
     printf("%s exit\n", __PRETTY_FUNCTION__ );
@@ -233,7 +377,15 @@ void engienl_dispose()
 
 void engienl_disconnect()
 {
-	stateOfCharge = stateOfChargeDefault;
+	battery_reset(battery);
+}
+
+//
+// Only used headless: stands in for the readings the asset would report
+//
+void engienl_tick(float seconds)
+{
+    battery_tick(battery, seconds);
 }
 
 
@@ -245,10 +397,6 @@ int  engienl_process_single_register(uint16_t address, uint16_t data)
         _DebugEnable(data);
         break;
 
-    case StateOfCharge:
-        _getStateOfCharge();
-        break;
-
     case PowerToDeliver:
         _setPowerToDeliver(data);
         break;
@@ -257,25 +405,17 @@ int  engienl_process_single_register(uint16_t address, uint16_t data)
     return 0;
 }
 
-int engienl_write_multiple_addresses(uint16_t start_address, uint16_t quantity, uint8_t* pdata)
+//
+// Refreshes the computed registers within the range of a read
+//
+int engienl_read_registers(uint16_t start_address, uint16_t quantity)
 {
-    int retval = MODBUS_SUCCESS;
-
-    int i;
-    uint16_t *address;
-    uint16_t address_offset;
-
-    address_offset = mb_mapping->start_registers + start_address;
-    address = mb_mapping->tab_registers + address_offset;
-    for ( i = 0; i < quantity; i++ )
-    {
-        if ( address < (mb_mapping->tab_registers + mb_mapping-> nb_registers) )
-        {
-            *address++  = (*pdata++ << 8) | *pdata++;
-        }
-    }
+    return regmap_read_hooks(read_hooks, sizeof(read_hooks) / sizeof(read_hooks[0]), start_address, quantity);
+}
 
-    return retval;
+int engienl_write_multiple_addresses(uint16_t start_address, uint16_t quantity, uint8_t* pdata)
+{
+    return regmap_write_block(mb_mapping, start_address, quantity, pdata);
 }
 
 
@@ -17,7 +17,9 @@
 void engienl_init(init_param_t* modbus_mapping);
 void engienl_dispose();
 void engienl_disconnect();
+void engienl_tick(float seconds);
 int  engienl_process_single_register(uint16_t address, uint16_t data);
+int  engienl_read_registers(uint16_t start_address, uint16_t quantity);
 int  engienl_write_multiple_addresses(uint16_t start_address, uint16_t quantity, uint8_t* pdata);
 
 #endif
@@ -8,10 +8,12 @@
 #include <unistd.h>
 #include <string.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <errno.h>
 #include <modbus/modbus.h>
 #include <getopt.h>
 #include <sys/socket.h>
+#include <netinet/in.h>
 #include <stdbool.h>
 #include <sys/syscall.h>
 #include "curl_handler.h"
@@ -19,6 +21,25 @@
 #include "nec.h"
 #include "tesla.h"
 #include "engienl.h"
+#include "recorder.h"
+#include "mbreply.h"
+#include "battery.h"
+#include "batch.h"
+#include "tick.h"
+#include "regmap.h"
+#include "regstore.h"
+#include "profile.h"
+#include "supervisor.h"
+#include "checkpoint.h"
+#include "config.h"
+#include "trace.h"
+#include "metrics.h"
+#include "mbudp.h"
+#include "mbsched.h"
+#include "compress.h"
+#include "rt.h"
+#include "shmexport.h"
+#include "telemetry.h"
 
 
 #define POWER_TO_DELIVER_URL_DEFAULT "http://localhost:1880"
@@ -30,6 +51,23 @@ static uint8_t query[MODBUS_TCP_MAX_ADU_LENGTH];
 #define MODBUS_DEFAULT_PORT 1502
 
 static init_param_t param;
+static bool supervised = false;
+static int workers = 1;
+static bool keep_state = false;
+static const char *checkpoint_file = NULL;
+static const char *target_name = NULL;
+static const char *export_name = NULL;
+static const char *config_file = NULL;
+static const char *trace_file = NULL;
+static const char *telemetry_prefix = NULL;
+static int metrics_port = 0;
+static bool udp = false;
+static int masters = 0;
+static bool lock_memory = false;
+static bool sparse_registers = false;         // the map comes from regstore_new(), see regstore_free()
+static battery_t battery;
+static device_state_t device;
+static batch_target_t batch_target;
 static uint16_t *address;
 static uint16_t address_offset;
 
@@ -38,8 +76,14 @@ static void (*dispose)();
 static void (*disconnect)();
 static int (*thread_handler)( void *ptr );
 static int (*process_handler)(uint16_t address, uint16_t data);
+static int (*process_read_registers)(uint16_t start_address, uint16_t quantity);
 static int (*process_write_multiple_addresses)(uint16_t start_address, uint16_t quantity, uint8_t* pdata);
 
+static int udp_query_handler(uint8_t* req, int length, uint8_t* rsp);
+static int sched_query_handler(int s, uint8_t* req, int length);
+static int query_invalid(int s, uint8_t* req, int length);
+static void sched_closed(int remaining);
+
 
 static void usage(const char *app_name)
 {
@@ -50,10 +94,36 @@ static void usage(const char *app_name)
     printf(" -k \t\t # The URL to submit readings\n");
     printf(" -t \t\t # The target simulator to start\n");
     printf(" -u \t\t # The URL to send the target power\n");
+    printf(" -z \t\t # Content-Encoding of readings sent to -k: none, gzip or zstd (Default none)\n");
+    printf(" -A \t\t # Forward one aggregate of the readings per window of seconds[:SoC jump forwarded at once]\n");
+    printf(" -r \t\t # Record every request and reply to a session log (see battreplay)\n");
+    printf(" -T \t\t # Simulation tick rate in Hz (Default 10, kill -USR1 prints tick jitter)\n");
+    printf(" -B \t\t # Battery parameter key=value, or key=from:to:step to sweep (rating, charge, discharge)\n");
+    printf(" -b \t\t # Run the set point schedule headless instead of serving modbus (repeatable)\n");
+    printf(" -o \t\t # Headless trajectory output, .csv or .bin\n");
+    printf(" -j \t\t # Number of headless scenarios run in parallel (Default one per core)\n");
+    printf(" -P \t\t # Simulate the device described by a register profile instead of -t\n");
+    printf(" -S \t\t # Supervise the simulator, restarting it as soon as it exits abnormally\n");
+    printf(" -c \t\t # Keep the battery state and registers in a checkpoint file and resume from it\n");
+    printf(" -E \t\t # Keep the registers and battery state in this shared memory segment for local readers (see battshm)\n");
+    printf(" -K \t\t # Keep the battery state when a client disconnects (Default reset to 50%%)\n");
+    printf(" -F \t\t # Configuration file (URLs, debug, battery parameters), re-read on kill -HUP\n");
+    printf(" -g \t\t # Record SoC, set point and heartbeat on every tick to columnar segments prefix.NNNNNN.tlm (see battlog)\n");
+    printf(" -x \t\t # Record a binary event trace (see battrace), otherwise events are printed while debug is on\n");
+    printf(" -m \t\t # Serve Prometheus metrics on this HTTP port at /metrics, worker n on port + n\n");
+    printf(" -U \t\t # Serve Modbus/UDP on the port instead of Modbus TCP\n");
+    printf(" -M \t\t # Serve up to this many Modbus TCP masters at once, round robin with set points first\n");
+    printf(" -L \t\t # Rate limit per master with -M, requests per second[:burst] (set points are never limited)\n");
+    printf(" -R \t\t # Pin a thread role (modbus, tick, http, uplink) to CPUs, role=cpus[@SCHED_FIFO priority] (repeatable)\n");
+    printf(" -l \t\t # Lock the simulator in memory and pre-fault the register map\n");
+    printf(" -w \t\t # Worker processes sharing the port and the device state, 0 = one per core (Default 1)\n");
     printf(" -h \t\t # Print this help menu\n");
     printf("\nExamples:\n");
     printf("%s -p 1504  \t # Change the listen port to 1504\n", app_name);
-    printf("%s -t TESLA | NEC | ENGIENL\n\n", app_name);
+    printf("%s -t TESLA | NEC | ENGIENL\n", app_name);
+    printf("%s -t NEC -r field.log \t # Record the session to field.log\n", app_name);
+    printf("%s -P profiles/nec.prof \t # Simulate the device described in nec.prof\n", app_name);
+    printf("%s -t NEC -b plan.csv -B rating=100:300:50 -o soc.csv \t # Sweep plan.csv over five power ratings\n\n", app_name);
     exit(1);
 }
 
@@ -64,24 +134,72 @@ static void init_default(init_param_t * param)
     exit(1);
 }
 
-static void modbus_mem_init()
+static void modbus_mem_init(int defaults)
 {
-    param.modbus_mapping = modbus_mapping_new_start_address(
-       0, 0,
-       0, 0,
-       0, UT_REGISTERS_NB,
-       0, 0);
+    if ( export_name && checkpoint_file )
+    {
+        printf("-E and -c cannot both hold the register map\n");
+        exit(1);
+    }
+    if ( export_name && !batch_enabled() )
+    {
+        param.modbus_mapping = shmexport_open(export_name, target_name ? target_name : "", UT_REGISTERS_NB, defaults);
+        param.battery = shmexport_battery();
+    }
+    else if ( checkpoint_file && target_name && !batch_enabled() )
+    {
+        param.modbus_mapping = checkpoint_open(checkpoint_file, target_name, UT_REGISTERS_NB, defaults);
+        param.battery = checkpoint_battery();
+        param.device = checkpoint_device();
+    }
+    else if ( workers > 1 )
+    {
+        param.modbus_mapping = regstore_new_shared(UT_REGISTERS_NB, defaults);
+        param.battery = regstore_shared(sizeof(battery_t));
+        sparse_registers = true;
+    }
+    else
+    {
+        param.modbus_mapping = regstore_new(UT_REGISTERS_NB, defaults);
+        sparse_registers = true;
+    }
+    if ( workers > 1 && checkpoint_device() == NULL )
+    {
+        param.device = regstore_shared(sizeof(device_state_t));
+    }
+    if ( workers > 1 && (param.device == NULL ||
+         (shmexport_battery() == NULL && (param.battery == NULL || regmap_share(NULL) != 0))) )
+    {
+        exit(1);
+    }
 
     if (param.modbus_mapping == NULL)
     {
         printf("Failed to allocate the mapping: %s\n", modbus_strerror(errno));
         exit(1); // all bets are off
     }
-    address_offset = param.modbus_mapping->start_registers + enableDebugTrace;
-    address = param.modbus_mapping->tab_registers + address_offset;
-    *address = FALSE;
+    if ( checkpoint_battery() == NULL )
+    {
+        address_offset = param.modbus_mapping->start_registers + enableDebugTrace;
+        address = param.modbus_mapping->tab_registers + address_offset;
+        *address = FALSE;
+    }
 }
 
+//
+// Applies a reloaded configuration to the running simulator. The URLs need nothing, curl_handler reads
+// them from the active configuration on every send
+//
+static void apply_config(const config_t* config)
+{
+    if ( config->debug >= 0 )
+    {
+        regmap_write16(param.modbus_mapping, enableDebugTrace, config->debug);
+        process_handler(enableDebugTrace, config->debug);
+    }
+    param.battery_param = config->battery_param;
+    battery_configure(param.battery, &config->battery_param);
+}
 
 static void scan_options(int argc, char* argv[])
 {
@@ -93,7 +211,7 @@ static void scan_options(int argc, char* argv[])
     strncpy(param.powerToDeliverURL, POWER_TO_DELIVER_URL_DEFAULT, strlen(POWER_TO_DELIVER_URL_DEFAULT));
     strncpy(param.submitReadingsURL, SUBMIT_READINGS_URL_DEFAULT, strlen(SUBMIT_READINGS_URL_DEFAULT));
 
-    while ((opt = getopt(argc, argv, "p:u:k:t:")) != -1)
+    while ((opt = getopt(argc, argv, "p:u:k:z:A:t:r:T:B:b:o:j:P:Sc:KF:w:x:m:UM:L:R:lE:g:")) != -1)
     {
         switch (opt)
         {
@@ -106,15 +224,185 @@ static void scan_options(int argc, char* argv[])
         case 'k':
             strncpy(param.submitReadingsURL, optarg, strlen(optarg));
             break;
+        case 'z':
+            param.uplink_encoding = compress_parse(optarg);
+            if ( param.uplink_encoding < 0 )
+            {
+                usage(*argv);
+            }
+            break;
+
+        case 'A':
+        {
+            char *end;
+            long window = strtol(optarg, &end, 10);
+
+            if ( window <= 0 || (*end != '\0' && *end != ':') )
+            {
+                usage(*argv);
+            }
+            param.aggregate_window = window;
+            param.aggregate_jump = *end == ':' ? atof(end + 1) : 0;
+            break;
+        }
+
+        case 'r':
+            if ( recorder_open(optarg) != 0 )
+            {
+                exit(1);
+            }
+            break;
+
+        case 'T':
+            param.tick_rate = atoi(optarg);
+            if ( param.tick_rate < 1 || param.tick_rate > TICK_RATE_MAX )
+            {
+                usage(*argv);
+            }
+            batch_set_step(1.0 / param.tick_rate);
+            break;
+
+        case 'B':
+            if ( batch_add_param(optarg) != 0 )
+            {
+                usage(*argv);
+            }
+            break;
+
+        case 'b':
+            if ( batch_add_schedule(optarg) != 0 )
+            {
+                exit(1);
+            }
+            break;
+
+        case 'o':
+            batch_set_output(optarg);
+            break;
+
+        case 'j':
+            batch_set_jobs(atoi(optarg));
+            break;
+
+        case 'S':
+            supervised = true;
+            break;
+
+        case 'c':
+            checkpoint_file = optarg;
+            break;
+
+        case 'E':
+            export_name = optarg;
+            break;
+
+        case 'K':
+            keep_state = true;
+            break;
+
+        case 'F':
+            config_file = optarg;
+            break;
+
+        case 'x':
+            trace_file = optarg;
+            break;
+
+        case 'g':
+            telemetry_prefix = optarg;
+            break;
+
+        case 'm':
+            metrics_port = atoi(optarg);
+            break;
+
+        case 'U':
+            udp = true;
+            break;
+
+        case 'R':
+            if ( rt_configure(optarg) != 0 )
+            {
+                usage(*argv);
+            }
+            break;
+
+        case 'l':
+            lock_memory = true;
+            break;
+
+        case 'M':
+            masters = atoi(optarg);
+            if ( masters < 1 || masters > MBSCHED_MAX_CONNECTIONS )
+            {
+                usage(*argv);
+            }
+            break;
+
+        case 'L':
+        {
+            char *end;
+            double rate = strtod(optarg, &end);
+
+            if ( rate <= 0 || (*end != '\0' && *end != ':') )
+            {
+                usage(*argv);
+            }
+            mbsched_limit(rate, *end == ':' ? atof(end + 1) : rate);
+            break;
+        }
+
+        case 'w':
+            workers = atoi(optarg);
+            if ( workers == 0 )
+            {
+                workers = sysconf(_SC_NPROCESSORS_ONLN);
+            }
+            if ( workers < 1 || workers > SUPERVISOR_MAX_WORKERS )
+            {
+                usage(*argv);
+            }
+            break;
+
+        case 'P':
+            if ( profile_load(optarg) != 0 )
+            {
+                exit(1);
+            }
+            init = profile_init;
+            dispose = profile_dispose;
+            disconnect = profile_disconnect;
+            process_handler = profile_process_single_register;
+            process_read_registers = profile_read_registers;
+            process_write_multiple_addresses = profile_write_multiple_addresses;
+            batch_target.tick = profile_tick;
+            if ( !profile_setpoint(&batch_target.setpoint_address, &batch_target.setpoint_quantity,
+                                   &batch_target.setpoint_scale) )
+            {
+                batch_target.setpoint_quantity = 0;          // nothing for -b to drive
+            }
+            if ( profile_dispatch(&batch_target.enable_address) )
+            {
+                batch_target.enable_value = 1;
+            }
+            target_name = profile_name();
+            fprintf(fp, "-p %d -P %s\n", param.port, optarg);
+            printf("starting %s battery simulator application - port (%d)\n", profile_name(), param.port);
+            break;
 
         case 't':
+            target_name = optarg;
             if (strncmp("TESLA", optarg, strlen(optarg)) == 0)
             {
                 init = tesla_init;
                 dispose = tesla_dispose;
                 disconnect = tesla_disconnect;
                 process_handler = tesla_process_single_register;
+                process_read_registers = tesla_read_registers;
                 process_write_multiple_addresses = tesla_write_multiple_addresses;
+                batch_target.tick = tesla_tick;
+                batch_target.setpoint_address = directPower;
+                batch_target.setpoint_quantity = 2;
             	fprintf(fp, "-p %d -t TESLA\n", param.port);
                 printf("starting tesla battery simulator application - port (%d)\n", param.port);
             }
@@ -124,7 +412,13 @@ static void scan_options(int argc, char* argv[])
                 dispose = nec_dispose;
                 disconnect = nec_disconnect;
                 process_handler = nec_process_single_register;
+                process_read_registers = nec_read_registers;
                 process_write_multiple_addresses = nec_write_multiple_addresses;
+                batch_target.tick = nec_tick;
+                batch_target.setpoint_address = RealPowerSetPoint;
+                batch_target.setpoint_quantity = 1;
+                batch_target.enable_address = dispatchmode;
+                batch_target.enable_value = DispatchModeDispatch;
             	fprintf(fp, "-p %d -t NEC\n", param.port);
                 printf("starting nec battery simulator application - port (%d)\n", param.port);
             }
@@ -134,7 +428,11 @@ static void scan_options(int argc, char* argv[])
                 dispose = engienl_dispose;
                 disconnect = engienl_disconnect;
                 process_handler = engienl_process_single_register;
+                process_read_registers = engienl_read_registers;
                 process_write_multiple_addresses = engienl_write_multiple_addresses;
+                batch_target.tick = engienl_tick;
+                batch_target.setpoint_address = PowerToDeliver;
+                batch_target.setpoint_quantity = 1;
             	fprintf(fp, "-p %d -t ENGIENL -u %s -k %s\n", param.port, param.powerToDeliverURL,param.submitReadingsURL);
                 printf("starting engienl battery simulator application - port (%d) "
                         "powerToDeliverURL (%s) "
@@ -161,30 +459,187 @@ static void scan_options(int argc, char* argv[])
 	fclose(fp);
 }
 
+//
+// A listen socket of its own for every worker, all bound to the same port. The kernel spreads new
+// connections over them
+//
+static int listen_reuseport(int port)
+{
+    struct sockaddr_in addr;
+    int s, enable = 1;
+
+    s = socket(AF_INET, SOCK_STREAM, 0);
+    if ( s < 0 )
+    {
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    if ( setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable)) != 0 ||
+         setsockopt(s, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable)) != 0 ||
+         bind(s, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+         listen(s, SOMAXCONN) != 0 )
+    {
+        close(s);
+        return -1;
+    }
+    return s;
+}
+
 int main(int argc, char* argv[])
 {
     void query_handler(modbus_pdu_t* mb);
-    int rc, s = -1;
-    bool done = FALSE;
+    int rc, s = -1, worker = 0, i;
+    int sockets[SUPERVISOR_MAX_WORKERS];
+    char name[PATH_MAX], telemetry_name[PATH_MAX];
+    bool done = FALSE, resume;
+    battery_t saved;
+    device_state_t saved_device;
     init = init_default;
 
-    modbus_mem_init();
+    param.battery = &battery;
+    param.device = &device;
     scan_options(argc, argv);
-    init(&param);
+    modbus_mem_init(init == profile_init ? profile_defaults(UT_REGISTERS_NB) : -1);
+    batch_params(&param.battery_param);
+    if ( batch_enabled() )
+    {
+        if ( batch_target.tick == NULL )
+        {
+            usage(*argv);                     // headless needs one of the simulator targets
+        }
+        if ( batch_target.setpoint_quantity == 0 )
+        {
+            printf("the %s profile has no setpoint register for -b to write\n", target_name);
+            return -1;
+        }
+        batch_target.init = init;
+        batch_target.process_handler = process_handler;
+        batch_target.write_multiple_addresses = process_write_multiple_addresses;
+        return batch_run(&param, &batch_target);
+    }
 
-    for (;;)
+    if ( workers > 1 && (init == engienl_init || recorder_enabled()) )
     {
-        param.ctx = modbus_new_tcp(NULL, param.port);
-        if ( param.ctx == NULL )
+        printf("-w does not support ENGIENL or -r, their uplink and log are single process\n");
+        return -1;
+    }
+    if ( regmap_shadow(param.modbus_mapping) != 0 )    // before forking, the workers share it
+    {
+        return -1;
+    }
+
+    // listen once, the socket outlives the connections and, with -S, a crashed simulator
+    param.ctx = modbus_new_tcp(NULL, param.port);
+    if ( param.ctx == NULL )
+    {
+        printf("Failed creating modbus context\n");
+        return -1;
+    }
+    for ( i = 0; i < workers; i++ )
+    {
+        if ( udp )
+        {
+            sockets[i] = mbudp_listen(param.port, workers > 1);
+        }
+        else
+        {
+            sockets[i] = workers > 1 ? listen_reuseport(param.port) : modbus_tcp_listen(param.ctx, 1);
+        }
+        if ( sockets[i] < 0 )
         {
-            printf("Failed creating modbus context\n");
+            printf("Failed to listen on port %d: %s\n", param.port, strerror(errno));
             return -1;
         }
+    }
+    if ( supervised || workers > 1 )
+    {
+        worker = supervisor_run(workers);     // returns in the simulator processes only
+    }
+    s = sockets[worker];
+    for ( i = 0; i < workers; i++ )
+    {
+        if ( i != worker ) close(sockets[i]);
+    }
+    param.passive = worker != 0;
+    config_init(&param);
+    config_block_signals();                   // before the first thread, trace, telemetry and metrics included
+    if ( trace_file && workers > 1 )
+    {
+        snprintf(name, sizeof(name), "%s.%d", trace_file, worker);
+        trace_file = name;
+    }
+    if ( lock_memory )
+    {
+        rt_lock_memory();                     // memory locks are not inherited across fork()
+        rt_prefault(param.modbus_mapping->tab_registers, param.modbus_mapping->nb_registers * sizeof(uint16_t));
+        rt_prefault(regmap_shadow_range(param.modbus_mapping, param.modbus_mapping->start_registers,
+                                        param.modbus_mapping->nb_registers),
+                    param.modbus_mapping->nb_registers * sizeof(uint16_t));
+    }
+    if ( telemetry_prefix && workers > 1 )
+    {
+        snprintf(telemetry_name, sizeof(telemetry_name), "%s.%d", telemetry_prefix, worker);
+        telemetry_prefix = telemetry_name;
+    }
+    if ( trace_start(trace_file) != 0 || telemetry_start(telemetry_prefix, target_name, param.port) != 0 )
+    {
+        return -1;
+    }
+    metrics_device(target_name, param.battery);
+    if ( sparse_registers )
+    {
+        metrics_registers(param.modbus_mapping);
+    }
+    if ( metrics_port && metrics_start(metrics_port + worker) != 0 )
+    {
+        return -1;
+    }
+    resume = !param.passive && checkpoint_begin(&saved, &saved_device);
+    init(&param);
+    checkpoint_restore(resume ? &saved : NULL, &saved_device, batch_target.enable_address, process_handler);
+    if ( config_file && config_start(config_file, apply_config) != 0 )
+    {
+        return -1;
+    }
+    rt_apply(RtModbus);                       // last, the threads started above would inherit it
+
+    if ( udp )
+    {
+        recorder_session();                   // connectionless, the whole run is one session
+        while ( mbudp_serve(s, udp_query_handler) >= 0 )
+        ;
+        printf("Modbus UDP receive failed: %s\n", strerror(errno));
+        return -1;
+    }
+
+    if ( masters )
+    {
+        listen(s, SOMAXCONN);                 // modbus_tcp_listen() queues a single connection
+        mbsched_control(batch_target.setpoint_address, batch_target.setpoint_quantity);
+        if ( batch_target.enable_address )
+        {
+            mbsched_control(batch_target.enable_address, 1);
+        }
+        recorder_session();                   // the masters interleave, the whole run is one session
+        mbsched_serve(s, masters, sched_query_handler, sched_closed);
+        return -1;
+    }
+
+    for (;;)
+    {
         address_offset = param.modbus_mapping->start_registers + enableDebugTrace;
         address = param.modbus_mapping->tab_registers + address_offset;
         modbus_set_debug(param.ctx, *address);
-        s = modbus_tcp_listen(param.ctx, 1);
-        modbus_tcp_accept(param.ctx, &s);
+        if ( modbus_tcp_accept(param.ctx, &s) < 0 )
+        {
+            continue;
+        }
+        metrics_add(MetricConnections, 1);
+        metrics_add(MetricConnectionsActive, 1);
+        recorder_session();
         done = FALSE;
         while (!done)
         {
@@ -192,11 +647,13 @@ int main(int argc, char* argv[])
             switch (rc)
             {
             case -1:
-                close(s); // close the socket
-                disconnect();
-                modbus_close(param.ctx);
-                modbus_free(param.ctx);
-                param.ctx = NULL;
+                if ( !keep_state )
+                {
+                    disconnect();
+                }
+                checkpoint_sync();
+                modbus_close(param.ctx);      // closes the client socket only
+                metrics_add(MetricConnectionsActive, -1);
                 done = TRUE;
                 break;
 
@@ -205,18 +662,50 @@ int main(int argc, char* argv[])
                 break;
 
             default:
+                if ( !mbreply_valid(query, rc) )
+                {
+                    query_invalid(modbus_get_socket(param.ctx), query, rc);
+                    break;
+                }
                 query_handler((modbus_pdu_t*) query);
                 break;
             }
         }
     } // for (;;)
     dispose();
+    recorder_close();
+    checkpoint_close();
+    metrics_stop();
+    trace_stop();
+    telemetry_stop();
+    if ( sparse_registers )
+    {
+        regstore_free(param.modbus_mapping);  // last, the metrics scrape reads it
+    }
     return 0;
 }
 
+//
+// Validates a read the way modbus_reply() does and refreshes the computed registers it covers
+//
+static int _read_registers(uint16_t address, uint16_t count)
+{
+    int offset = address - param.modbus_mapping->start_registers;
+
+    if ( count < 1 || count > MODBUS_MAX_READ_REGISTERS )
+    {
+        return MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE;
+    }
+    if ( offset < 0 || (offset + count) > param.modbus_mapping->nb_registers )
+    {
+        return MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS;
+    }
+    return process_read_registers(address, count);
+}
+
 /*
 ***************************************************************************************************************
- \fn      tesla_query_handler(modbus_pdu_t* mb)
+ \fn      query_dispatch(modbus_pdu_t* mb)
  \brief   processess all incoming commands
 
  Process all input commands. The Modbus function code 0x17 which is not standard seems to exhibit non standaard
@@ -249,28 +738,30 @@ int main(int argc, char* argv[])
 **************************************************************************************************************
 */
 
-void query_handler(modbus_pdu_t* mb)
+static int query_dispatch(modbus_pdu_t* mb)
 {
     const int convert_bytes2word_value = 256;
-    int i,j,retval = MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS;
-    uint16_t address,value,count;
+    int i = 0,j,retval = MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS;
+    uint16_t address = 0,value,count = 0;
     int len = __bswap_16(mb->mbap.length) - 2; // len - fc - unit_id
     uint8_t fc;
 
    // for ( i = 0; i < len; i++ ) {
     fc = mb->fcode;
+    recorder_write(RECORDER_REQUEST, (uint8_t*)mb, sizeof(mbap_header_t) + sizeof(fc) + len);
     switch ( fc ){
     case MODBUS_FC_READ_HOLDING_REGISTERS:
         //printf("%s MODBUS_FC_READ_HOLDING_REGISTERS\n", __PRETTY_FUNCTION__);
-        address = (mb->data[i++] * convert_bytes2word_value) + mb->data[i++]; // address
-        value   = (mb->data[i++] * convert_bytes2word_value) + mb->data[i++]; // data
-        retval  = process_handler(address, value);
+        address = (mb->data[0] * convert_bytes2word_value) + mb->data[1];     // read address
+        count   = (mb->data[2] * convert_bytes2word_value) + mb->data[3];     // read quantity
+        retval  = _read_registers(address, count);
         break;
 
     case MODBUS_FC_WRITE_SINGLE_REGISTER:
         //printf("%s MODBUS_FC_WRITE_SINGLE_REGISTER\n", __PRETTY_FUNCTION__);
         address = (mb->data[i++] * convert_bytes2word_value) + mb->data[i++]; // address
         value   = (mb->data[i++] * convert_bytes2word_value) + mb->data[i++]; // data
+        count   = 1;
         retval  = process_handler(address, value);
         break;
 
@@ -285,14 +776,15 @@ void query_handler(modbus_pdu_t* mb)
 
     case MODBUS_FC_WRITE_AND_READ_REGISTERS:
         //printf("%s MODBUS_FC_WRITE_AND_READ_REGISTERS\n", __PRETTY_FUNCTION__);
-        address = (mb->data[i++] * convert_bytes2word_value) + mb->data[i++]; // address
-        value   = (mb->data[i++] * convert_bytes2word_value) + mb->data[i++]; // data
-        retval  = process_handler(address, value);
-        address = (mb->data[i++] * convert_bytes2word_value) + mb->data[i++]; // address
-        count = (mb->data[i++] * convert_bytes2word_value) + mb->data[i++];   // register count
-        i++;                                             // skip over byte count
-        retval = process_write_multiple_addresses(address, count, &mb->data[i]);
-        i += (count*2);
+        address = (mb->data[4] * convert_bytes2word_value) + mb->data[5];     // write address
+        count   = (mb->data[6] * convert_bytes2word_value) + mb->data[7];     // write quantity
+        retval  = process_write_multiple_addresses(address, count, &mb->data[9]);
+        if ( retval == MODBUS_SUCCESS )                                      // the write happens before the read
+        {
+            address = (mb->data[0] * convert_bytes2word_value) + mb->data[1]; // read address
+            count   = (mb->data[2] * convert_bytes2word_value) + mb->data[3]; // read quantity
+            retval  = _read_registers(address, count);
+        }
         break;
 
     default:
@@ -300,14 +792,101 @@ void query_handler(modbus_pdu_t* mb)
         break;
         }
    // }
+    trace_event4(TraceRequest, fc, address, count, retval);
+    return retval;
+}
+
+//
+// Modbus TCP: dispatches the request and sends the reply on s, register reads straight from the shadow map
+//
+static int query_reply(int s, modbus_pdu_t* mb)
+{
+    uint64_t start = metrics_now();
+    uint8_t rest[MODBUS_TCP_MAX_ADU_LENGTH], reply[MODBUS_TCP_MAX_ADU_LENGTH];
+    int rc, rest_length, reply_length = 0, retval = query_dispatch(mb);
+
+    regmap_lock();
     if ( retval == MODBUS_SUCCESS)
     {
-        modbus_reply(param.ctx, (uint8_t*)mb, sizeof(mbap_header_t) + sizeof(fc) + len, param.modbus_mapping); // subtract function code
+        mbreply_apply((uint8_t*)mb, param.modbus_mapping);
     }
-    else
+    rc = mbreply_send(s, (uint8_t*)mb, retval, param.modbus_mapping, rest, &rest_length);
+    if ( recorder_enabled() )
+    {
+        reply_length = mbreply_build((uint8_t*)mb, retval, param.modbus_mapping, reply);
+    }
+    regmap_unlock();                          // a slow master only holds up its own connection from here
+    if ( rc >= 0 && rest_length > 0 && mbreply_write(s, rest, rest_length) != 0 )
+    {
+        rc = -1;
+    }
+    if ( reply_length > 0 )
+    {
+        recorder_write(RECORDER_REPLY, reply, reply_length);
+    }
+    metrics_request(mb->fcode, retval != MODBUS_SUCCESS, metrics_now() - start);
+    return rc;
+}
+
+void query_handler(modbus_pdu_t* mb)
+{
+    query_reply(modbus_get_socket(param.ctx), mb);
+}
+
+//
+// Modbus TCP: modbus_receive() only frames a write by its byte count. A quantity that disagrees with it is
+// answered the way modbus_reply() did, without reaching a handler that would trust the quantity
+//
+static int query_invalid(int s, uint8_t* req, int length)
+{
+    uint8_t reply[MODBUS_TCP_MAX_ADU_LENGTH];
+    int reply_length = mbreply_exception(req, MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE, reply);
+
+    recorder_write(RECORDER_REQUEST, req, length);
+    recorder_write(RECORDER_REPLY, reply, reply_length);
+    metrics_request(((modbus_pdu_t*) req)->fcode, 1, 0);
+    return mbreply_write(s, reply, reply_length);
+}
+
+//
+// Modbus TCP with -M: mbsched_serve() framed the request, the reply goes back on its connection
+//
+static int sched_query_handler(int s, uint8_t* req, int length)
+{
+    return query_reply(s, (modbus_pdu_t*) req);
+}
+
+//
+// The battery is reset once the last master has gone, not whenever one of several disconnects
+//
+static void sched_closed(int remaining)
+{
+    if ( remaining == 0 && !keep_state )
+    {
+        disconnect();
+    }
+    checkpoint_sync();
+}
+
+//
+// Modbus UDP: the same dispatch, the reply is built into rsp for mbudp_serve() to send with the rest of the batch
+//
+static int udp_query_handler(uint8_t* req, int length, uint8_t* rsp)
+{
+    modbus_pdu_t* mb = (modbus_pdu_t*) req;
+    uint64_t start = metrics_now();
+    int len, retval = query_dispatch(mb);
+
+    regmap_lock();
+    if ( retval == MODBUS_SUCCESS )
     {
-       modbus_reply_exception(param.ctx, (uint8_t*)mb, retval);
+        mbreply_apply(req, param.modbus_mapping);
     }
+    len = mbreply_build(req, retval, param.modbus_mapping, rsp);
+    regmap_unlock();
+    recorder_write(RECORDER_REPLY, rsp, len);
+    metrics_request(mb->fcode, retval != MODBUS_SUCCESS, metrics_now() - start);
+    return len;
 }
 
 
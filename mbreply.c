@@ -0,0 +1,294 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <byteswap.h>
+#include <sys/socket.h>
+#include <modbus/modbus.h>
+#include "typedefs.h"
+#include "mbreply.h"
+#include "regcodec.h"
+#include "regmap.h"
+
+#define MODBUS_EXCEPTION_BIT    0x80
+
+static uint16_t _get_word(const uint8_t* p);
+static int      _read_registers(const modbus_pdu_t* mb, uint16_t address, uint16_t count,
+                                modbus_mapping_t* mb_mapping, uint8_t* rsp);
+
+uint16_t _get_word(const uint8_t* p)
+{
+    return (p[0] << 8) | p[1];
+}
+
+//
+// Copies the requested registers big endian into the reply, validating the range the same way libmodbus does
+//
+int _read_registers(const modbus_pdu_t* mb, uint16_t address, uint16_t count,
+                    modbus_mapping_t* mb_mapping, uint8_t* rsp)
+{
+    modbus_pdu_t* reply = (modbus_pdu_t*) rsp;
+    int offset = address - mb_mapping->start_registers;
+
+    if ( count < 1 || count > MODBUS_MAX_READ_REGISTERS )
+    {
+        return mbreply_exception((const uint8_t*)mb, MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE, rsp);
+    }
+    if ( offset < 0 || (offset + count) > mb_mapping->nb_registers )
+    {
+        return mbreply_exception((const uint8_t*)mb, MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS, rsp);
+    }
+
+    reply->data[0] = count * 2;                          // byte count
+    regcodec_encode(&reply->data[1], mb_mapping->tab_registers + offset, count);
+    reply->mbap.length = __bswap_16(3 + (count * 2));     // unit id + fc + byte count + data
+    return sizeof(mbap_header_t) + 2 + (count * 2);
+}
+
+/*
+***************************************************************************************************************
+ \fn      mbreply_build(const uint8_t* req, int exception, modbus_mapping_t* mb_mapping, uint8_t* rsp)
+ \brief   builds the reply ADU sent for a request
+
+ Reconstructs the bytes modbus_reply() / modbus_reply_exception() put on the wire for the function codes
+ handled by query_handler(). Must be called after the request has been applied to the register map so
+ that MODBUS_FC_WRITE_AND_READ_REGISTERS returns the post-write values.
+
+ \note    rsp must hold at least MODBUS_TCP_MAX_ADU_LENGTH bytes. Returns the reply length in bytes.
+**************************************************************************************************************
+*/
+int mbreply_build(const uint8_t* req, int exception, modbus_mapping_t* mb_mapping, uint8_t* rsp)
+{
+    const modbus_pdu_t* mb = (const modbus_pdu_t*) req;
+    modbus_pdu_t* reply = (modbus_pdu_t*) rsp;
+
+    if ( exception != MODBUS_SUCCESS )
+    {
+        return mbreply_exception(req, exception, rsp);
+    }
+
+    memcpy(&reply->mbap, &mb->mbap, sizeof(mbap_header_t));
+    reply->fcode = mb->fcode;
+    switch ( mb->fcode )
+    {
+    case MODBUS_FC_READ_HOLDING_REGISTERS:
+        return _read_registers(mb, _get_word(&mb->data[0]), _get_word(&mb->data[2]), mb_mapping, rsp);
+
+    case MODBUS_FC_WRITE_SINGLE_REGISTER:
+    case MODBUS_FC_WRITE_MULTIPLE_REGISTERS:
+        memcpy(reply->data, mb->data, 4);                 // echo address and value / quantity
+        reply->mbap.length = __bswap_16(6);
+        return sizeof(mbap_header_t) + 5;
+
+    case MODBUS_FC_WRITE_AND_READ_REGISTERS:
+        return _read_registers(mb, _get_word(&mb->data[0]), _get_word(&mb->data[2]), mb_mapping, rsp);
+
+    default:
+        break;
+    }
+    return mbreply_exception(req, MODBUS_EXCEPTION_ILLEGAL_FUNCTION, rsp);
+}
+
+//
+// Exception reply: function code with the top bit set followed by the exception code
+//
+int mbreply_exception(const uint8_t* req, int exception, uint8_t* rsp)
+{
+    const modbus_pdu_t* mb = (const modbus_pdu_t*) req;
+    modbus_pdu_t* reply = (modbus_pdu_t*) rsp;
+
+    memcpy(&reply->mbap, &mb->mbap, sizeof(mbap_header_t));
+    reply->mbap.length = __bswap_16(3);
+    reply->fcode = mb->fcode | MODBUS_EXCEPTION_BIT;
+    reply->data[0] = exception;
+    return sizeof(mbap_header_t) + 2;
+}
+
+/*
+***************************************************************************************************************
+ \fn      mbreply_apply(const uint8_t* req, modbus_mapping_t* mb_mapping)
+ \brief   stores the registers a successful write request carries, as modbus_reply() does
+
+ Call it under regmap_lock(), before mbreply_build() or mbreply_send(), so a MODBUS_FC_WRITE_AND_READ_REGISTERS
+ reply reads back the written values. A range outside the map is ignored, as libmodbus does.
+**************************************************************************************************************
+*/
+void mbreply_apply(const uint8_t* req, modbus_mapping_t* mb_mapping)
+{
+    const modbus_pdu_t* mb = (const modbus_pdu_t*) req;
+
+    switch ( mb->fcode )
+    {
+    case MODBUS_FC_WRITE_SINGLE_REGISTER:
+        regmap_store(mb_mapping, _get_word(&mb->data[0]), 1, &mb->data[2]);
+        break;
+
+    case MODBUS_FC_WRITE_MULTIPLE_REGISTERS:
+        regmap_store(mb_mapping, _get_word(&mb->data[0]), _get_word(&mb->data[2]), &mb->data[5]);
+        break;
+
+    case MODBUS_FC_WRITE_AND_READ_REGISTERS:
+        regmap_store(mb_mapping, _get_word(&mb->data[4]), _get_word(&mb->data[6]), &mb->data[9]);
+        break;
+
+    default:
+        break;
+    }
+}
+
+//
+// The checks modbus_receive() and modbus_reply() make between them: one whole ADU of length bytes, the MBAP
+// length matching it, and write quantities within the protocol limits matching their byte counts, so
+// handlers can trust the request. Modbus TCP checks what modbus_receive() framed, UDP datagrams and the
+// connection scheduler frame requests themselves
+//
+bool mbreply_valid(const uint8_t* adu, int length)
+{
+    const modbus_pdu_t* mb = (const modbus_pdu_t*) adu;
+    uint16_t quantity;
+
+    if ( length < MBREPLY_HEADER_LENGTH + 1 || mb->mbap.protocol_id != 0 ||
+         __bswap_16(mb->mbap.length) != length - (MBREPLY_HEADER_LENGTH - 1) )
+    {
+        return false;
+    }
+    switch ( mb->fcode )
+    {
+    case MODBUS_FC_READ_HOLDING_REGISTERS:
+    case MODBUS_FC_WRITE_SINGLE_REGISTER:
+        return length == MBREPLY_HEADER_LENGTH + 5;
+
+    case MODBUS_FC_WRITE_MULTIPLE_REGISTERS:
+        if ( length < MBREPLY_HEADER_LENGTH + 6 )
+        {
+            return false;
+        }
+        quantity = _get_word(&mb->data[2]);
+        return quantity >= 1 && quantity <= MODBUS_MAX_WRITE_REGISTERS && mb->data[4] == quantity * 2 &&
+               length == MBREPLY_HEADER_LENGTH + 6 + quantity * 2;
+
+    case MODBUS_FC_WRITE_AND_READ_REGISTERS:
+        if ( length < MBREPLY_HEADER_LENGTH + 10 )
+        {
+            return false;
+        }
+        quantity = _get_word(&mb->data[6]);
+        return quantity >= 1 && quantity <= MODBUS_MAX_WR_WRITE_REGISTERS && mb->data[8] == quantity * 2 &&
+               length == MBREPLY_HEADER_LENGTH + 10 + quantity * 2;
+
+    default:
+        return true;                            // answered with an illegal function exception
+    }
+}
+
+/*
+***************************************************************************************************************
+ \fn      mbreply_send(int s, const uint8_t* req, int exception, modbus_mapping_t* mb_mapping,
+                       uint8_t* rest, int* rest_length)
+ \brief   sends the reply to a request without copying the registers it reads
+
+ A successful MODBUS_FC_READ_HOLDING_REGISTERS or MODBUS_FC_WRITE_AND_READ_REGISTERS reply is only the MBAP
+ header, function code and byte count built here, followed by the register bytes gathered by the kernel
+ straight from the big endian shadow of the map (see regmap_shadow()). Every other reply, and reads without
+ a shadow, are built with mbreply_build(). Call it under regmap_lock().
+
+ The lock is shared by every worker, so the reply is only sent as far as the socket takes it without
+ waiting. What a master too slow to read leaves over is copied to rest, *rest_length bytes, for
+ mbreply_write() to send once the lock is released.
+
+ \note    rest must hold MODBUS_TCP_MAX_ADU_LENGTH bytes. Returns the reply length, or -1 if the socket failed
+**************************************************************************************************************
+*/
+int mbreply_send(int s, const uint8_t* req, int exception, modbus_mapping_t* mb_mapping, uint8_t* rest, int* rest_length)
+{
+    const modbus_pdu_t* mb = (const modbus_pdu_t*) req;
+    uint8_t rsp[MODBUS_TCP_MAX_ADU_LENGTH];
+    modbus_pdu_t* reply = (modbus_pdu_t*) rsp;
+    const uint8_t *registers = NULL;
+    struct iovec iov[2];
+    struct msghdr msg;
+    uint16_t address = 0, count = 0;
+    int length, rc;
+
+    if ( exception == MODBUS_SUCCESS &&
+         (mb->fcode == MODBUS_FC_READ_HOLDING_REGISTERS || mb->fcode == MODBUS_FC_WRITE_AND_READ_REGISTERS) )
+    {
+        address = _get_word(&mb->data[0]);
+        count = _get_word(&mb->data[2]);
+        if ( count >= 1 && count <= MODBUS_MAX_READ_REGISTERS )
+        {
+            registers = regmap_shadow_range(mb_mapping, address, count);
+        }
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    iov[0].iov_base = rsp;
+    if ( registers )
+    {
+        memcpy(&reply->mbap, &mb->mbap, sizeof(mbap_header_t));
+        reply->mbap.length = __bswap_16(3 + (count * 2));         // unit id + fc + byte count + data
+        reply->fcode = mb->fcode;
+        reply->data[0] = count * 2;
+        iov[0].iov_len = sizeof(mbap_header_t) + 2;
+        iov[1].iov_base = (void*)registers;
+        iov[1].iov_len = count * 2;
+        msg.msg_iovlen = 2;
+    }
+    else
+    {
+        iov[0].iov_len = mbreply_build(req, exception, mb_mapping, rsp);
+        msg.msg_iovlen = 1;
+    }
+    length = iov[0].iov_len + (registers ? iov[1].iov_len : 0);
+
+    *rest_length = 0;
+    while ( msg.msg_iovlen )
+    {
+        rc = sendmsg(s, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);      // writev() that cannot raise SIGPIPE
+        if ( rc < 0 )
+        {
+            if ( errno == EINTR ) continue;
+            if ( errno == EAGAIN || errno == EWOULDBLOCK ) break;
+            return -1;
+        }
+        while ( msg.msg_iovlen && (size_t)rc >= msg.msg_iov->iov_len )
+        {
+            rc -= msg.msg_iov->iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+        if ( msg.msg_iovlen )
+        {
+            msg.msg_iov->iov_base = (uint8_t*)msg.msg_iov->iov_base + rc;
+            msg.msg_iov->iov_len -= rc;
+        }
+    }
+    for ( ; msg.msg_iovlen; msg.msg_iov++, msg.msg_iovlen-- )
+    {
+        memcpy(rest + *rest_length, msg.msg_iov->iov_base, msg.msg_iov->iov_len);
+        *rest_length += msg.msg_iov->iov_len;
+    }
+    return length;
+}
+
+//
+// Sends the rest of a reply mbreply_send() could not, outside regmap_lock(). Waits for a blocking socket;
+// a non blocking one that is still full fails, as a full connection always has
+//
+int mbreply_write(int s, const uint8_t* data, int length)
+{
+    int rc;
+
+    while ( length > 0 )
+    {
+        rc = send(s, data, length, MSG_NOSIGNAL);
+        if ( rc < 0 )
+        {
+            if ( errno == EINTR ) continue;
+            return -1;
+        }
+        data += rc;
+        length -= rc;
+    }
+    return 0;
+}
@@ -0,0 +1,25 @@
+/*
+ * Copyright © kiwipower 2017
+ *
+ * Header file to build modbus TCP reply ADUs
+ */
+#ifndef MBREPLY_DOT_H
+#define MBREPLY_DOT_H
+
+#include <stdint.h>
+#include <modbus/modbus.h>
+#include "typedefs.h"
+
+#define MBREPLY_HEADER_LENGTH   7             // MBAP header, unit id included
+
+//
+// Public functions
+//
+bool mbreply_valid(const uint8_t* adu, int length);
+int mbreply_build(const uint8_t* req, int exception, modbus_mapping_t* mb_mapping, uint8_t* rsp);
+int mbreply_exception(const uint8_t* req, int exception, uint8_t* rsp);
+void mbreply_apply(const uint8_t* req, modbus_mapping_t* mb_mapping);
+int mbreply_send(int s, const uint8_t* req, int exception, modbus_mapping_t* mb_mapping, uint8_t* rest, int* rest_length);
+int mbreply_write(int s, const uint8_t* data, int length);
+
+#endif
@@ -0,0 +1,390 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <byteswap.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "typedefs.h"
+#include "mbsched.h"
+#include "mbreply.h"
+#include "regmap.h"
+#include "metrics.h"
+
+#define NSEC_PER_SEC            1000000000ULL
+
+typedef struct mbsched_connection_struct
+{
+    int      s;                                 // -1 once failed, reaped after the pass
+    int      start;                             // first byte not yet served
+    int      length;                            // bytes buffered from start
+    double   tokens;                            // requests the rate limit allows right now
+    uint64_t refilled;                          // when tokens were last topped up
+    bool     throttled;                         // the request at the head was counted as held back
+    uint8_t  buffer[MBSCHED_BUFFER_SIZE];
+} mbsched_connection_t;
+
+typedef struct mbsched_range_struct
+{
+    uint16_t address;
+    uint16_t quantity;
+} mbsched_range_t;
+
+// Private data
+static mbsched_connection_t connections[MBSCHED_MAX_CONNECTIONS];
+static struct pollfd fds[MBSCHED_MAX_CONNECTIONS + 1];
+static int count = 0;                           // connections open
+static int next = 0;                            // connection the next round robin pass starts with
+static double rate = 0;                         // requests per second per connection, 0 for no limit
+static double burst = 1;
+static mbsched_range_t control[MBSCHED_MAX_CONTROL];
+static int control_count = 0;
+
+static uint16_t _get_word(const uint8_t* p);
+static int      _frame(const mbsched_connection_t* c);
+static bool     _control(const uint8_t* adu);
+static void     _refill(mbsched_connection_t* c, uint64_t now);
+static bool     _ready(mbsched_connection_t* c, int length);
+static void     _accept(int s);
+static void     _receive(mbsched_connection_t* c);
+static void     _serve(mbsched_connection_t* c, mbsched_handler_t handler, int budget, bool control_only);
+static int      _timeout(uint64_t now);
+static void     _reap(mbsched_closed_t closed);
+
+
+uint16_t _get_word(const uint8_t* p)
+{
+    return (p[0] << 8) | p[1];
+}
+
+//
+// Length of the complete request at the head of the buffer, 0 while it is still arriving and -1 if the
+// stream cannot be framed any more
+//
+int _frame(const mbsched_connection_t* c)
+{
+    const modbus_pdu_t* mb = (const modbus_pdu_t*)(c->buffer + c->start);
+    int length;
+
+    if ( c->length < MBREPLY_HEADER_LENGTH )
+    {
+        return 0;
+    }
+    length = __bswap_16(mb->mbap.length) + (MBREPLY_HEADER_LENGTH - 1);
+    if ( mb->mbap.protocol_id != 0 || length <= MBREPLY_HEADER_LENGTH || length > MODBUS_TCP_MAX_ADU_LENGTH )
+    {
+        return -1;
+    }
+    if ( c->length < length )
+    {
+        return 0;
+    }
+    return mbreply_valid((const uint8_t*)mb, length) ? length : -1;
+}
+
+//
+// Writes that touch one of the control ranges, set points and dispatch commands
+//
+bool _control(const uint8_t* adu)
+{
+    const modbus_pdu_t* mb = (const modbus_pdu_t*) adu;
+    uint16_t address, quantity;
+    int i;
+
+    switch ( mb->fcode )
+    {
+    case MODBUS_FC_WRITE_SINGLE_REGISTER:
+        address = _get_word(&mb->data[0]);
+        quantity = 1;
+        break;
+
+    case MODBUS_FC_WRITE_MULTIPLE_REGISTERS:
+        address = _get_word(&mb->data[0]);
+        quantity = _get_word(&mb->data[2]);
+        break;
+
+    case MODBUS_FC_WRITE_AND_READ_REGISTERS:
+        address = _get_word(&mb->data[4]);
+        quantity = _get_word(&mb->data[6]);
+        break;
+
+    default:
+        return false;
+    }
+    for ( i = 0; i < control_count; i++ )
+    {
+        if ( regmap_overlaps(address, quantity, control[i].address, control[i].quantity) )
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+void _refill(mbsched_connection_t* c, uint64_t now)
+{
+    if ( rate > 0 )
+    {
+        c->tokens += rate * (now - c->refilled) / NSEC_PER_SEC;
+        if ( c->tokens > burst )
+        {
+            c->tokens = burst;
+        }
+    }
+    c->refilled = now;
+}
+
+//
+// Whether the complete request at the head may be served now, counting it once if the limit holds it back
+//
+bool _ready(mbsched_connection_t* c, int length)
+{
+    if ( length <= 0 )
+    {
+        return false;
+    }
+    if ( rate == 0 || c->tokens >= 1 || _control(c->buffer + c->start) )
+    {
+        return true;
+    }
+    if ( !c->throttled )
+    {
+        metrics_add(MetricRequestsThrottled, 1);
+        c->throttled = true;
+    }
+    return false;
+}
+
+void _accept(int s)
+{
+    mbsched_connection_t* c = &connections[count];
+    int enable = 1;
+
+    c->s = accept4(s, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if ( c->s < 0 )
+    {
+        return;
+    }
+    setsockopt(c->s, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+    c->start = 0;
+    c->length = 0;
+    c->tokens = burst;
+    c->refilled = metrics_now();
+    c->throttled = false;
+    count++;
+    metrics_add(MetricConnections, 1);
+    metrics_add(MetricConnectionsActive, 1);
+}
+
+void _receive(mbsched_connection_t* c)
+{
+    int rc;
+
+    if ( c->start > 0 )
+    {
+        memmove(c->buffer, c->buffer + c->start, c->length);
+        c->start = 0;
+    }
+    rc = recv(c->s, c->buffer + c->length, sizeof(c->buffer) - c->length, 0);
+    if ( rc > 0 )
+    {
+        c->length += rc;
+    }
+    else if ( rc == 0 || (errno != EAGAIN && errno != EINTR) )
+    {
+        close(c->s);
+        c->s = -1;
+    }
+}
+
+//
+// Serves up to budget requests from the head of a connection, in the order they arrived. control_only stops
+// at the first request that is not a control write
+//
+void _serve(mbsched_connection_t* c, mbsched_handler_t handler, int budget, bool control_only)
+{
+    int length = 0, served;
+    bool is_control;
+
+    for ( served = 0; c->s >= 0 && served < budget; served++ )
+    {
+        length = _frame(c);
+        if ( length <= 0 )
+        {
+            break;
+        }
+        is_control = _control(c->buffer + c->start);
+        if ( (control_only && !is_control) || !_ready(c, length) )
+        {
+            break;
+        }
+        if ( rate > 0 && !is_control )
+        {
+            c->tokens -= 1;
+        }
+        c->throttled = false;
+        if ( handler(c->s, c->buffer + c->start, length) < 0 )
+        {
+            length = -1;
+            break;
+        }
+        c->start += length;
+        c->length -= length;
+    }
+    if ( length < 0 && c->s >= 0 )
+    {
+        close(c->s);                            // malformed stream or the reply failed
+        c->s = -1;
+    }
+}
+
+//
+// Poll timeout in ms: none while a request can be served, until the next token while the limit holds
+// requests back, forever otherwise
+//
+int _timeout(uint64_t now)
+{
+    mbsched_connection_t* c;
+    double wait = -1, until;
+    int i;
+
+    for ( i = 0; i < count; i++ )
+    {
+        c = &connections[i];
+        _refill(c, now);
+        if ( _ready(c, _frame(c)) || _frame(c) < 0 )
+        {
+            return 0;
+        }
+        if ( _frame(c) > 0 )
+        {
+            until = (1 - c->tokens) / rate;
+            if ( wait < 0 || until < wait )
+            {
+                wait = until;
+            }
+        }
+    }
+    return wait < 0 ? -1 : (int)(wait * 1000) + 1;
+}
+
+//
+// Drops the connections that failed during the pass
+//
+void _reap(mbsched_closed_t closed)
+{
+    int i = 0;
+
+    while ( i < count )
+    {
+        if ( connections[i].s >= 0 )
+        {
+            i++;
+            continue;
+        }
+        connections[i] = connections[--count];   // the order only decides who starts a pass
+        metrics_add(MetricConnectionsActive, -1);
+        closed(count);
+    }
+    if ( next >= count )
+    {
+        next = 0;
+    }
+}
+
+//
+// Limits each connection to rate requests per second, with bursts of up to burst requests. Control writes
+// are never held back
+//
+void mbsched_limit(double requests_per_second, double burst_requests)
+{
+    rate = requests_per_second > 0 ? requests_per_second : 0;
+    burst = burst_requests >= 1 ? burst_requests : 1;
+}
+
+//
+// Marks writes to quantity registers from address as control writes, served ahead of everything else
+//
+void mbsched_control(uint16_t address, uint16_t quantity)
+{
+    if ( control_count < MBSCHED_MAX_CONTROL && quantity > 0 )
+    {
+        control[control_count].address = address;
+        control[control_count].quantity = quantity;
+        control_count++;
+    }
+}
+
+/*
+***************************************************************************************************************
+ \fn      mbsched_serve(int s, int max_connections, mbsched_handler_t handler, mbsched_closed_t closed)
+ \brief   serves up to max_connections modbus TCP masters from one thread
+
+ Accepts on the listening socket s and polls every connection. Each pass first serves the control writes
+ waiting at the head of any connection, then gives every connection a round robin turn of up to
+ MBSCHED_BUDGET requests, subject to its token bucket (see mbsched_limit()). Requests of one connection are
+ always answered in order, so a control write queued behind reads waits for them, but never for another
+ master: a dispatch command waits at most one pass however hard the other masters poll. A connection that
+ has its buffer full is not read from until it has been served, its master is held back by TCP flow
+ control. Malformed streams and connections whose reply cannot be sent at once are closed.
+
+ \note    only returns, with -1, if polling fails
+**************************************************************************************************************
+*/
+int mbsched_serve(int s, int max_connections, mbsched_handler_t handler, mbsched_closed_t closed)
+{
+    mbsched_connection_t* c;
+    int i;
+
+    if ( max_connections > MBSCHED_MAX_CONNECTIONS )
+    {
+        max_connections = MBSCHED_MAX_CONNECTIONS;
+    }
+    for (;;)
+    {
+        fds[0].fd = count < max_connections ? s : -1;
+        fds[0].events = POLLIN;
+        for ( i = 0; i < count; i++ )
+        {
+            // a full buffer is not polled at all, a hang up would otherwise wake the loop until it drains
+            fds[i + 1].fd = connections[i].length < (int)sizeof(connections[i].buffer) ? connections[i].s : -1;
+            fds[i + 1].events = POLLIN;
+        }
+        if ( poll(fds, count + 1, _timeout(metrics_now())) < 0 )
+        {
+            if ( errno == EINTR )
+            {
+                continue;
+            }
+            printf("%s poll failed: %s\n", __PRETTY_FUNCTION__, strerror(errno));
+            return -1;
+        }
+        for ( i = 0; i < count; i++ )
+        {
+            if ( fds[i + 1].revents & (POLLIN | POLLHUP | POLLERR) )
+            {
+                _receive(&connections[i]);
+            }
+        }
+        if ( fds[0].revents & POLLIN )
+        {
+            _accept(s);
+        }
+
+        for ( i = 0; i < count; i++ )
+        {
+            _serve(&connections[i], handler, MBSCHED_BUFFER_SIZE, true);
+        }
+        for ( i = 0; i < count; i++ )
+        {
+            c = &connections[(next + i) % count];
+            _refill(c, metrics_now());
+            _serve(c, handler, MBSCHED_BUDGET, false);
+        }
+        next = count ? (next + 1) % count : 0;
+        _reap(closed);
+    }
+}
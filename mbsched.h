@@ -0,0 +1,34 @@
+/*
+ * Copyright © kiwipower 2017
+ *
+ * Header file to serve several modbus TCP masters at once, fairly and rate limited
+ */
+#ifndef MBSCHED_DOT_H
+#define MBSCHED_DOT_H
+
+#include <stdint.h>
+#include <modbus/modbus.h>
+
+#define MBSCHED_MAX_CONNECTIONS 64            // masters served at the same time
+#define MBSCHED_BUDGET          4             // requests served per connection per round robin turn
+#define MBSCHED_MAX_CONTROL     4             // control register ranges
+#define MBSCHED_BUFFER_SIZE     (4 * MODBUS_TCP_MAX_ADU_LENGTH)
+
+//
+// Handles one request ADU and sends its reply on s, returns -1 if the connection failed
+//
+typedef int (*mbsched_handler_t)(int s, uint8_t* req, int length);
+
+//
+// Called after a connection closed, with the number still open
+//
+typedef void (*mbsched_closed_t)(int remaining);
+
+//
+// Public functions
+//
+void mbsched_limit(double rate, double burst);
+void mbsched_control(uint16_t address, uint16_t quantity);
+int  mbsched_serve(int s, int connections, mbsched_handler_t handler, mbsched_closed_t closed);
+
+#endif
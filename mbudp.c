@@ -0,0 +1,118 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <modbus/modbus.h>
+#include "typedefs.h"
+#include "mbudp.h"
+#include "mbreply.h"
+
+#define MBUDP_BUFFER_SIZE       (1 << 20)     // socket buffers, a fleet polling in step arrives in bursts
+
+// Private data
+static uint8_t requests[MBUDP_BATCH][MODBUS_TCP_MAX_ADU_LENGTH];
+static uint8_t replies[MBUDP_BATCH][MODBUS_TCP_MAX_ADU_LENGTH];
+static struct sockaddr_in peers[MBUDP_BATCH];
+static struct mmsghdr rx[MBUDP_BATCH];
+static struct mmsghdr tx[MBUDP_BATCH];
+static struct iovec rx_iov[MBUDP_BATCH];
+static struct iovec tx_iov[MBUDP_BATCH];
+
+
+//
+// Binds a UDP socket to port on every interface. With reuseport each worker binds a socket of its own and
+// the kernel spreads the clients over them by source address
+//
+int mbudp_listen(int port, bool reuseport)
+{
+    struct sockaddr_in addr;
+    int s, enable = 1, size = MBUDP_BUFFER_SIZE;
+
+    s = socket(AF_INET, SOCK_DGRAM, 0);
+    if ( s < 0 )
+    {
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    setsockopt(s, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    setsockopt(s, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+    if ( (reuseport && setsockopt(s, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable)) != 0) ||
+         bind(s, (struct sockaddr*)&addr, sizeof(addr)) != 0 )
+    {
+        close(s);
+        return -1;
+    }
+    return s;
+}
+
+/*
+***************************************************************************************************************
+ \fn      mbudp_serve(int s, mbudp_handler_t handler)
+ \brief   answers one batch of modbus UDP requests
+
+ Waits for at least one datagram and takes up to MBUDP_BATCH with a single recvmmsg(), runs each through
+ handler in arrival order, then sends all the replies back to their sources with a single sendmmsg().
+ Each datagram carries one ADU with the same MBAP framing as modbus TCP. Datagrams that are truncated or
+ whose framing does not add up are dropped without a reply, the master times out and retries.
+
+ \note    returns the number of replies handed to the socket, or -1 if receiving failed
+**************************************************************************************************************
+*/
+int mbudp_serve(int s, mbudp_handler_t handler)
+{
+    int i, received, count = 0, sent = 0, rc;
+
+    for ( i = 0; i < MBUDP_BATCH; i++ )
+    {
+        rx_iov[i].iov_base = requests[i];
+        rx_iov[i].iov_len = sizeof(requests[i]);
+        memset(&rx[i].msg_hdr, 0, sizeof(rx[i].msg_hdr));
+        rx[i].msg_hdr.msg_iov = &rx_iov[i];
+        rx[i].msg_hdr.msg_iovlen = 1;
+        rx[i].msg_hdr.msg_name = &peers[i];
+        rx[i].msg_hdr.msg_namelen = sizeof(peers[i]);
+    }
+    received = recvmmsg(s, rx, MBUDP_BATCH, MSG_WAITFORONE, NULL);
+    if ( received < 0 )
+    {
+        return errno == EINTR || errno == ECONNREFUSED ? 0 : -1;   // the latter reports an earlier reply
+    }
+
+    for ( i = 0; i < received; i++ )
+    {
+        if ( (rx[i].msg_hdr.msg_flags & MSG_TRUNC) || !mbreply_valid(requests[i], rx[i].msg_len) )
+        {
+            continue;
+        }
+        tx_iov[count].iov_base = replies[count];
+        tx_iov[count].iov_len = handler(requests[i], rx[i].msg_len, replies[count]);
+        if ( tx_iov[count].iov_len == 0 )
+        {
+            continue;
+        }
+        memset(&tx[count].msg_hdr, 0, sizeof(tx[count].msg_hdr));
+        tx[count].msg_hdr.msg_iov = &tx_iov[count];
+        tx[count].msg_hdr.msg_iovlen = 1;
+        tx[count].msg_hdr.msg_name = &peers[i];
+        tx[count].msg_hdr.msg_namelen = rx[i].msg_hdr.msg_namelen;
+        count++;
+    }
+
+    while ( sent < count )
+    {
+        rc = sendmmsg(s, &tx[sent], count - sent, 0);
+        if ( rc < 0 && errno != EINTR )
+        {
+            printf("%s sendmmsg failed: %s\n", __PRETTY_FUNCTION__, strerror(errno));
+            rc = 1;                             // drop the reply that failed, the master retries
+        }
+        sent += rc > 0 ? rc : 0;
+    }
+    return sent;
+}
@@ -0,0 +1,25 @@
+/*
+ * Copyright © kiwipower 2017
+ *
+ * Header file to serve modbus requests over UDP
+ */
+#ifndef MBUDP_DOT_H
+#define MBUDP_DOT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define MBUDP_BATCH             64            // datagrams received and answered per system call
+
+//
+// Handles one request ADU and builds its reply ADU in rsp, returns the reply length, 0 for no reply
+//
+typedef int (*mbudp_handler_t)(uint8_t* req, int length, uint8_t* rsp);
+
+//
+// Public functions
+//
+int mbudp_listen(int port, bool reuseport);
+int mbudp_serve(int s, mbudp_handler_t handler);
+
+#endif
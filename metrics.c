@@ -0,0 +1,316 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <time.h>
+#include <microhttpd.h>
+#include <modbus/modbus.h>
+#include "metrics.h"
+#include "regstore.h"
+
+#define NSEC_PER_SEC            1000000000ULL
+#define METRICS_URL             "/metrics"
+#define METRICS_CONTENT_TYPE    "text/plain; version=0.0.4"
+
+typedef struct metric_struct
+{
+    const char *name;
+    const char *label;                          // NULL or the label set of this series
+    const char *type;
+    const char *help;
+}metric_t;
+
+//
+// Each histogram is written by one thread at a time, keep them off each other's cache lines
+//
+typedef struct histogram_struct
+{
+    uint64_t bucket[METRICS_BUCKETS];
+    uint64_t sum;                               // nanoseconds
+    uint64_t count;
+}__attribute__((aligned(64)))histogram_t;
+
+// Private data
+static uint64_t counters[MetricCounterCount] __attribute__((aligned(64)));
+static histogram_t histograms[MetricHistogramCount];
+static struct MHD_Daemon *daemon_handle = NULL;
+static const char *device_name = "battsim";
+static const battery_t *device = NULL;
+static const modbus_mapping_t *registers = NULL;
+
+static const uint64_t bounds[METRICS_BUCKETS - 1] =   // nanoseconds, upper bounds, +Inf implied
+{
+    50000, 100000, 250000, 500000,
+    1000000, 2500000, 5000000, 10000000, 25000000, 50000000, 100000000, 250000000, 500000000,
+    1000000000, 2500000000ULL, 5000000000ULL, 10000000000ULL
+};
+
+static const metric_t counter_metrics[MetricCounterCount] =
+{
+    { "battsim_modbus_requests_total",          "fc=\"3\"",  "counter", "Modbus requests by function code" },
+    { "battsim_modbus_requests_total",          "fc=\"6\"",  "counter", NULL },
+    { "battsim_modbus_requests_total",          "fc=\"16\"", "counter", NULL },
+    { "battsim_modbus_requests_total",          "fc=\"23\"", "counter", NULL },
+    { "battsim_modbus_requests_total",          "fc=\"other\"", "counter", NULL },
+    { "battsim_modbus_exceptions_total",        NULL, "counter", "Modbus requests answered with an exception" },
+    { "battsim_modbus_connections_total",       NULL, "counter", "Modbus client connections accepted" },
+    { "battsim_modbus_connections",             NULL, "gauge",   "Modbus client connections open" },
+    { "battsim_modbus_throttled_total",         NULL, "counter", "Modbus requests delayed by the per connection rate limit" },
+    { "battsim_uplink_queue_depth",             "lane=\"control\"", "gauge", "Uplink messages waiting to be sent by lane" },
+    { "battsim_uplink_queue_depth",             "lane=\"bulk\"", "gauge", NULL },
+    { "battsim_uplink_requests_total",          NULL, "counter", "Uplink HTTP transfers" },
+    { "battsim_uplink_errors_total",            NULL, "counter", "Uplink HTTP transfers that failed" },
+    { "battsim_uplink_body_bytes_total",        NULL, "counter", "Uplink readings bytes before compression" },
+    { "battsim_uplink_wire_bytes_total",        NULL, "counter", "Uplink readings bytes sent after compression" },
+    { "battsim_ingest_requests_total",          NULL, "counter", "Readings received on the ingest endpoint" },
+    { "battsim_ingest_errors_total",            NULL, "counter", "Readings that failed to parse" },
+    { "battsim_aggregate_windows_total",        NULL, "counter", "Reading windows forwarded as one aggregate" },
+    { "battsim_aggregate_events_total",         NULL, "counter", "State of charge jumps forwarded out of band" },
+    { "battsim_telemetry_dropped_total",        NULL, "counter", "Telemetry rows dropped waiting for a segment" },
+    { "battsim_ticks_total",                    NULL, "counter", "Simulator ticks" },
+    { "battsim_tick_overruns_total",            NULL, "counter", "Simulator ticks that started after their deadline" }
+};
+
+static const metric_t histogram_metrics[MetricHistogramCount] =
+{
+    { "battsim_modbus_request_duration_seconds", NULL, "histogram", "Modbus request handling, decode to reply" },
+    { "battsim_uplink_queue_seconds",            "lane=\"control\"", "histogram", "Time uplink messages spend queued by lane" },
+    { "battsim_uplink_queue_seconds",            "lane=\"bulk\"", "histogram", NULL },
+    { "battsim_uplink_request_duration_seconds", "lane=\"control\"", "histogram", "Uplink HTTP transfer time by lane" },
+    { "battsim_uplink_request_duration_seconds", "lane=\"bulk\"", "histogram", NULL },
+    { "battsim_ingest_parse_seconds",            NULL, "histogram", "Readings JSON parse time" }
+};
+
+static void _append(char* buf, int size, int* len, const char* format, ...);
+static void _format_histogram(char* buf, int size, int* len, int index);
+static int  _handler(void * cls, struct MHD_Connection * connection, const char * url,
+                     const char * method, const char * version, const char * upload_data,
+                     size_t * upload_data_size, void ** ptr);
+
+
+uint64_t metrics_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+//
+// Adds to a counter, or moves a gauge with a negative n
+//
+void metrics_add(int counter, int64_t n)
+{
+    __atomic_fetch_add(&counters[counter], (uint64_t)n, __ATOMIC_RELAXED);
+}
+
+void metrics_observe(int histogram, uint64_t nanoseconds)
+{
+    histogram_t *h = &histograms[histogram];
+    int i;
+
+    for ( i = 0; i < METRICS_BUCKETS - 1 && nanoseconds > bounds[i]; i++ )
+    ;
+    __atomic_fetch_add(&h->bucket[i], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->sum, nanoseconds, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+}
+
+void metrics_request(uint8_t fc, int exception, uint64_t nanoseconds)
+{
+    switch ( fc )
+    {
+        case MODBUS_FC_READ_HOLDING_REGISTERS:   metrics_add(MetricRequestsRead, 1);          break;
+        case MODBUS_FC_WRITE_SINGLE_REGISTER:    metrics_add(MetricRequestsWrite, 1);         break;
+        case MODBUS_FC_WRITE_MULTIPLE_REGISTERS: metrics_add(MetricRequestsWriteMultiple, 1); break;
+        case MODBUS_FC_WRITE_AND_READ_REGISTERS: metrics_add(MetricRequestsWriteRead, 1);     break;
+        default:                                 metrics_add(MetricRequestsOther, 1);         break;
+    }
+    if ( exception )
+    {
+        metrics_add(MetricRequestExceptions, 1);
+    }
+    metrics_observe(MetricRequestLatency, nanoseconds);
+}
+
+//
+// The device whose state of charge and set point are exported, read at scrape time
+//
+void metrics_device(const char* name, const battery_t* battery)
+{
+    device_name = name ? name : device_name;
+    device = battery;
+}
+
+//
+// A register map from regstore_new(), whose resident size is exported, read at scrape time
+//
+void metrics_registers(const modbus_mapping_t* mb_mapping)
+{
+    registers = mb_mapping;
+}
+
+void _append(char* buf, int size, int* len, const char* format, ...)
+{
+    va_list args;
+    int n;
+
+    if ( *len >= size )
+    {
+        return;
+    }
+    va_start(args, format);
+    n = vsnprintf(buf + *len, size - *len, format, args);
+    va_end(args);
+    *len = (n < 0 || *len + n >= size) ? size : *len + n;
+}
+
+void _format_histogram(char* buf, int size, int* len, int index)
+{
+    const metric_t *m = &histogram_metrics[index];
+    const histogram_t *h = &histograms[index];
+    const char *label = m->label ? m->label : "";
+    const char *comma = m->label ? "," : "";
+    uint64_t cumulative = 0;
+    int i;
+
+    if ( m->help )                              // the first series of the metric
+    {
+        _append(buf, size, len, "# HELP %s %s\n# TYPE %s %s\n", m->name, m->help, m->name, m->type);
+    }
+    for ( i = 0; i < METRICS_BUCKETS; i++ )
+    {
+        cumulative += __atomic_load_n(&h->bucket[i], __ATOMIC_RELAXED);
+        if ( i < METRICS_BUCKETS - 1 )
+        {
+            _append(buf, size, len, "%s_bucket{%s%sle=\"%g\"} %llu\n", m->name, label, comma,
+                    (double)bounds[i] / NSEC_PER_SEC, (unsigned long long)cumulative);
+        }
+        else
+        {
+            _append(buf, size, len, "%s_bucket{%s%sle=\"+Inf\"} %llu\n", m->name, label, comma,
+                    (unsigned long long)cumulative);
+        }
+    }
+    _append(buf, size, len, m->label ? "%s_sum{%s} %.9f\n" : "%s_sum%s %.9f\n", m->name, label,
+            (double)__atomic_load_n(&h->sum, __ATOMIC_RELAXED) / NSEC_PER_SEC);
+    _append(buf, size, len, m->label ? "%s_count{%s} %llu\n" : "%s_count%s %llu\n", m->name, label,
+            (unsigned long long)__atomic_load_n(&h->count, __ATOMIC_RELAXED));
+}
+
+/*
+***************************************************************************************************************
+ \fn      metrics_format(char* buf, int size)
+ \brief   renders every metric in the Prometheus text exposition format
+
+ Counters are read with relaxed atomic loads, so a scrape never waits for the modbus, curl or simulator threads
+ and they never wait for it. The series of one scrape are therefore not a consistent snapshot: a histogram
+ _count may already include a request its buckets do not.
+
+ \note    returns the length of the text, or -1 when it does not fit in size bytes
+**************************************************************************************************************
+*/
+int metrics_format(char* buf, int size)
+{
+    int i, len = 0;
+    float soc;
+    int32_t setpoint;
+
+    for ( i = 0; i < MetricCounterCount; i++ )
+    {
+        const metric_t *m = &counter_metrics[i];
+        if ( m->help )
+        {
+            _append(buf, size, &len, "# HELP %s %s\n# TYPE %s %s\n", m->name, m->help, m->name, m->type);
+        }
+        _append(buf, size, &len, m->label ? "%s{%s} %lld\n" : "%s%s %lld\n", m->name, m->label ? m->label : "",
+                (long long)__atomic_load_n(&counters[i], __ATOMIC_RELAXED));
+    }
+    for ( i = 0; i < MetricHistogramCount; i++ )
+    {
+        _format_histogram(buf, size, &len, i);
+    }
+    if ( device )
+    {
+        __atomic_load(&device->state_of_charge, &soc, __ATOMIC_RELAXED);
+        setpoint = __atomic_load_n(&device->setpoint, __ATOMIC_RELAXED);
+        _append(buf, size, &len, "# HELP battsim_state_of_charge_percent Battery state of charge\n"
+                                 "# TYPE battsim_state_of_charge_percent gauge\n"
+                                 "battsim_state_of_charge_percent{device=\"%s\"} %.2f\n", device_name, soc);
+        _append(buf, size, &len, "# HELP battsim_setpoint_kw Real power set point, negative charges\n"
+                                 "# TYPE battsim_setpoint_kw gauge\n"
+                                 "battsim_setpoint_kw{device=\"%s\"} %d\n", device_name, setpoint);
+    }
+    if ( registers )
+    {
+        _append(buf, size, &len, "# HELP battsim_registers_resident_bytes Register map memory faulted in\n"
+                                 "# TYPE battsim_registers_resident_bytes gauge\n"
+                                 "battsim_registers_resident_bytes %zu\n", regstore_resident(registers));
+    }
+    return len < size ? len : -1;
+}
+
+int _handler(void * cls,
+             struct MHD_Connection * connection,
+             const char * url,
+             const char * method,
+             const char * version,
+             const char * upload_data,
+             size_t * upload_data_size,
+             void ** ptr)
+{
+    struct MHD_Response * response;
+    char *page;
+    int len, ret;
+
+    if ( strcmp(method, "GET") != 0 )
+    {
+        return MHD_NO;
+    }
+    if ( strcmp(url, METRICS_URL) != 0 )
+    {
+        response = MHD_create_response_from_buffer(0, NULL, MHD_RESPMEM_PERSISTENT);
+        ret = MHD_queue_response(connection, MHD_HTTP_NOT_FOUND, response);
+        MHD_destroy_response(response);
+        return ret;
+    }
+
+    page = malloc(METRICS_PAGE_SIZE);
+    if ( page == NULL || (len = metrics_format(page, METRICS_PAGE_SIZE)) < 0 )
+    {
+        free(page);
+        return MHD_NO;
+    }
+    response = MHD_create_response_from_buffer(len, page, MHD_RESPMEM_MUST_FREE);
+    MHD_add_response_header(response, MHD_HTTP_HEADER_CONTENT_TYPE, METRICS_CONTENT_TYPE);
+    ret = MHD_queue_response(connection, MHD_HTTP_OK, response);
+    MHD_destroy_response(response);
+    return ret;
+}
+
+//
+// Serves GET /metrics on port from the microhttpd polling thread. The thread inherits the signal mask of the
+// caller, call it after config_block_signals() or a SIGHUP may land on it
+//
+int metrics_start(int port)
+{
+    daemon_handle = MHD_start_daemon(MHD_USE_AUTO | MHD_USE_INTERNAL_POLLING_THREAD,
+                                     port,
+                                     NULL, NULL, &_handler, NULL,
+                                     MHD_OPTION_CONNECTION_TIMEOUT, (unsigned int) 10,
+                                     MHD_OPTION_END);
+    if ( daemon_handle == NULL )
+    {
+        printf("%s unable to serve metrics on port %d\n", __PRETTY_FUNCTION__, port);
+        return -1;
+    }
+    return 0;
+}
+
+void metrics_stop()
+{
+    if ( daemon_handle )
+    {
+        MHD_stop_daemon(daemon_handle);
+        daemon_handle = NULL;
+    }
+}
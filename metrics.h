@@ -0,0 +1,67 @@
+/*
+ * Copyright © kiwipower 2017
+ *
+ * Header file for the Prometheus style metrics endpoint
+ */
+#ifndef METRICS_DOT_H
+#define METRICS_DOT_H
+
+#include <stdint.h>
+#include <modbus/modbus.h>
+#include "battery.h"
+
+#define METRICS_BUCKETS         18            // latency buckets including +Inf
+#define METRICS_PAGE_SIZE       16384         // rendered exposition text
+
+enum MetricCounter
+{
+    MetricRequestsRead = 0,                     // FC 0x03
+    MetricRequestsWrite,                        // FC 0x06
+    MetricRequestsWriteMultiple,                // FC 0x10
+    MetricRequestsWriteRead,                    // FC 0x17
+    MetricRequestsOther,                        // anything else, answered with an exception
+    MetricRequestExceptions,
+    MetricConnections,                          // accepted so far
+    MetricConnectionsActive,                    // gauge
+    MetricRequestsThrottled,                    // requests held back by their connection's rate limit
+    MetricQueueDepthControl,                    // gauge, set points waiting for the uplink
+    MetricQueueDepthBulk,                       // gauge, readings waiting for the uplink
+    MetricCurlRequests,
+    MetricCurlErrors,
+    MetricUplinkBodyBytes,                      // readings bodies before compression
+    MetricUplinkWireBytes,                      // readings bodies as sent
+    MetricIngestRequests,
+    MetricIngestErrors,                         // readings that are not JSON
+    MetricAggregateWindows,                     // aggregates forwarded instead of the readings
+    MetricAggregateEvents,                      // state of charge jumps forwarded at once
+    MetricTelemetryDropped,                     // telemetry rows lost, no segment was ready
+    MetricTicks,
+    MetricTickOverruns,
+    MetricCounterCount
+};
+
+enum MetricHistogram
+{
+    MetricRequestLatency = 0,                   // decode, handler and reply of a modbus request
+    MetricQueueTimeControl,                     // uplink set point enqueue to dequeue
+    MetricQueueTimeBulk,                        // uplink readings enqueue to dequeue
+    MetricCurlLatencyControl,                   // one uplink set point transfer
+    MetricCurlLatencyBulk,                      // one uplink readings transfer
+    MetricIngestParse,                          // readings JSON parse
+    MetricHistogramCount
+};
+
+//
+// Public functions
+//
+int      metrics_start(int port);
+void     metrics_stop();
+void     metrics_device(const char* name, const battery_t* battery);
+void     metrics_registers(const modbus_mapping_t* mb_mapping);
+uint64_t metrics_now();
+void     metrics_add(int counter, int64_t n);
+void     metrics_observe(int histogram, uint64_t nanoseconds);
+void     metrics_request(uint8_t fc, int exception, uint64_t nanoseconds);
+int      metrics_format(char* buf, int size);
+
+#endif
@@ -2,6 +2,12 @@
 #include <stdlib.h>
 #include "nec.h"
 #include "typedefs.h"
+#include "battery.h"
+#include "tick.h"
+#include "rt.h"
+#include "telemetry.h"
+#include "regmap.h"
+#include "trace.h"
 #include <unistd.h>
 #include <signal.h>
 #include <error.h>
@@ -12,10 +18,6 @@
 #include <stdbool.h>
 #include <pthread.h>
 
-#define BATTERY_POWER_RATING            230           // kW
-#define TIME_CHARGE_FROM_0_TO_100       3000          // seconds
-#define TIME_DISCHARGE_FROM_100_TO_0    2800          // seconds
-
 // Private data
 static modbus_t* ctx;
 static modbus_mapping_t *mb_mapping;
@@ -26,21 +28,11 @@ static pthread_t thread1;
 static uint8_t terminate1;
 
 static uint16_t averagesoc_multiplier = 10;
-static float battery_discharge_decrement = 0.0;
-static float battery_charge_increment = 0.0;
-static bool battery_charging = false;
-static bool battery_discharging = false;
-static uint16_t heartbeat = 0;
-static uint16_t dispatch_mode_enable = 0;
-static uint16_t real_power_output = 0;
-static float state_of_charge;
-
-static const uint16_t sign_bit_mask             = 0x8000;
+static battery_t *battery;
+static device_state_t *device;                                  // heartbeat and set point, see device_state_t
+
 static const int HeartbeatFromPGMask            = 1;
 static const int HeartBeatIntervalInSeconds     = 5;
-static const float state_of_charge_default      = 50.00;
-static const float battery_charge_resolution    = 100.00 / (BATTERY_POWER_RATING * TIME_CHARGE_FROM_0_TO_100);     // % increase in charge per sec
-static const float battery_discharge_resolution = 100.00 / (BATTERY_POWER_RATING * TIME_DISCHARGE_FROM_100_TO_0);  // % decrease in charge per sec
 static const float battery_fully_charged        = 100.00;
 static const float battery_fully_discharged     = 0.0;
 
@@ -61,6 +53,13 @@ static int _pslewrate(uint16_t);
 static int _qslewrate(uint16_t);
 
 const char* OperatingModecontrolName(uint16_t val);
+
+static const read_hook_t read_hooks[] =
+{
+    { realpoweroutput, 1, _realpoweroutput },
+    { averagesoc,      1, _averagesoc }
+};
+
 //
 // Lookup table for process functions
 //
@@ -74,14 +73,6 @@ int nec_process_single_register(uint16_t address, uint16_t data)
             retval = _enableDebugTrace(data);
             break;
 
-        case realpoweroutput:
-            retval = _realpoweroutput();
-            break;
-
-        case averagesoc:
-            retval = _averagesoc();
-            break;
-
         case RealPowerSetPoint:
             retval = _RealPowerSetPoint(data);
             break;
@@ -138,16 +129,9 @@ int nec_process_single_register(uint16_t address, uint16_t data)
 int _enableDebugTrace(uint16_t value)
 {
     debug =  value & 0x0001;
-    uint16_t *address;
-    uint16_t address_offset;
 
-    printf("%s - %s\n", __PRETTY_FUNCTION__, debug?"TRUE":"FALSE");
-    address_offset = mb_mapping->start_registers + enableDebugTrace;
-    address = mb_mapping->tab_registers + address_offset;
-    if ( address < (mb_mapping->tab_registers + mb_mapping-> nb_registers) )
-    {
-       *address = debug;
-    }
+    trace_debug(debug);
+    regmap_write16(mb_mapping, enableDebugTrace, debug);
     return MODBUS_SUCCESS;
 }
 
@@ -157,7 +141,7 @@ int _enableDebugTrace(uint16_t value)
 int _ackalarams (uint16_t value)
 {
     int retval = MODBUS_SUCCESS;
-    if (debug) printf("%s\n", __PRETTY_FUNCTION__);
+    trace_event(TraceRegisterWrite, ackalarams, value);
     //alarm(val);
     return retval;
 }
@@ -167,17 +151,12 @@ int _ackalarams (uint16_t value)
 //
 int _averagesoc()
 {
-    uint16_t *address;
-    uint16_t address_offset;
+    uint16_t value;
     int retval = MODBUS_SUCCESS; // need to figure out what this constant is
 
-    address_offset = mb_mapping->start_registers + averagesoc;
-    address = mb_mapping->tab_registers + address_offset;
-    if ( address < (mb_mapping->tab_registers + mb_mapping-> nb_registers) )
-    {
-        *address = state_of_charge * averagesoc_multiplier;
-    }
-    if (debug) printf("%s - soc(%d) \n", __PRETTY_FUNCTION__, *address );
+    value = battery->state_of_charge * averagesoc_multiplier;
+    regmap_write16(mb_mapping, averagesoc, value);
+    trace_event(TraceRegisterRead, averagesoc, value);
     return retval;
 }
 
@@ -190,14 +169,13 @@ int _averagesoc()
 int _dispatchmode(uint16_t value)
 {
     int retval = MODBUS_SUCCESS;
-    if (debug) printf("%s val(%d)\n", __PRETTY_FUNCTION__, value );
+    trace_event(TraceRegisterWrite, dispatchmode, value);
 
     switch (value)
     {
     case DispatchModeIdle:
     case DispatchModeDispatch:
-        dispatch_mode_enable = value;
-        break;
+        break;                                  // nec_tick() reads the mode from the register
 
     default:
         retval = MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE;
@@ -211,15 +189,14 @@ int _dispatchmode(uint16_t value)
 //
 int _HeartbeatFromPGM (uint16_t value)
 {
-    static uint16_t toggle = 0;
     uint16_t val = value;
 
-    if (debug) printf("%s val(%d)\n", __PRETTY_FUNCTION__, value );
+    trace_event(TraceHeartbeat, HeartbeatFromPGM, value);
     val &= HeartbeatFromPGMask;   // mask off unwanted bits
-    if ( toggle ^ val )
+    if ( device->heartbeat_last ^ val )
     {
-        toggle = val;
-        heartbeat = 0;
+        device->heartbeat_last = val;
+        device->heartbeat = 0;
     }
     return MODBUS_SUCCESS;
 }
@@ -233,7 +210,7 @@ int _HeartbeatFromPGM (uint16_t value)
 int _modecontrol(uint16_t value)
 {
     int retval = MODBUS_SUCCESS; // need to figure out what this constant is
-    if (debug) printf("%s %s, value(%d)\n", __PRETTY_FUNCTION__, OperatingModecontrolName(value), value);
+    trace_event(TraceRegisterWrite, modecontrol, value);
 
     switch (value)
     {
@@ -256,7 +233,7 @@ int _powerblockenablecontrol12H (uint16_t value)
 {
     int retval = MODBUS_SUCCESS;
 
-    if (debug) printf("%s val(%d)\n", __PRETTY_FUNCTION__, value );
+    trace_event(TraceRegisterWrite, powerblockenablecontrol12H, value);
 
     return retval;
 }
@@ -269,7 +246,7 @@ int _powerblockenablecontrol12L (uint16_t value)
 {
     int retval = MODBUS_SUCCESS;
 
-    if (debug) printf("%s val(%d)\n", __PRETTY_FUNCTION__, value );
+    trace_event(TraceRegisterWrite, powerblockenablecontrol12L, value);
 
     return retval;
 }
@@ -283,29 +260,21 @@ int _realpoweroutput()
 {
     int retval = MODBUS_SUCCESS;
     int val;
-    uint16_t *address;
-    uint16_t address_offset;
-
-    if (debug) printf("%s \n", __PRETTY_FUNCTION__ );
 
-    if (battery_charging)
+    if (battery->charging)
     {
-          val = (int) (state_of_charge == battery_fully_charged) ? 0 : real_power_output;
+          val = (int) (battery->state_of_charge == battery_fully_charged) ? 0 : device->setpoint;
     }
-    else if (battery_discharging)
+    else if (battery->discharging)
     {
-        val = (int) (state_of_charge == battery_fully_discharged) ? 0 : real_power_output;
+        val = (int) (battery->state_of_charge == battery_fully_discharged) ? 0 : device->setpoint;
     }
     else
     {
-        val = real_power_output;
-    }
-    address_offset = mb_mapping->start_registers + realpoweroutput;
-    address = mb_mapping->tab_registers + address_offset;
-    if ( address < (mb_mapping->tab_registers + mb_mapping-> nb_registers) )
-    {
-        *address = val;
+        val = device->setpoint;
     }
+    regmap_write16(mb_mapping, realpoweroutput, val);
+    trace_event(TraceRegisterRead, realpoweroutput, (int16_t)val);
 
     return retval;
 }
@@ -318,30 +287,11 @@ int _RealPowerSetPoint(uint16_t value)
 {
 
     int retval = MODBUS_SUCCESS;
-    uint16_t val = value;
 
-    real_power_output  = val;                             // store set point value
-    if ( val & sign_bit_mask )
-    {
-        val = ((~val) + 1);                            // get 2nd complement value
-        if (debug) printf("%s - battery charging val(-%d)\n", __PRETTY_FUNCTION__, val);
-        battery_charging = true;
-        battery_discharging = false;
-        battery_charge_increment = ( val * battery_charge_resolution);  ;
-    }
-    else if (val > 0)
-    {
-        if (debug) printf("%s - battery discharging val(%d)\n", __PRETTY_FUNCTION__, val);
-        battery_discharging = true;
-        battery_charging = false;
-        battery_discharge_decrement = (val * battery_discharge_resolution);
-    }
-    else
-    {
-        if (debug) printf("%s - not charging val(%d)\n", __PRETTY_FUNCTION__, val);
-        battery_discharging = false;
-        battery_charging = false;
-    }
+    device->setpoint = value;                             // store set point value
+    trace_event(TraceSetpoint, RealPowerSetPoint, (int16_t)value);
+    battery_setpoint(battery, (int16_t)value);
+    telemetry_record(TelemetrySetpoint, battery, device->heartbeat);
     return retval;
 }
 
@@ -353,7 +303,7 @@ int _ReactivePowerSetPoint(uint16_t value)
 {
     int retval = MODBUS_SUCCESS;
 
-    if (debug) printf("%s value %d\n", __PRETTY_FUNCTION__, value);
+    trace_event(TraceRegisterWrite, ReactivePowerSetPoint, (int16_t)value);
 
     return retval;
 }
@@ -365,7 +315,7 @@ int _pslewrate(uint16_t value)
 {
     int retval = MODBUS_SUCCESS;
 
-    if (debug) printf("%s val(%d)\n", __PRETTY_FUNCTION__, value );
+    trace_event(TraceRegisterWrite, pslewrate, value);
 
     return retval;
 }
@@ -377,7 +327,7 @@ int _qslewrate(uint16_t value)
 {
     int retval = MODBUS_SUCCESS;
 
-    if (debug) printf("%s val(%d)\n", __PRETTY_FUNCTION__, value );
+    trace_event(TraceRegisterWrite, qslewrate, value);
     return retval;
 }
 
@@ -407,7 +357,7 @@ const char* OperatingModecontrolName(uint16_t val)
 int _SocRef (uint16_t value)
 {
     int retval = MODBUS_SUCCESS;
-    if (debug) printf("%s val(%d)\n", __PRETTY_FUNCTION__, value );
+    trace_event(TraceRegisterWrite, SocRef, value);
     return retval;
 }
 
@@ -415,12 +365,22 @@ int _SocRef (uint16_t value)
 void nec_init(init_param_t* init_param)
 {
     thread_param_t* nec_thread_param;
-    nec_disconnect();                                           // set default SoC
-    setvbuf(stdout, NULL, _IONBF, 0);                          // disable stdout buffering
+    battery = init_param->battery;
+    device = init_param->device;
+    if ( !init_param->passive )
+    {
+        battery_init(battery, &init_param->battery_param);     // set default SoC
+        memset(device, 0, sizeof(device_state_t));
+    }
     mb_mapping = init_param->modbus_mapping;
     terminate1 = FALSE;
+    if ( init_param->headless || init_param->passive )
+    {
+        return;                                                // caller or worker 0 drives nec_tick()
+    }
     nec_thread_param = (thread_param_t*) malloc(sizeof (thread_param_t));
     nec_thread_param -> terminate = &terminate1;
+    nec_thread_param -> tick_rate = init_param->tick_rate;
     pthread_create( &thread1, NULL, nec_thread_handler, nec_thread_param);
 }
 
@@ -432,77 +392,74 @@ void nec_dispose()
 
 void nec_disconnect()
 {
-    state_of_charge = state_of_charge_default;
+    battery_reset(battery);
 }
 
 
+//
+// Refreshes the computed registers within the range of a read
+//
+int nec_read_registers(uint16_t start_address, uint16_t quantity)
+{
+    return regmap_read_hooks(read_hooks, sizeof(read_hooks) / sizeof(read_hooks[0]), start_address, quantity);
+}
+
 int nec_write_multiple_addresses(uint16_t start_address, uint16_t quantity, uint8_t* pdata)
 {
     uint16_t *address;
-    uint16_t address_offset;
-    uint16_t i, data;
+    uint16_t i;
+    int retval;
 
-    address_offset = mb_mapping->start_registers + start_address;
-    address = mb_mapping->tab_registers + address_offset;
+    retval = regmap_write_block(mb_mapping, start_address, quantity, pdata);
+    if ( retval != MODBUS_SUCCESS )
+    {
+        return retval;
+    }
+    address = mb_mapping->tab_registers + (start_address - mb_mapping->start_registers);
     for ( i = 0; i < quantity; i++ )
     {
-        if ( address < (mb_mapping->tab_registers + mb_mapping-> nb_registers) )
-        {
-            data = (*pdata++ << 8) | *pdata++;
-            *address++  = data;
-            nec_process_single_register(start_address + i, data);
-        }
+        nec_process_single_register(start_address + i, address[i]);
     }
     return MODBUS_SUCCESS;
 }
 
+//
+// Advances the simulation by the given number of seconds. The battery only moves while dispatching. The
+// mode is taken from the register map, which worker processes share, not from the process that took the write
+//
+void nec_tick(float seconds)
+{
+    if ( device->heartbeat > HeartBeatIntervalInSeconds )
+    {
+        device->heartbeat = 0;
+        trace_event(TraceHeartbeatExpired, HeartBeatIntervalInSeconds, 0);
+    }
+    if ( mb_mapping->tab_registers[dispatchmode - mb_mapping->start_registers] == DispatchModeDispatch )
+    {
+        battery_tick(battery, seconds);
+    }
+    device->heartbeat += seconds;
+    telemetry_record(TelemetryTick, battery, device->heartbeat);
+}
+
 //
 // Thread handler
 //
 void *nec_thread_handler( void *ptr )
 {
     uint8_t *terminate;
+    tick_t tick;
     thread_param_t* param = (thread_param_t*) ptr;
     ctx = param->ctx;
     terminate = param->terminate;
+    tick_init(&tick, "nec", param->tick_rate);
     free(param);
+    rt_apply(RtTick);
 
     while ( *terminate == false )
     {
-        sleep(1);
-        if ( heartbeat > HeartBeatIntervalInSeconds )
-        {
-            heartbeat = 0;
-            if (debug) printf("heartbeat not received\n");
-        }
-        if ( dispatch_mode_enable == DispatchModeDispatch )
-        {
-            if (battery_charging)
-            {
-                if ( (state_of_charge + battery_charge_increment) <= battery_fully_charged )
-                {
-                    state_of_charge += battery_charge_increment;
-                }
-                else
-                {
-                    state_of_charge = battery_fully_charged;
-                    battery_charging = false;
-                }
-            }
-            else if (battery_discharging)
-            {
-                if ( (state_of_charge - battery_discharge_decrement) >= battery_fully_discharged )
-                {
-                    state_of_charge -= battery_discharge_decrement;
-                }
-                else
-                {
-                    state_of_charge = battery_fully_discharged;
-                    battery_discharging = false;
-                }
-            }
-        }
-        heartbeat++;
+        nec_tick(tick_wait(&tick));
     }
+    tick_stats_print(&tick);
+    return 0;
 }
-
@@ -0,0 +1,657 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <limits.h>
+#include <pthread.h>
+#include "profile.h"
+#include "typedefs.h"
+#include "battery.h"
+#include "tick.h"
+#include "rt.h"
+#include "telemetry.h"
+#include "regmap.h"
+#include "trace.h"
+#include "regstore.h"
+
+#define PROFILE_HEARTBEAT_TIMEOUT_DEFAULT   60          // seconds
+#define PROFILE_ADDRESS_SPACE               65536
+
+typedef struct profile_keyword_struct
+{
+    const char *name;
+    uint8_t kind;
+}profile_keyword_t;
+
+// Private data
+static const profile_keyword_t keywords[] =
+{
+    { "debug",     ProfileBindingDebug },
+    { "value",     ProfileBindingValue },
+    { "constant",  ProfileBindingConstant },
+    { "setpoint",  ProfileBindingSetpoint },
+    { "dispatch",  ProfileBindingDispatch },
+    { "heartbeat", ProfileBindingHeartbeat },
+    { "soc",       ProfileBindingSoc },
+    { "power",     ProfileBindingPower }
+};
+
+static char name[32] = "PROFILE";
+static profile_binding_t bindings[PROFILE_MAX_BINDINGS + 1];   // slot 0 means not in the profile
+static int binding_count = 0;
+static uint8_t slots[PROFILE_ADDRESS_SPACE];                  // register address -> binding slot
+static uint8_t readouts[PROFILE_MAX_BINDINGS];                // slots computed on read, sorted by address
+static int readout_count = 0;
+static float heartbeatTimeout = PROFILE_HEARTBEAT_TIMEOUT_DEFAULT;
+static bool dispatch_gated = false;
+static uint16_t dispatch_address = 0;
+
+static modbus_mapping_t *mb_mapping;
+static battery_t *battery;
+static pthread_t thread1;
+static uint8_t terminate1;
+static bool debug = false;
+static device_state_t *device;                                // heartbeat, see device_state_t
+
+static int      _parse_register(char* args, int lineno);
+static int      _compare_readouts(const void* a, const void* b);
+static bool     _signed(const profile_binding_t* b);
+static bool     _readonly(const profile_binding_t* b);
+static int32_t  _decode(const profile_binding_t* b, uint32_t raw);
+static void     _encode(const profile_binding_t* b, int32_t value, uint16_t* registers);
+static uint16_t _payload_word(uint32_t address, uint16_t start_address, uint16_t quantity, const uint8_t* pdata);
+static int      _check(const profile_binding_t* b, int32_t value);
+static void     _apply(const profile_binding_t* b, int32_t value);
+static int32_t  _readout(const profile_binding_t* b);
+
+
+bool _signed(const profile_binding_t* b)
+{
+    return b->kind == ProfileBindingSetpoint || b->kind == ProfileBindingPower || b->min < 0;
+}
+
+bool _readonly(const profile_binding_t* b)
+{
+    return b->kind == ProfileBindingConstant || b->kind == ProfileBindingSoc || b->kind == ProfileBindingPower;
+}
+
+int32_t _decode(const profile_binding_t* b, uint32_t raw)
+{
+    if ( b->width == 2 )
+    {
+        return (int32_t)raw;
+    }
+    return _signed(b) ? (int16_t)raw : (uint16_t)raw;
+}
+
+void _encode(const profile_binding_t* b, int32_t value, uint16_t* registers)
+{
+    if ( b->width == 2 )
+    {
+        registers[0] = (uint32_t)value >> 16;
+        registers[1] = (uint32_t)value;
+    }
+    else
+    {
+        registers[0] = (uint16_t)value;
+    }
+}
+
+int _compare_readouts(const void* a, const void* b)
+{
+    return bindings[*(const uint8_t*)a].address - bindings[*(const uint8_t*)b].address;
+}
+
+//
+// register <address> <binding> [scale=] [min=] [max=] [values=] [width=] [mask=] [value=] [string=]
+//
+int _parse_register(char* args, int lineno)
+{
+    profile_binding_t *b;
+    char *tok, *address = strtok(args, " \t\r\n"), *kind = strtok(NULL, " \t\r\n"), *end;
+    unsigned long i;
+    bool min_given = false;
+
+    if ( address == NULL || kind == NULL )
+    {
+        printf("%s line %d: expected register <address> <binding>\n", __PRETTY_FUNCTION__, lineno);
+        return -1;
+    }
+    if ( binding_count == PROFILE_MAX_BINDINGS )
+    {
+        printf("%s line %d: more than %d registers\n", __PRETTY_FUNCTION__, lineno, PROFILE_MAX_BINDINGS);
+        return -1;
+    }
+    i = strtoul(address, &end, 0);
+    if ( end == address || *end != '\0' || i >= PROFILE_ADDRESS_SPACE )
+    {
+        printf("%s line %d: bad register address %s\n", __PRETTY_FUNCTION__, lineno, address);
+        return -1;
+    }
+    b = &bindings[binding_count + 1];
+    memset(b, 0, sizeof(profile_binding_t));
+    b->address = i;
+    b->width = 1;
+    b->scale = 1.0;
+    b->max = INT_MAX;
+    b->mask = 0xffff;
+    for ( i = 0; i < sizeof(keywords) / sizeof(keywords[0]); i++ )
+    {
+        if ( strcmp(kind, keywords[i].name) == 0 )
+        {
+            b->kind = keywords[i].kind;
+        }
+    }
+    if ( b->kind == ProfileBindingNone )
+    {
+        printf("%s line %d: unknown binding %s\n", __PRETTY_FUNCTION__, lineno, kind);
+        return -1;
+    }
+
+    while ( (tok = strtok(NULL, " \t\r\n")) != NULL )
+    {
+        char *value = strchr(tok, '=');
+        if ( value == NULL )
+        {
+            printf("%s line %d: expected key=value, got %s\n", __PRETTY_FUNCTION__, lineno, tok);
+            return -1;
+        }
+        *value++ = '\0';
+        if      ( strcmp(tok, "scale")  == 0 ) b->scale = atof(value);
+        else if ( strcmp(tok, "min")    == 0 )
+        {
+            b->min = strtol(value, NULL, 0);
+            min_given = true;
+        }
+        else if ( strcmp(tok, "max")    == 0 ) b->max   = strtol(value, NULL, 0);
+        else if ( strcmp(tok, "width")  == 0 ) b->width = atoi(value);
+        else if ( strcmp(tok, "mask")   == 0 ) b->mask  = strtoul(value, NULL, 0);
+        else if ( strcmp(tok, "value")  == 0 ) b->value = strtol(value, NULL, 0);
+        else if ( strcmp(tok, "string") == 0 ) strncpy(b->string, value, sizeof(b->string) - 1);
+        else if ( strcmp(tok, "values") == 0 )
+        {
+            do
+            {
+                if ( b->value_count == PROFILE_MAX_VALUES )
+                {
+                    printf("%s line %d: more than %d values\n", __PRETTY_FUNCTION__, lineno, PROFILE_MAX_VALUES);
+                    return -1;
+                }
+                b->values[b->value_count++] = strtol(value, &end, 0);
+                value = end + 1;
+            } while ( *end == ',' );
+        }
+        else
+        {
+            printf("%s line %d: unknown key %s\n", __PRETTY_FUNCTION__, lineno, tok);
+            return -1;
+        }
+    }
+
+    if ( !min_given )
+    {
+        b->min = b->kind == ProfileBindingSetpoint || b->kind == ProfileBindingPower ? INT_MIN : 0;
+    }
+    if ( b->string[0] )
+    {
+        b->width = (strlen(b->string) + 1) / 2;
+    }
+    else if ( b->width != 1 && b->width != 2 )
+    {
+        printf("%s line %d: width must be 1 or 2\n", __PRETTY_FUNCTION__, lineno);
+        return -1;
+    }
+    if ( b->scale == 0 || (uint32_t)b->address + b->width > PROFILE_ADDRESS_SPACE )
+    {
+        printf("%s line %d: invalid scale or address\n", __PRETTY_FUNCTION__, lineno);
+        return -1;
+    }
+    for ( i = b->address; i < (unsigned long)b->address + b->width; i++ )
+    {
+        if ( slots[i] )
+        {
+            printf("%s line %d: register %lu already bound\n", __PRETTY_FUNCTION__, lineno, i);
+            return -1;
+        }
+        slots[i] = binding_count + 1;
+    }
+    if ( b->kind == ProfileBindingSoc || b->kind == ProfileBindingPower )
+    {
+        readouts[readout_count++] = binding_count + 1;
+    }
+    if ( b->kind == ProfileBindingDispatch )
+    {
+        dispatch_gated = true;
+        dispatch_address = b->address;
+    }
+    binding_count++;
+    return 0;
+}
+
+/*
+***************************************************************************************************************
+ \fn      profile_load(const char* filename)
+ \brief   compiles a register profile into the lookup table
+
+ One directive per line, '#' starts a comment:
+
+      name      <vendor name>
+      heartbeat <seconds before a missing heartbeat is reported>
+      register  <address> <binding> [key=value ...]
+
+ Bindings: debug, value, constant, setpoint, dispatch, heartbeat, soc and power. Keys: scale (engineering
+ value = register * scale), min and max (writes outside are rejected), values (a list such as 0,4,32, other
+ writes are rejected), width (1 or 2 registers, high word first), mask (heartbeat bits), value and string
+ (constants). A single register is signed for setpoint and power bindings or when min is negative, min
+ defaults to 0 otherwise.
+
+ Every register address indexes straight into a 64K slot table, so dispatching a request costs one load
+ and one switch, the same as the hand written vendor switch statements.
+**************************************************************************************************************
+*/
+int profile_load(const char* filename)
+{
+    FILE *fp;
+    char line[256];
+    int lineno = 0, retval = 0;
+
+    fp = fopen(filename, "r");
+    if ( fp == NULL )
+    {
+        printf("%s unable to open %s: %s\n", __PRETTY_FUNCTION__, filename, strerror(errno));
+        return -1;
+    }
+    while ( retval == 0 && fgets(line, sizeof(line), fp) )
+    {
+        char *p, *directive;
+
+        lineno++;
+        if ( (p = strchr(line, '#')) != NULL ) *p = '\0';
+        directive = strtok(line, " \t\r\n");
+        if ( directive == NULL )
+        {
+            continue;
+        }
+        p = strtok(NULL, "");                                 // rest of the line
+        if ( strcmp(directive, "name") == 0 && p && (p = strtok(p, " \t\r\n")) != NULL )
+        {
+            strncpy(name, p, sizeof(name) - 1);
+        }
+        else if ( strcmp(directive, "heartbeat") == 0 && p )
+        {
+            heartbeatTimeout = atof(p);
+        }
+        else if ( strcmp(directive, "register") == 0 && p )
+        {
+            retval = _parse_register(p, lineno);
+        }
+        else
+        {
+            printf("%s line %d: unknown directive\n", __PRETTY_FUNCTION__, lineno);
+            retval = -1;
+        }
+    }
+    fclose(fp);
+    qsort(readouts, readout_count, sizeof(readouts[0]), _compare_readouts);
+    return retval;
+}
+
+const char* profile_name()
+{
+    return name;
+}
+
+//
+// Register image holding the constants, see regstore_defaults(). -1 if the profile has none
+//
+int profile_defaults(int nb_registers)
+{
+    uint16_t *image;
+    int i, j, fd = -1;
+    bool constants = false;
+
+    image = calloc(nb_registers, sizeof(uint16_t));
+    if ( image == NULL )
+    {
+        return -1;
+    }
+    for ( i = 1; i <= binding_count; i++ )
+    {
+        const profile_binding_t *b = &bindings[i];
+
+        if ( b->kind != ProfileBindingConstant || b->address + b->width > nb_registers )
+        {
+            continue;
+        }
+        constants = true;
+        if ( b->string[0] )
+        {
+            for ( j = 0; j < b->width; j++ )
+            {
+                image[b->address + j] = ((uint8_t)b->string[j * 2] << 8) | (uint8_t)b->string[(j * 2) + 1];
+            }
+        }
+        else
+        {
+            _encode(b, b->value, &image[b->address]);
+        }
+    }
+    if ( constants )
+    {
+        fd = regstore_defaults(image, nb_registers);
+    }
+    free(image);
+    return fd;
+}
+
+bool profile_setpoint(uint16_t* address, uint16_t* quantity, float* scale)
+{
+    int i;
+
+    for ( i = 1; i <= binding_count; i++ )
+    {
+        if ( bindings[i].kind == ProfileBindingSetpoint )
+        {
+            *address = bindings[i].address;
+            *quantity = bindings[i].width;
+            *scale = bindings[i].scale;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool profile_dispatch(uint16_t* address)
+{
+    int i;
+
+    for ( i = 1; i <= binding_count; i++ )
+    {
+        if ( bindings[i].kind == ProfileBindingDispatch )
+        {
+            *address = bindings[i].address;
+            return true;
+        }
+    }
+    return false;
+}
+
+int _check(const profile_binding_t* b, int32_t value)
+{
+    int i;
+
+    if ( _readonly(b) )
+    {
+        return MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS;
+    }
+    if ( value < b->min || value > b->max )
+    {
+        return MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE;
+    }
+    for ( i = 0; i < b->value_count; i++ )
+    {
+        if ( b->values[i] == value )
+        {
+            return MODBUS_SUCCESS;
+        }
+    }
+    return b->value_count ? MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE : MODBUS_SUCCESS;
+}
+
+void _apply(const profile_binding_t* b, int32_t value)
+{
+    uint16_t toggle;
+
+    switch ( b->kind )
+    {
+    case ProfileBindingDebug:
+        debug = value & 0x0001;
+        trace_debug(debug);
+        break;
+
+    case ProfileBindingSetpoint:
+        trace_event(TraceSetpoint, b->address, (int32_t)(value * b->scale));
+        battery_setpoint(battery, (int32_t)(value * b->scale));
+        telemetry_record(TelemetrySetpoint, battery, device->heartbeat);
+        break;
+
+    case ProfileBindingDispatch:
+        trace_event(TraceRegisterWrite, b->address, value);
+        break;
+
+    case ProfileBindingHeartbeat:
+        toggle = value & b->mask;
+        if ( toggle != device->heartbeat_last )
+        {
+            device->heartbeat_last = toggle;
+            device->heartbeat = 0;
+        }
+        break;
+
+    default:
+        trace_event(TraceRegisterWrite, b->address, value);
+        break;
+    }
+}
+
+int32_t _readout(const profile_binding_t* b)
+{
+    float power = battery->setpoint;
+
+    if ( b->kind == ProfileBindingSoc )
+    {
+        return (int32_t)(battery->state_of_charge / b->scale);
+    }
+    if ( (!battery->charging && power < 0) || (!battery->discharging && power > 0) )
+    {
+        power = 0;                                  // full or empty, nothing is delivered
+    }
+    return (int32_t)(power / b->scale);
+}
+
+//
+// FC 0x06. The high word of a two register value is latched until its low word is written
+//
+int profile_process_single_register(uint16_t address, uint16_t data)
+{
+    const profile_binding_t *b = &bindings[slots[address]];
+    int32_t value;
+    int retval;
+
+    if ( slots[address] == 0 )
+    {
+        return MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS;
+    }
+    if ( b->width == 2 )
+    {
+        if ( address == b->address )
+        {
+            return _readonly(b) ? MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS : MODBUS_SUCCESS;
+        }
+        value = (int32_t)((regmap_read32(mb_mapping, b->address) & 0xffff0000) | data);
+    }
+    else
+    {
+        value = _decode(b, data);
+    }
+    retval = _check(b, value);
+    if ( retval == MODBUS_SUCCESS )
+    {
+        _apply(b, value);
+    }
+    return retval;
+}
+
+uint16_t _payload_word(uint32_t address, uint16_t start_address, uint16_t quantity, const uint8_t* pdata)
+{
+    if ( address >= start_address && address < (uint32_t)start_address + quantity )
+    {
+        pdata += (address - start_address) * 2;
+        return (pdata[0] << 8) | pdata[1];
+    }
+    return mb_mapping->tab_registers[address - mb_mapping->start_registers];
+}
+
+//
+// FC 0x10. Every binding the block touches is validated before anything is stored, then the block is
+// published in one go and each binding sees its whole, decoded value once
+//
+int profile_write_multiple_addresses(uint16_t start_address, uint16_t quantity, uint8_t* pdata)
+{
+    uint32_t address, end = (uint32_t)start_address + quantity;
+    int retval;
+
+    if ( end > PROFILE_ADDRESS_SPACE )
+    {
+        return MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS;
+    }
+    for ( address = start_address; address < end; )
+    {
+        const profile_binding_t *b = &bindings[slots[address]];
+        uint32_t raw;
+
+        if ( slots[address] == 0 )
+        {
+            address++;
+            continue;
+        }
+        raw = _payload_word(b->address, start_address, quantity, pdata);
+        if ( b->width == 2 )
+        {
+            raw = (raw << 16) | _payload_word(b->address + 1, start_address, quantity, pdata);
+        }
+        retval = _check(b, _decode(b, raw));
+        if ( retval != MODBUS_SUCCESS )
+        {
+            return retval;
+        }
+        address = b->address + b->width;
+    }
+
+    retval = regmap_write_block(mb_mapping, start_address, quantity, pdata);
+    for ( address = start_address; retval == MODBUS_SUCCESS && address < end; )
+    {
+        const profile_binding_t *b = &bindings[slots[address]];
+
+        if ( slots[address] == 0 )
+        {
+            address++;
+            continue;
+        }
+        if ( b->width == 2 )
+        {
+            _apply(b, _decode(b, regmap_read32(mb_mapping, b->address)));
+        }
+        else
+        {
+            _apply(b, _decode(b, mb_mapping->tab_registers[b->address - mb_mapping->start_registers]));
+        }
+        address = b->address + b->width;
+    }
+    return retval;
+}
+
+//
+// Refreshes the soc and power readouts within the range of a read
+//
+int profile_read_registers(uint16_t start_address, uint16_t quantity)
+{
+    int i;
+
+    for ( i = 0; i < readout_count; i++ )
+    {
+        const profile_binding_t *b = &bindings[readouts[i]];
+
+        if ( b->address >= (uint32_t)start_address + quantity )
+        {
+            break;
+        }
+        if ( !regmap_overlaps(start_address, quantity, b->address, b->width) )
+        {
+            continue;
+        }
+        if ( b->width == 2 )
+        {
+            regmap_write32(mb_mapping, b->address, _readout(b));
+        }
+        else
+        {
+            regmap_write16(mb_mapping, b->address, (uint16_t)_readout(b));
+        }
+    }
+    return MODBUS_SUCCESS;
+}
+
+void profile_init(init_param_t* param)
+{
+    thread_param_t* profile_thread_param;
+    battery = param->battery;
+    device = param->device;
+    if ( !param->passive )
+    {
+        battery_init(battery, &param->battery_param);          // set default SoC
+        memset(device, 0, sizeof(device_state_t));
+    }
+    mb_mapping = param->modbus_mapping;
+    terminate1 = FALSE;
+    if ( param->headless || param->passive )
+    {
+        return;                                                // caller or worker 0 drives profile_tick()
+    }
+    profile_thread_param = (thread_param_t*) malloc(sizeof (thread_param_t));
+    profile_thread_param -> terminate = &terminate1;
+    profile_thread_param -> tick_rate = param->tick_rate;
+    pthread_create( &thread1, NULL, profile_thread_handler, profile_thread_param);
+}
+
+void profile_dispose()
+{
+    terminate1 = true;
+    pthread_join(thread1, NULL);
+}
+
+void profile_disconnect()
+{
+    battery_reset(battery);
+}
+
+//
+// Advances the simulation by the given number of seconds. With a dispatch register the battery only
+// moves while it is non zero, read from the register map so every worker process sees the same
+//
+void profile_tick(float seconds)
+{
+    if ( device->heartbeat > heartbeatTimeout )
+    {
+        trace_event(TraceHeartbeatExpired, (int32_t)heartbeatTimeout, 0);
+        device->heartbeat = 0;
+    }
+    if ( !dispatch_gated || mb_mapping->tab_registers[dispatch_address - mb_mapping->start_registers] )
+    {
+        battery_tick(battery, seconds);
+    }
+    device->heartbeat += seconds;
+    telemetry_record(TelemetryTick, battery, device->heartbeat);
+}
+
+//
+// Thread handler
+//
+void *profile_thread_handler( void *ptr )
+{
+    uint8_t *terminate;
+    tick_t tick;
+    thread_param_t* param = (thread_param_t*) ptr;
+    terminate = param->terminate;
+    tick_init(&tick, name, param->tick_rate);
+    free(param);
+    rt_apply(RtTick);
+
+    while ( *terminate == false )
+    {
+        profile_tick(tick_wait(&tick));
+    }
+    tick_stats_print(&tick);
+    return 0;
+}
@@ -0,0 +1,63 @@
+/*
+ * Copyright © kiwipower 2017
+ *
+ * Header file for vendor register profiles loaded at startup
+ */
+#ifndef PROFILE_DOT_H
+#define PROFILE_DOT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <modbus/modbus.h>
+#include "typedefs.h"
+
+#define PROFILE_MAX_BINDINGS        255
+#define PROFILE_MAX_VALUES          8         // values= list of one binding
+
+enum ProfileBinding
+{
+    ProfileBindingNone = 0,
+    ProfileBindingDebug,                        // enables debug trace
+    ProfileBindingValue,                        // plain register, range checked
+    ProfileBindingConstant,                     // static value or string, read only
+    ProfileBindingSetpoint,                     // real power set point in kW
+    ProfileBindingDispatch,                     // battery only moves while non zero
+    ProfileBindingHeartbeat,                    // toggling the masked bits resets the heartbeat
+    ProfileBindingSoc,                          // state of charge readout, read only
+    ProfileBindingPower                         // delivered power readout, read only
+};
+
+typedef struct profile_binding_struct
+{
+    uint16_t address;
+    uint8_t  kind;                              // ProfileBinding
+    uint8_t  width;                             // registers, 1 or 2 (high word first)
+    float    scale;                             // engineering value = register value * scale
+    int32_t  min;                               // below 0 decodes a single register as signed
+    int32_t  max;
+    int32_t  values[PROFILE_MAX_VALUES];        // the only values accepted, if value_count
+    uint8_t  value_count;
+    uint16_t mask;
+    int32_t  value;                             // constant value
+    char     string[64];                        // constant string, two characters per register
+}profile_binding_t;
+
+//
+// Public functions
+//
+int   profile_load(const char* filename);
+const char* profile_name();
+int   profile_defaults(int nb_registers);
+bool  profile_setpoint(uint16_t* address, uint16_t* quantity, float* scale);
+bool  profile_dispatch(uint16_t* address);
+
+void  profile_init(init_param_t* );
+void  profile_dispose();
+void  profile_disconnect();
+void* profile_thread_handler( void *ptr );
+void  profile_tick(float seconds);
+int   profile_process_single_register(uint16_t address, uint16_t data);
+int   profile_read_registers(uint16_t start_address, uint16_t quantity);
+int   profile_write_multiple_addresses(uint16_t start_address, uint16_t quantity, uint8_t* pdata);
+
+#endif
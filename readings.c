@@ -0,0 +1,110 @@
+#include <stdio.h>
+#include <string.h>
+#include <endian.h>
+#include "readings.h"
+
+static uint64_t _get64(const uint8_t* p);
+static uint32_t _get32(const uint8_t* p);
+static uint16_t _get16(const uint8_t* p);
+
+
+//
+// Big endian fields, readings travel in network order like modbus registers. Records need no alignment
+//
+uint64_t _get64(const uint8_t* p)
+{
+    uint64_t value;
+    memcpy(&value, p, sizeof(value));
+    return be64toh(value);
+}
+
+uint32_t _get32(const uint8_t* p)
+{
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return be32toh(value);
+}
+
+uint16_t _get16(const uint8_t* p)
+{
+    uint16_t value;
+    memcpy(&value, p, sizeof(value));
+    return be16toh(value);
+}
+
+/*
+***************************************************************************************************************
+ \fn      readings_count(const uint8_t* data, size_t length)
+ \brief   checks a binary readings upload and returns the number of records it holds
+
+ The body is an 8 byte header, the magic "BSR1" and a 32 bit record count, followed by that many 16 byte
+ records, all big endian:
+
+      0  int64   timestamp, ms since the epoch
+      8  int32   power delivered, W
+     12  uint16  state of charge, hundredths of a percent
+     14  uint16  reserved, 0
+
+ \note    returns -1 if the magic is wrong or the length does not match the count
+**************************************************************************************************************
+*/
+int readings_count(const uint8_t* data, size_t length)
+{
+    uint64_t count;
+
+    if ( length < READINGS_HEADER_SIZE || memcmp(data, READINGS_MAGIC, 4) != 0 )
+    {
+        return -1;
+    }
+    count = _get32(data + 4);
+    if ( length != READINGS_HEADER_SIZE + count * READINGS_RECORD_SIZE )
+    {
+        return -1;
+    }
+    return (int)count;
+}
+
+//
+// Decodes record index of a body readings_count() accepted, nothing is allocated
+//
+int readings_decode(const uint8_t* data, size_t length, int index, reading_t* reading)
+{
+    const uint8_t *record = data + READINGS_HEADER_SIZE + (size_t)index * READINGS_RECORD_SIZE;
+
+    if ( index < 0 || record + READINGS_RECORD_SIZE > data + length )
+    {
+        return -1;
+    }
+    reading->timestamp = (int64_t)_get64(record);
+    reading->power_kw = (int32_t)_get32(record + 8) / 1000.0f;
+    reading->state_of_charge = _get16(record + 12) / 100.0f;
+    return 0;
+}
+
+//
+// Renders a binary upload as the JSON the uplink expects, returns its length or -1 if size is too small.
+// READINGS_JSON_RECORD bytes per record plus 32 are always enough
+//
+int readings_json(const uint8_t* data, size_t length, char* buf, size_t size)
+{
+    reading_t reading;
+    int i, count = readings_count(data, length);
+    size_t n;
+
+    if ( count < 0 || size < 32 )
+    {
+        return -1;
+    }
+    n = snprintf(buf, size, "{ \"readings\": [");
+    for ( i = 0; i < count && n < size; i++ )
+    {
+        readings_decode(data, length, i, &reading);
+        n += snprintf(buf + n, size - n, "%s { \"timestamp\": %lld, \"powerDeliveredkW\": %f, \"stateOfCharge\": %g }",
+                      i ? "," : "", (long long)reading.timestamp, reading.power_kw, reading.state_of_charge);
+    }
+    if ( n < size )
+    {
+        n += snprintf(buf + n, size - n, " ] }");
+    }
+    return n < size ? (int)n : -1;
+}
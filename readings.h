@@ -0,0 +1,35 @@
+/*
+ * Copyright © kiwipower 2017
+ *
+ * Header file for the readings uploaded to the ENGIENL ingest endpoint, JSON or fixed width binary
+ */
+#ifndef READINGS_DOT_H
+#define READINGS_DOT_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define READINGS_CONTENT_TYPE   "application/vnd.battsim.readings"
+#define READINGS_MAGIC          "BSR1"
+#define READINGS_HEADER_SIZE    8             // magic, record count
+#define READINGS_RECORD_SIZE    16
+#define READINGS_JSON_RECORD    128           // upper bound of one record rendered as JSON
+
+//
+// One reading, whichever format it arrived in
+//
+typedef struct reading_struct
+{
+    int64_t timestamp;                          // ms since the epoch
+    float   power_kw;                           // powerDeliveredkW
+    float   state_of_charge;                    // percent
+}reading_t;
+
+//
+// Public functions
+//
+int readings_count(const uint8_t* data, size_t length);
+int readings_decode(const uint8_t* data, size_t length, int index, reading_t* reading);
+int readings_json(const uint8_t* data, size_t length, char* buf, size_t size);
+
+#endif
@@ -0,0 +1,156 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "recorder.h"
+
+#define RECORDER_BUFFER_SIZE    (64 * 1024)
+
+// Private data
+static FILE* fp = NULL;
+static uint32_t session = 0;
+
+static uint64_t _timestamp();
+
+uint64_t _timestamp()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+//
+// Opens (truncates) the session log. Records are buffered and flushed at the end of every session
+//
+int recorder_open(const char* filename)
+{
+    recorder_header_t header;
+
+    fp = fopen(filename, "wb");
+    if ( fp == NULL )
+    {
+        printf("%s unable to open %s: %s\n", __PRETTY_FUNCTION__, filename, strerror(errno));
+        return -1;
+    }
+    setvbuf(fp, NULL, _IOFBF, RECORDER_BUFFER_SIZE);
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, RECORDER_MAGIC, sizeof(header.magic));
+    header.version = RECORDER_VERSION;
+    fwrite(&header, sizeof(header), 1, fp);
+    return 0;
+}
+
+void recorder_close()
+{
+    if ( fp )
+    {
+        fclose(fp);
+        fp = NULL;
+    }
+}
+
+bool recorder_enabled()
+{
+    return fp != NULL;
+}
+
+//
+// Marks the start of a new client connection
+//
+void recorder_session()
+{
+    if ( fp )
+    {
+        fflush(fp);
+        session++;
+    }
+}
+
+void recorder_write(recorder_direction_t direction, const uint8_t* adu, int length)
+{
+    recorder_record_t record;
+
+    if ( fp == NULL )
+    {
+        return;
+    }
+    record.timestamp = _timestamp();
+    record.session   = session;
+    record.direction = direction;
+    record.reserved  = 0;
+    record.length    = length;
+    fwrite(&record, sizeof(record), 1, fp);
+    fwrite(adu, length, 1, fp);
+}
+
+//
+// Reads a whole log into memory. Returns the number of records or -1 on error
+//
+int recorder_load(const char* filename, recorder_log_t* log)
+{
+    FILE *in;
+    struct stat st;
+    recorder_header_t *header;
+    size_t pos, size;
+    int capacity = 0;
+
+    memset(log, 0, sizeof(recorder_log_t));
+    in = fopen(filename, "rb");
+    if ( in == NULL || fstat(fileno(in), &st) != 0 )
+    {
+        printf("%s unable to open %s: %s\n", __PRETTY_FUNCTION__, filename, strerror(errno));
+        if ( in ) fclose(in);
+        return -1;
+    }
+    size = st.st_size;
+    log->data = malloc(size);
+    if ( log->data == NULL || fread(log->data, 1, size, in) != size )
+    {
+        printf("%s unable to read %s\n", __PRETTY_FUNCTION__, filename);
+        fclose(in);
+        recorder_free(log);
+        return -1;
+    }
+    fclose(in);
+
+    header = (recorder_header_t*) log->data;
+    if ( size < sizeof(recorder_header_t) || memcmp(header->magic, RECORDER_MAGIC, sizeof(header->magic)) != 0 ||
+         header->version != RECORDER_VERSION )
+    {
+        printf("%s %s is not a battsim session log\n", __PRETTY_FUNCTION__, filename);
+        recorder_free(log);
+        return -1;
+    }
+
+    pos = sizeof(recorder_header_t);
+    while ( pos + sizeof(recorder_record_t) <= size )
+    {
+        recorder_entry_t *entry;
+
+        if ( log->count == capacity )
+        {
+            capacity = capacity ? capacity * 2 : 1024;
+            log->entries = realloc(log->entries, capacity * sizeof(recorder_entry_t));
+        }
+        entry = &log->entries[log->count];
+        memcpy(&entry->record, log->data + pos, sizeof(recorder_record_t));
+        pos += sizeof(recorder_record_t);
+        if ( pos + entry->record.length > size )
+        {
+            break;                                     // truncated tail, e.g. process killed mid write
+        }
+        entry->adu = log->data + pos;
+        pos += entry->record.length;
+        log->count++;
+    }
+    return log->count;
+}
+
+void recorder_free(recorder_log_t* log)
+{
+    free(log->entries);
+    free(log->data);
+    memset(log, 0, sizeof(recorder_log_t));
+}
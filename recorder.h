@@ -0,0 +1,68 @@
+/*
+ * Copyright © kiwipower 2017
+ *
+ * Header file to record and load modbus sessions
+ */
+#ifndef RECORDER_DOT_H
+#define RECORDER_DOT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define RECORDER_MAGIC      "BSIMREC1"
+#define RECORDER_VERSION    1
+
+typedef enum RECORDER_DIRECTION
+{
+    RECORDER_REQUEST = 1,
+    RECORDER_REPLY
+}recorder_direction_t;
+
+//
+// File layout: recorder_header_t followed by records, each a recorder_record_t and `length` ADU bytes
+//
+typedef struct recorder_header_struct
+{
+    char     magic[8];
+    uint32_t version;
+    uint32_t reserved;
+}__attribute__((packed))recorder_header_t;
+
+typedef struct recorder_record_struct
+{
+    uint64_t timestamp;                         // CLOCK_REALTIME in nanoseconds
+    uint32_t session;                           // incremented on every accepted connection
+    uint8_t  direction;                         // recorder_direction_t
+    uint8_t  reserved;
+    uint16_t length;                            // number of ADU bytes following the record
+}__attribute__((packed))recorder_record_t;
+
+//
+// In memory copy of a log as loaded by recorder_load()
+//
+typedef struct recorder_entry_struct
+{
+    recorder_record_t record;
+    const uint8_t *adu;
+}recorder_entry_t;
+
+typedef struct recorder_log_struct
+{
+    recorder_entry_t *entries;
+    int count;
+    uint8_t *data;
+}recorder_log_t;
+
+//
+// Public functions
+//
+int   recorder_open(const char* filename);
+void  recorder_close();
+bool  recorder_enabled();
+void  recorder_session();
+void  recorder_write(recorder_direction_t direction, const uint8_t* adu, int length);
+
+int   recorder_load(const char* filename, recorder_log_t* log);
+void  recorder_free(recorder_log_t* log);
+
+#endif
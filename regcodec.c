@@ -0,0 +1,156 @@
+#include <stdio.h>
+#include <string.h>
+#include "regcodec.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define REGCODEC_X86
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define REGCODEC_NEON
+#endif
+
+typedef void (*swap_t)(uint8_t* dst, const uint8_t* src, int quantity);
+
+static void _swap_scalar(uint8_t* dst, const uint8_t* src, int quantity);
+static void _swap_copy(uint8_t* dst, const uint8_t* src, int quantity);
+static void _swap_select(uint8_t* dst, const uint8_t* src, int quantity);
+
+// Private data
+static swap_t swap = _swap_select;               // the kernel, chosen on first use
+
+
+//
+// Byte by byte, for hosts without a vector kernel and for the tail of a block
+//
+void _swap_scalar(uint8_t* dst, const uint8_t* src, int quantity)
+{
+    int i;
+    uint8_t high;
+
+    for ( i = 0; i < quantity; i++ )
+    {
+        high = src[i * 2];                      // src may be dst
+        dst[i * 2] = src[(i * 2) + 1];
+        dst[(i * 2) + 1] = high;
+    }
+}
+
+//
+// Big endian hosts store registers the way they travel
+//
+void _swap_copy(uint8_t* dst, const uint8_t* src, int quantity)
+{
+    memmove(dst, src, quantity * 2);
+}
+
+#ifdef REGCODEC_X86
+//
+// SSE2 is part of x86-64, swapping with shifts needs nothing newer
+//
+__attribute__((target("sse2")))
+static void _swap_sse2(uint8_t* dst, const uint8_t* src, int quantity)
+{
+    int i = 0;
+    __m128i v;
+
+    for ( ; i + 8 <= quantity; i += 8 )
+    {
+        v = _mm_loadu_si128((const __m128i*)(src + i * 2));
+        _mm_storeu_si128((__m128i*)(dst + i * 2), _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8)));
+    }
+    _swap_scalar(dst + i * 2, src + i * 2, quantity - i);
+}
+
+__attribute__((target("avx2")))
+static void _swap_avx2(uint8_t* dst, const uint8_t* src, int quantity)
+{
+    const __m256i mask = _mm256_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14,
+                                          1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+    int i = 0;
+    uint8_t high;
+    __m256i v;
+
+    for ( ; i + 16 <= quantity; i += 16 )
+    {
+        v = _mm256_loadu_si256((const __m256i*)(src + i * 2));
+        _mm256_storeu_si256((__m256i*)(dst + i * 2), _mm256_shuffle_epi8(v, mask));
+    }
+    if ( i + 8 <= quantity )
+    {
+        _mm_storeu_si128((__m128i*)(dst + i * 2),
+                         _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(src + i * 2)), _mm256_castsi256_si128(mask)));
+        i += 8;
+    }
+    for ( ; i < quantity; i++ )                 // the tail stays VEX encoded, no AVX to SSE transition
+    {
+        high = src[i * 2];
+        dst[i * 2] = src[(i * 2) + 1];
+        dst[(i * 2) + 1] = high;
+    }
+}
+#endif
+
+#ifdef REGCODEC_NEON
+static void _swap_neon(uint8_t* dst, const uint8_t* src, int quantity)
+{
+    int i = 0;
+
+    for ( ; i + 8 <= quantity; i += 8 )
+    {
+        vst1q_u8(dst + i * 2, vrev16q_u8(vld1q_u8(src + i * 2)));
+    }
+    _swap_scalar(dst + i * 2, src + i * 2, quantity - i);
+}
+#endif
+
+//
+// Picks the kernel on first use: the widest the CPU runs, a plain copy on big endian hosts
+//
+void _swap_select(uint8_t* dst, const uint8_t* src, int quantity)
+{
+    swap_t selected = _swap_scalar;
+
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    selected = _swap_copy;
+#elif defined(REGCODEC_X86)
+    __builtin_cpu_init();
+    if ( __builtin_cpu_supports("avx2") )
+    {
+        selected = _swap_avx2;
+    }
+    else if ( __builtin_cpu_supports("sse2") )
+    {
+        selected = _swap_sse2;
+    }
+#elif defined(REGCODEC_NEON)
+    selected = _swap_neon;
+#endif
+    __atomic_store_n(&swap, selected, __ATOMIC_RELEASE);
+    selected(dst, src, quantity);
+}
+
+/*
+***************************************************************************************************************
+ \fn      regcodec_decode(uint16_t* registers, const uint8_t* data, int quantity)
+ \brief   stores quantity big endian register values from a request payload
+
+ The caller checks the range once, the kernel converts the whole block without further checks: a vector
+ byte swap on little endian hosts (AVX2 or SSE2 on x86, NEON on ARM), a memmove on big endian ones. data
+ needs no alignment, FC 0x10 payloads start at an odd offset.
+**************************************************************************************************************
+*/
+void regcodec_decode(uint16_t* registers, const uint8_t* data, int quantity)
+{
+    swap_t kernel_swap = __atomic_load_n(&swap, __ATOMIC_ACQUIRE);
+    kernel_swap((uint8_t*)registers, data, quantity);
+}
+
+//
+// Reply direction: quantity registers into big endian bytes
+//
+void regcodec_encode(uint8_t* data, const uint16_t* registers, int quantity)
+{
+    swap_t kernel_swap = __atomic_load_n(&swap, __ATOMIC_ACQUIRE);
+    kernel_swap(data, (const uint8_t*)registers, quantity);
+}
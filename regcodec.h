@@ -0,0 +1,17 @@
+/*
+ * Copyright © kiwipower 2017
+ *
+ * Header file to convert register blocks between host order and the big endian wire order
+ */
+#ifndef REGCODEC_DOT_H
+#define REGCODEC_DOT_H
+
+#include <stdint.h>
+
+//
+// Public functions
+//
+void regcodec_decode(uint16_t* registers, const uint8_t* data, int quantity);
+void regcodec_encode(uint8_t* data, const uint16_t* registers, int quantity);
+
+#endif
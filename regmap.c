@@ -0,0 +1,349 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "typedefs.h"
+#include "regmap.h"
+#include "regcodec.h"
+
+typedef struct regmap_state_struct
+{
+    pthread_mutex_t mutex;
+    uint32_t sequence;                          // odd while a write is in progress
+}regmap_state_t;
+
+// Private data
+static regmap_state_t local = { PTHREAD_MUTEX_INITIALIZER, 0 };
+static regmap_state_t *state = &local;
+static uint16_t *shadow = NULL;                 // big endian copy of the map, as replies carry it
+
+static uint16_t* _address(modbus_mapping_t* mb_mapping, uint16_t address, uint16_t quantity);
+static void      _write_begin();
+static void      _write_end();
+static void      _publish(modbus_mapping_t* mb_mapping, const uint16_t* address, uint16_t quantity);
+static void      _store(modbus_mapping_t* mb_mapping, uint16_t* address, uint16_t quantity, const uint8_t* pdata);
+static bool      _zero(const uint16_t* registers, int quantity);
+
+
+//
+// Pointer to the first register, NULL if any of them lies outside the map
+//
+uint16_t* _address(modbus_mapping_t* mb_mapping, uint16_t address, uint16_t quantity)
+{
+    int offset = address - mb_mapping->start_registers;
+
+    if ( offset < 0 || (offset + quantity) > mb_mapping->nb_registers )
+    {
+        return NULL;
+    }
+    return mb_mapping->tab_registers + offset;
+}
+
+//
+// Encodes registers just written into the shadow
+//
+void _publish(modbus_mapping_t* mb_mapping, const uint16_t* address, uint16_t quantity)
+{
+    if ( shadow )
+    {
+        regcodec_encode((uint8_t*)(shadow + (address - mb_mapping->tab_registers)), address, quantity);
+    }
+}
+
+//
+// Decodes a big endian payload into the map; it is the shadow's encoding already, a plain copy there
+//
+void _store(modbus_mapping_t* mb_mapping, uint16_t* address, uint16_t quantity, const uint8_t* pdata)
+{
+    regcodec_decode(address, pdata, quantity);
+    if ( shadow )
+    {
+        memcpy(shadow + (address - mb_mapping->tab_registers), pdata, quantity * 2);
+    }
+}
+
+bool _zero(const uint16_t* registers, int quantity)
+{
+    int i;
+
+    for ( i = 0; i < quantity; i++ )
+    {
+        if ( registers[i] )
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+void _write_begin()
+{
+    if ( pthread_mutex_lock(&state->mutex) == EOWNERDEAD )
+    {
+        // a worker died half way through a write, close the sequence it left open
+        if ( state->sequence & 1 )
+        {
+            __atomic_store_n(&state->sequence, state->sequence + 1, __ATOMIC_RELEASE);
+        }
+        pthread_mutex_consistent(&state->mutex);
+    }
+    __atomic_store_n(&state->sequence, state->sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+void _write_end()
+{
+    __atomic_store_n(&state->sequence, state->sequence + 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&state->mutex);
+}
+
+//
+// Moves the lock and the sequence into memory shared with processes forked afterwards, for worker
+// processes serving the same register map. memory is REGMAP_SHARED_SIZE bytes of shared memory to use,
+// NULL to map some. Must be called before the first write
+//
+int regmap_share(void* memory)
+{
+    pthread_mutexattr_t attr;
+    regmap_state_t *shared = memory;
+
+    if ( sizeof(regmap_state_t) > REGMAP_SHARED_SIZE )
+    {
+        printf("%s the shared lock needs %zu bytes\n", __PRETTY_FUNCTION__, sizeof(regmap_state_t));
+        return -1;
+    }
+    if ( shared == NULL )
+    {
+        shared = mmap(NULL, sizeof(regmap_state_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    }
+    if ( shared == MAP_FAILED )
+    {
+        printf("%s unable to map the shared lock: %s\n", __PRETTY_FUNCTION__, strerror(errno));
+        return -1;
+    }
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&shared->mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+    shared->sequence = 0;
+    state = shared;
+    return 0;
+}
+
+//
+// The sequence a reader that cannot take the lock checks around its copy, see shmexport.h
+//
+const uint32_t* regmap_sequence()
+{
+    return &state->sequence;
+}
+
+/*
+***************************************************************************************************************
+ \fn      regmap_shadow(modbus_mapping_t* mb_mapping)
+ \brief   keeps a big endian copy of the register map for replies sent straight from it
+
+ Every write through the regmap functions updates the copy in the same critical section, so under
+ regmap_lock() the two always agree. Registers must then only be written through these functions. Like
+ regmap_share() the copy lives in memory shared with processes forked afterwards. Zero encodes to zero, so
+ only the pages holding a non zero register are written here; like the register store (see regstore_new())
+ the rest take no memory until a register in them is written.
+**************************************************************************************************************
+*/
+int regmap_shadow(modbus_mapping_t* mb_mapping)
+{
+    int page = sysconf(_SC_PAGESIZE) / sizeof(uint16_t), i, quantity;
+    uint16_t *copy;
+
+    copy = mmap(NULL, mb_mapping->nb_registers * sizeof(uint16_t), PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if ( copy == MAP_FAILED )
+    {
+        printf("%s unable to map the shadow registers: %s\n", __PRETTY_FUNCTION__, strerror(errno));
+        return -1;
+    }
+    for ( i = 0; i < mb_mapping->nb_registers; i += page )
+    {
+        quantity = mb_mapping->nb_registers - i < page ? mb_mapping->nb_registers - i : page;
+        if ( !_zero(mb_mapping->tab_registers + i, quantity) )
+        {
+            regcodec_encode((uint8_t*)(copy + i), mb_mapping->tab_registers + i, quantity);
+        }
+    }
+    shadow = copy;
+    return 0;
+}
+
+//
+// Big endian bytes of quantity registers from address, NULL without a shadow or outside the map. Only
+// stable under regmap_lock()
+//
+const uint8_t* regmap_shadow_range(modbus_mapping_t* mb_mapping, uint16_t address, uint16_t quantity)
+{
+    uint16_t *p = _address(mb_mapping, address, quantity);
+
+    return shadow && p ? (const uint8_t*)(shadow + (p - mb_mapping->tab_registers)) : NULL;
+}
+
+//
+// Held across building and sending a reply, which may itself store registers, so a reply never mixes
+// halves of two different values
+//
+void regmap_lock()
+{
+    _write_begin();
+}
+
+void regmap_unlock()
+{
+    _write_end();
+}
+
+//
+// True if a request for [start_address, start_address + quantity) touches any register of the field
+//
+bool regmap_overlaps(uint16_t start_address, uint16_t quantity, uint16_t address, uint16_t width)
+{
+    return (uint32_t)start_address < (uint32_t)address + width &&
+           (uint32_t)address < (uint32_t)start_address + quantity;
+}
+
+//
+// Runs the hooks of the computed registers a read of [start_address, start_address + quantity) covers
+//
+int regmap_read_hooks(const read_hook_t* hooks, int count, uint16_t start_address, uint16_t quantity)
+{
+    int i, retval = MODBUS_SUCCESS;
+
+    for ( i = 0; i < count && hooks[i].address < (uint32_t)start_address + quantity; i++ )
+    {
+        if ( regmap_overlaps(start_address, quantity, hooks[i].address, hooks[i].quantity) )
+        {
+            retval = hooks[i].hook();
+            if ( retval != MODBUS_SUCCESS )
+            {
+                break;
+            }
+        }
+    }
+    return retval;
+}
+
+//
+// Stores a big endian FC 0x10 payload. The whole block is published at once so every value wider than one
+// register it contains is decoded from one consistent write.
+//
+int regmap_write_block(modbus_mapping_t* mb_mapping, uint16_t start_address, uint16_t quantity, const uint8_t* pdata)
+{
+    uint16_t *address = _address(mb_mapping, start_address, quantity);
+
+    if ( address == NULL )
+    {
+        return MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS;
+    }
+    _write_begin();
+    _store(mb_mapping, address, quantity, pdata);
+    _write_end();
+    return MODBUS_SUCCESS;
+}
+
+//
+// regmap_write_block() for callers already holding regmap_lock()
+//
+int regmap_store(modbus_mapping_t* mb_mapping, uint16_t start_address, uint16_t quantity, const uint8_t* pdata)
+{
+    uint16_t *address = _address(mb_mapping, start_address, quantity);
+
+    if ( address == NULL )
+    {
+        return MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS;
+    }
+    _store(mb_mapping, address, quantity, pdata);
+    return MODBUS_SUCCESS;
+}
+
+void regmap_write16(modbus_mapping_t* mb_mapping, uint16_t address, uint16_t value)
+{
+    uint16_t *p = _address(mb_mapping, address, 1);
+
+    if ( p )
+    {
+        _write_begin();
+        p[0] = value;
+        _publish(mb_mapping, p, 1);
+        _write_end();
+    }
+}
+
+void regmap_write32(modbus_mapping_t* mb_mapping, uint16_t address, uint32_t value)
+{
+    uint16_t *p = _address(mb_mapping, address, REGMAP_U32_QUANTITY);
+
+    if ( p )
+    {
+        _write_begin();
+        p[0] = value >> 16;
+        p[1] = value;
+        _publish(mb_mapping, p, REGMAP_U32_QUANTITY);
+        _write_end();
+    }
+}
+
+void regmap_write64(modbus_mapping_t* mb_mapping, uint16_t address, uint64_t value)
+{
+    uint16_t *p = _address(mb_mapping, address, REGMAP_U64_QUANTITY);
+
+    if ( p )
+    {
+        _write_begin();
+        p[0] = value >> 48;
+        p[1] = value >> 32;
+        p[2] = value >> 16;
+        p[3] = value;
+        _publish(mb_mapping, p, REGMAP_U64_QUANTITY);
+        _write_end();
+    }
+}
+
+//
+// Lock free readers retry until they saw no writer
+//
+uint32_t regmap_read32(modbus_mapping_t* mb_mapping, uint16_t address)
+{
+    volatile uint16_t *p = _address(mb_mapping, address, REGMAP_U32_QUANTITY);
+    uint32_t value, seq;
+
+    if ( p == NULL )
+    {
+        return 0;
+    }
+    do
+    {
+        seq = __atomic_load_n(&state->sequence, __ATOMIC_ACQUIRE);
+        value = ((uint32_t)p[0] << 16) | p[1];
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while ( (seq & 1) || seq != __atomic_load_n(&state->sequence, __ATOMIC_RELAXED) );
+    return value;
+}
+
+uint64_t regmap_read64(modbus_mapping_t* mb_mapping, uint16_t address)
+{
+    volatile uint16_t *p = _address(mb_mapping, address, REGMAP_U64_QUANTITY);
+    uint64_t value;
+    uint32_t seq;
+
+    if ( p == NULL )
+    {
+        return 0;
+    }
+    do
+    {
+        seq = __atomic_load_n(&state->sequence, __ATOMIC_ACQUIRE);
+        value = ((uint64_t)p[0] << 48) | ((uint64_t)p[1] << 32) | ((uint64_t)p[2] << 16) | p[3];
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while ( (seq & 1) || seq != __atomic_load_n(&state->sequence, __ATOMIC_RELAXED) );
+    return value;
+}
@@ -0,0 +1,41 @@
+/*
+ * Copyright © kiwipower 2017
+ *
+ * Header file for multi register values in the modbus register map
+ */
+#ifndef REGMAP_DOT_H
+#define REGMAP_DOT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <modbus/modbus.h>
+#include "typedefs.h"
+
+//
+// Values wider than one register are stored most significant word first. Writers publish them under a
+// sequence lock so a reader sees either the old or the new value, never one half of each.
+//
+#define REGMAP_U32_QUANTITY     2
+#define REGMAP_U64_QUANTITY     4
+#define REGMAP_SHARED_SIZE      64            // room for the lock and the sequence, see regmap_share()
+
+//
+// Public functions
+//
+int      regmap_share(void* memory);
+const uint32_t* regmap_sequence();
+int      regmap_shadow(modbus_mapping_t* mb_mapping);
+const uint8_t* regmap_shadow_range(modbus_mapping_t* mb_mapping, uint16_t address, uint16_t quantity);
+void     regmap_lock();
+void     regmap_unlock();
+int      regmap_read_hooks(const read_hook_t* hooks, int count, uint16_t start_address, uint16_t quantity);
+bool     regmap_overlaps(uint16_t start_address, uint16_t quantity, uint16_t address, uint16_t width);
+int      regmap_write_block(modbus_mapping_t* mb_mapping, uint16_t start_address, uint16_t quantity, const uint8_t* pdata);
+int      regmap_store(modbus_mapping_t* mb_mapping, uint16_t start_address, uint16_t quantity, const uint8_t* pdata);
+void     regmap_write16(modbus_mapping_t* mb_mapping, uint16_t address, uint16_t value);
+void     regmap_write32(modbus_mapping_t* mb_mapping, uint16_t address, uint32_t value);
+void     regmap_write64(modbus_mapping_t* mb_mapping, uint16_t address, uint64_t value);
+uint32_t regmap_read32(modbus_mapping_t* mb_mapping, uint16_t address);
+uint64_t regmap_read64(modbus_mapping_t* mb_mapping, uint16_t address);
+
+#endif
@@ -0,0 +1,150 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "regstore.h"
+
+static size_t _map_size(int nb_registers);
+static modbus_mapping_t* _new(int nb_registers, int defaults, int flags);
+
+
+size_t _map_size(int nb_registers)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    return ((nb_registers * sizeof(uint16_t)) + page - 1) & ~(page - 1);
+}
+
+/*
+***************************************************************************************************************
+ \fn      regstore_new(int nb_registers, int defaults)
+ \brief   allocates a holding register map starting at address 0
+
+ The registers are a private mapping. Pages nobody has written are backed by one shared page, the kernel
+ zero page or a page of the defaults image, and a page is only copied the first time a register on it is
+ written. A profile that touches a few dozen registers costs a few KB instead of the full 128 KB table.
+
+ \note    defaults is a file descriptor from regstore_defaults(), or -1 for an all zero map.
+          The map must be released with regstore_free(), not modbus_mapping_free().
+**************************************************************************************************************
+*/
+modbus_mapping_t* regstore_new(int nb_registers, int defaults)
+{
+    return _new(nb_registers, defaults, MAP_PRIVATE);
+}
+
+//
+// Same as regstore_new() but the registers are shared with every process forked afterwards. Pages are
+// still only allocated when first written, the defaults image itself is what gets written to
+//
+modbus_mapping_t* regstore_new_shared(int nb_registers, int defaults)
+{
+    return _new(nb_registers, defaults, MAP_SHARED);
+}
+
+//
+// Zeroed memory shared with every process forked afterwards
+//
+void* regstore_shared(size_t size)
+{
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    return p == MAP_FAILED ? NULL : p;
+}
+
+modbus_mapping_t* _new(int nb_registers, int defaults, int flags)
+{
+    modbus_mapping_t *mb_mapping;
+    void *registers;
+    size_t size = _map_size(nb_registers);
+
+    mb_mapping = calloc(1, sizeof(modbus_mapping_t));
+    if ( mb_mapping == NULL )
+    {
+        return NULL;
+    }
+    if ( defaults < 0 )
+    {
+        registers = mmap(NULL, size, PROT_READ | PROT_WRITE, flags | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    }
+    else
+    {
+        registers = mmap(NULL, size, PROT_READ | PROT_WRITE, flags | MAP_NORESERVE, defaults, 0);
+    }
+    if ( registers == MAP_FAILED )
+    {
+        free(mb_mapping);
+        return NULL;
+    }
+    mb_mapping->start_registers = 0;
+    mb_mapping->nb_registers = nb_registers;
+    mb_mapping->tab_registers = registers;
+    return mb_mapping;
+}
+
+void regstore_free(modbus_mapping_t* mb_mapping)
+{
+    if ( mb_mapping )
+    {
+        munmap(mb_mapping->tab_registers, _map_size(mb_mapping->nb_registers));
+        free(mb_mapping);
+    }
+}
+
+//
+// Builds the shared image every map created from the returned descriptor starts from. Only pages
+// holding a non zero register are written, the rest of the file stays a hole.
+//
+int regstore_defaults(const uint16_t* image, int nb_registers)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t size = _map_size(nb_registers), offset, i;
+    const uint8_t *p = (const uint8_t*) image;
+    int fd;
+
+    fd = memfd_create("battsim-defaults", MFD_CLOEXEC);
+    if ( fd < 0 || ftruncate(fd, size) != 0 )
+    {
+        printf("%s unable to create defaults image: %s\n", __PRETTY_FUNCTION__, strerror(errno));
+        if ( fd >= 0 ) close(fd);
+        return -1;
+    }
+    for ( offset = 0; offset < nb_registers * sizeof(uint16_t); offset += page )
+    {
+        size_t length = nb_registers * sizeof(uint16_t) - offset;
+
+        if ( length > page ) length = page;
+        for ( i = 0; i < length && p[offset + i] == 0; i++ )
+        ;
+        if ( i < length && pwrite(fd, p + offset, length, offset) != (ssize_t)length )
+        {
+            close(fd);
+            return -1;
+        }
+    }
+    return fd;
+}
+
+//
+// Bytes of the map currently faulted in, pages still shared with the zero or defaults page included
+//
+size_t regstore_resident(const modbus_mapping_t* mb_mapping)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t size = _map_size(mb_mapping->nb_registers), i, resident = 0;
+    unsigned char vec[size / page];
+
+    if ( mincore(mb_mapping->tab_registers, size, vec) != 0 )
+    {
+        return 0;
+    }
+    for ( i = 0; i < size / page; i++ )
+    {
+        if ( vec[i] & 1 )
+        {
+            resident += page;
+        }
+    }
+    return resident;
+}
@@ -0,0 +1,23 @@
+/*
+ * Copyright © kiwipower 2017
+ *
+ * Header file for the paged, copy on write holding register store
+ */
+#ifndef REGSTORE_DOT_H
+#define REGSTORE_DOT_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <modbus/modbus.h>
+
+//
+// Public functions
+//
+modbus_mapping_t* regstore_new(int nb_registers, int defaults);
+modbus_mapping_t* regstore_new_shared(int nb_registers, int defaults);
+void*             regstore_shared(size_t size);
+void              regstore_free(modbus_mapping_t* mb_mapping);
+int               regstore_defaults(const uint16_t* image, int nb_registers);
+size_t            regstore_resident(const modbus_mapping_t* mb_mapping);
+
+#endif
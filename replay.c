@@ -0,0 +1,302 @@
+/*
+ * Copyright © kiwipower 2017
+ *
+ * battreplay - replays a session log written by battsim -r against a running simulator.
+ *
+ * Every recorded request is sent over one or more parallel connections, either at the recorded pace,
+ * scaled or as fast as possible, and each reply is compared byte for byte with the recorded reply.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <getopt.h>
+#include <stdbool.h>
+#include <time.h>
+#include <pthread.h>
+#include <byteswap.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <modbus/modbus.h>
+#include "typedefs.h"
+#include "recorder.h"
+
+#define REPLAY_DEFAULT_HOST     "127.0.0.1"
+#define REPLAY_DEFAULT_PORT     "1502"
+
+typedef struct replay_thread_param_struct
+{
+    pthread_t thread;
+    int id;
+    uint64_t requests;
+    uint64_t mismatches;
+    uint64_t errors;
+    uint64_t latency_total;                     // nanoseconds
+    uint64_t latency_max;                       // nanoseconds
+}replay_thread_param_t;
+
+// Private data
+static recorder_log_t log_data;
+static const char* host = REPLAY_DEFAULT_HOST;
+static const char* port = REPLAY_DEFAULT_PORT;
+static double speed = 1.0;                      // 0 = as fast as possible
+static int loops = 1;
+static bool verbose = false;
+
+static void     usage(const char *app_name);
+static uint64_t _now();
+static void     _sleep_until(uint64_t deadline);
+static int      _connect();
+static int      _read_reply(int s, uint8_t* rsp);
+static void    *_replay_handler(void *ptr);
+
+
+static void usage(const char *app_name)
+{
+    printf("Usage:\n");
+    printf("%s -f <log> [option <value>] ...\n", app_name);
+    printf("\nOptions:\n");
+    printf(" -f \t\t # Session log written by battsim -r\n");
+    printf(" -i \t\t # Simulator address (Default %s)\n", REPLAY_DEFAULT_HOST);
+    printf(" -p \t\t # Simulator port (Default %s)\n", REPLAY_DEFAULT_PORT);
+    printf(" -c \t\t # Number of parallel connections (Default 1)\n");
+    printf(" -s \t\t # Speed factor, 1 = recorded pace, 2 = twice as fast, 0 = as fast as possible (Default 1)\n");
+    printf(" -l \t\t # Number of times each connection replays the log (Default 1)\n");
+    printf(" -v \t\t # Print every reply that differs from the recording\n");
+    printf(" -h \t\t # Print this help menu\n");
+    printf("\nExamples:\n");
+    printf("%s -f field.log -c 32 -s 0 \t # Replay field.log flat out over 32 connections\n\n", app_name);
+    exit(1);
+}
+
+uint64_t _now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void _sleep_until(uint64_t deadline)
+{
+    struct timespec ts;
+    ts.tv_sec  = deadline / 1000000000ULL;
+    ts.tv_nsec = deadline % 1000000000ULL;
+    while ( clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR )
+    ;
+}
+
+int _connect()
+{
+    struct addrinfo hints, *res, *rp;
+    int s = -1, one = 1;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if ( getaddrinfo(host, port, &hints, &res) != 0 )
+    {
+        return -1;
+    }
+    for ( rp = res; rp != NULL; rp = rp->ai_next )
+    {
+        s = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
+        if ( s < 0 )
+        {
+            continue;
+        }
+        if ( connect(s, rp->ai_addr, rp->ai_addrlen) == 0 )
+        {
+            break;
+        }
+        close(s);
+        s = -1;
+    }
+    freeaddrinfo(res);
+    if ( s >= 0 )
+    {
+        setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    return s;
+}
+
+//
+// Reads one complete ADU: the MBAP header tells how many bytes follow the unit id
+//
+int _read_reply(int s, uint8_t* rsp)
+{
+    int got = 0, want = sizeof(mbap_header_t), rc;
+    bool header = true;
+
+    while ( got < want )
+    {
+        rc = recv(s, rsp + got, want - got, 0);
+        if ( rc <= 0 )
+        {
+            return -1;
+        }
+        got += rc;
+        if ( header && got >= (int)sizeof(mbap_header_t) )
+        {
+            header = false;
+            want = sizeof(mbap_header_t) - 1 + __bswap_16(((mbap_header_t*)rsp)->length);
+            if ( want > MODBUS_TCP_MAX_ADU_LENGTH )
+            {
+                return -1;
+            }
+        }
+    }
+    return got;
+}
+
+//
+// Thread handler, one per connection
+//
+void *_replay_handler(void *ptr)
+{
+    replay_thread_param_t* param = (replay_thread_param_t*) ptr;
+    uint8_t rsp[MODBUS_TCP_MAX_ADU_LENGTH];
+    int loop, i, s = -1;
+    uint32_t session = 0;
+
+    for ( loop = 0; loop < loops; loop++ )
+    {
+        uint64_t start = _now();
+        uint64_t first = log_data.count ? log_data.entries[0].record.timestamp : 0;
+
+        for ( i = 0; i < log_data.count; i++ )
+        {
+            const recorder_entry_t *entry = &log_data.entries[i];
+            const recorder_entry_t *expected = NULL;
+            uint64_t sent;
+            int length;
+
+            if ( entry->record.direction != RECORDER_REQUEST )
+            {
+                continue;
+            }
+            if ( s < 0 || entry->record.session != session )
+            {
+                if ( s >= 0 ) close(s);            // new recorded session, new connection
+                session = entry->record.session;
+                s = _connect();
+                if ( s < 0 )
+                {
+                    param->errors++;
+                    return NULL;
+                }
+            }
+            if ( speed > 0 )
+            {
+                _sleep_until(start + (uint64_t)((entry->record.timestamp - first) / speed));
+            }
+
+            sent = _now();
+            if ( send(s, entry->adu, entry->record.length, MSG_NOSIGNAL) != entry->record.length ||
+                 (length = _read_reply(s, rsp)) < 0 )
+            {
+                param->errors++;
+                close(s);
+                s = -1;
+                continue;
+            }
+            sent = _now() - sent;
+            param->requests++;
+            param->latency_total += sent;
+            if ( sent > param->latency_max ) param->latency_max = sent;
+
+            if ( i + 1 < log_data.count && log_data.entries[i + 1].record.direction == RECORDER_REPLY &&
+                 log_data.entries[i + 1].record.session == entry->record.session )
+            {
+                expected = &log_data.entries[i + 1];
+            }
+            if ( expected && (expected->record.length != length || memcmp(expected->adu, rsp, length) != 0) )
+            {
+                param->mismatches++;
+                if ( verbose )
+                {
+                    printf("connection %d: reply to record %d differs (fc 0x%02x)\n", param->id, i, entry->adu[7]);
+                }
+            }
+        }
+    }
+    if ( s >= 0 ) close(s);
+    return NULL;
+}
+
+int main(int argc, char* argv[])
+{
+    const char *filename = NULL;
+    replay_thread_param_t *threads;
+    uint64_t requests = 0, mismatches = 0, errors = 0, latency_total = 0, latency_max = 0, elapsed;
+    int opt, i, connections = 1;
+
+    while ((opt = getopt(argc, argv, "f:i:p:c:s:l:v")) != -1)
+    {
+        switch (opt)
+        {
+        case 'f':
+            filename = optarg;
+            break;
+        case 'i':
+            host = optarg;
+            break;
+        case 'p':
+            port = optarg;
+            break;
+        case 'c':
+            connections = atoi(optarg);
+            break;
+        case 's':
+            speed = atof(optarg);
+            break;
+        case 'l':
+            loops = atoi(optarg);
+            break;
+        case 'v':
+            verbose = true;
+            break;
+        default:
+            usage(*argv);
+        }
+    }
+    if ( filename == NULL || connections < 1 || loops < 1 || speed < 0 )
+    {
+        usage(*argv);
+    }
+    if ( recorder_load(filename, &log_data) < 0 )
+    {
+        return 1;
+    }
+
+    threads = calloc(connections, sizeof(replay_thread_param_t));
+    elapsed = _now();
+    for ( i = 0; i < connections; i++ )
+    {
+        threads[i].id = i;
+        pthread_create(&threads[i].thread, NULL, _replay_handler, &threads[i]);
+    }
+    for ( i = 0; i < connections; i++ )
+    {
+        pthread_join(threads[i].thread, NULL);
+        requests      += threads[i].requests;
+        mismatches    += threads[i].mismatches;
+        errors        += threads[i].errors;
+        latency_total += threads[i].latency_total;
+        if ( threads[i].latency_max > latency_max ) latency_max = threads[i].latency_max;
+    }
+    elapsed = _now() - elapsed;
+
+    printf("records %d connections %d requests %llu mismatches %llu errors %llu\n",
+           log_data.count, connections, (unsigned long long)requests,
+           (unsigned long long)mismatches, (unsigned long long)errors);
+    printf("elapsed %.3f s, %.0f requests/s, latency avg %.1f us max %.1f us\n",
+           elapsed / 1e9, requests / (elapsed / 1e9),
+           requests ? (latency_total / (double)requests) / 1e3 : 0.0, latency_max / 1e3);
+
+    free(threads);
+    recorder_free(&log_data);
+    return (mismatches || errors) ? 2 : 0;
+}
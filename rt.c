@@ -0,0 +1,191 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "rt.h"
+
+typedef struct rt_role_struct
+{
+    const char *name;
+    bool        configured;
+    cpu_set_t   cpus;                           // empty = leave the affinity alone
+    int         priority;                       // SCHED_FIFO priority, 0 = leave the policy alone
+}rt_role_t;
+
+// Private data, configured from the command line before any thread starts
+static rt_role_t roles[RtRoleCount] =
+{
+    { "modbus" },
+    { "tick" },
+    { "http" },
+    { "uplink" }
+};
+
+static int  _cpus(const char* list, cpu_set_t* cpus);
+static void _prefault_stack();
+
+
+//
+// Parses a CPU list such as 2 or 0-1,4 into cpus, returns -1 if it is not one
+//
+int _cpus(const char* list, cpu_set_t* cpus)
+{
+    long first, last;
+    char *end;
+
+    CPU_ZERO(cpus);
+    do
+    {
+        first = strtol(list, &end, 10);
+        last = *end == '-' ? strtol(end + 1, &end, 10) : first;
+        if ( end == list || first < 0 || last < first || last >= CPU_SETSIZE )
+        {
+            return -1;
+        }
+        for ( ; first <= last; first++ )
+        {
+            CPU_SET(first, cpus);
+        }
+        list = end + 1;
+    } while ( *end == ',' );
+    return *end == '\0' || *end == '@' ? 0 : -1;
+}
+
+//
+// Touches the stack a real time thread will use, so its first deep call does not page fault
+//
+void _prefault_stack()
+{
+    volatile unsigned char stack[RT_STACK_PREFAULT];
+    long page = sysconf(_SC_PAGESIZE);
+    size_t i;
+
+    for ( i = 0; i < sizeof(stack); i += page )
+    {
+        stack[i] = 0;
+    }
+}
+
+/*
+***************************************************************************************************************
+ \fn      rt_configure(const char* spec)
+ \brief   sets the CPUs and scheduling of a thread role from role=cpus[@priority]
+
+ role is modbus, tick, http or uplink, cpus a list such as 2 or 0-1,4 the role's threads are pinned to,
+ empty to leave the affinity alone. A priority from 1 to 99 runs them SCHED_FIFO, meant for the modbus loop
+ and the simulator tick; a real time thread that spins starves everything else on its CPUs.
+
+ \note    returns -1 if spec cannot be parsed
+**************************************************************************************************************
+*/
+int rt_configure(const char* spec)
+{
+    const char *cpus = strchr(spec, '='), *at;
+    rt_role_t *role = NULL;
+    int i;
+
+    for ( i = 0; cpus && i < RtRoleCount; i++ )
+    {
+        if ( strlen(roles[i].name) == (size_t)(cpus - spec) && strncmp(spec, roles[i].name, cpus - spec) == 0 )
+        {
+            role = &roles[i];
+        }
+    }
+    if ( role == NULL )
+    {
+        printf("%s %s: the role must be modbus, tick, http or uplink\n", __PRETTY_FUNCTION__, spec);
+        return -1;
+    }
+    cpus++;
+    at = strchr(cpus, '@');
+    if ( *cpus != '\0' && *cpus != '@' && _cpus(cpus, &role->cpus) != 0 )
+    {
+        printf("%s %s: bad CPU list\n", __PRETTY_FUNCTION__, spec);
+        return -1;
+    }
+    role->priority = at ? atoi(at + 1) : 0;
+    if ( at && (role->priority < sched_get_priority_min(SCHED_FIFO) ||
+                role->priority > sched_get_priority_max(SCHED_FIFO)) )
+    {
+        printf("%s %s: the priority must be between %d and %d\n", __PRETTY_FUNCTION__, spec,
+               sched_get_priority_min(SCHED_FIFO), sched_get_priority_max(SCHED_FIFO));
+        return -1;
+    }
+    role->configured = true;
+    return 0;
+}
+
+//
+// Gives the calling thread the CPUs and policy of its role. Threads inherit both, so roles are applied by
+// the threads themselves and the modbus loop last, once every other thread has started. Failures are
+// reported and the thread carries on with what it has
+//
+int rt_apply(int role)
+{
+    struct sched_param param;
+    rt_role_t *r = &roles[role];
+    int rc, retval = 0;
+
+    if ( !r->configured )
+    {
+        return 0;
+    }
+    if ( CPU_COUNT(&r->cpus) > 0 )
+    {
+        rc = pthread_setaffinity_np(pthread_self(), sizeof(r->cpus), &r->cpus);
+        if ( rc != 0 )
+        {
+            printf("%s %s: unable to set the CPU affinity: %s\n", __PRETTY_FUNCTION__, r->name, strerror(rc));
+            retval = -1;
+        }
+    }
+    if ( r->priority > 0 )
+    {
+        _prefault_stack();
+        param.sched_priority = r->priority;
+        rc = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+        if ( rc != 0 )
+        {
+            printf("%s %s: unable to use SCHED_FIFO: %s (needs CAP_SYS_NICE or RLIMIT_RTPRIO)\n",
+                   __PRETTY_FUNCTION__, r->name, strerror(rc));
+            retval = -1;
+        }
+    }
+    return retval;
+}
+
+//
+// Locks the process in memory, current and future mappings, so no request waits for a page to come back
+// from swap. The memory lock limit must cover every thread stack
+//
+int rt_lock_memory()
+{
+    if ( mlockall(MCL_CURRENT | MCL_FUTURE) != 0 )
+    {
+        printf("%s mlockall failed: %s (needs CAP_IPC_LOCK or a larger RLIMIT_MEMLOCK)\n",
+               __PRETTY_FUNCTION__, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+//
+// Reads every page of data so it is mapped before the first request needs it, with or without the lock
+//
+void rt_prefault(const void* data, size_t length)
+{
+    const volatile unsigned char *p = data;
+    long page = sysconf(_SC_PAGESIZE);
+    size_t i;
+
+    for ( i = 0; data && i < length; i += page )
+    {
+        (void)p[i];
+    }
+}
@@ -0,0 +1,30 @@
+/*
+ * Copyright © kiwipower 2017
+ *
+ * Header file for the CPU affinity, scheduling policy and memory locking of the simulator threads
+ */
+#ifndef RT_DOT_H
+#define RT_DOT_H
+
+#include <stddef.h>
+
+#define RT_STACK_PREFAULT       (64 * 1024)   // stack touched by a real time thread before it starts
+
+enum RtRole
+{
+    RtModbus = 0,                               // the modbus loop in main()
+    RtTick,                                     // the vendor simulator thread
+    RtHttp,                                     // the ENGIENL ingest endpoint
+    RtUplink,                                   // the curl uplink thread
+    RtRoleCount
+};
+
+//
+// Public functions
+//
+int  rt_configure(const char* spec);
+int  rt_apply(int role);
+int  rt_lock_memory();
+void rt_prefault(const void* data, size_t length);
+
+#endif
@@ -0,0 +1,88 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include "shmexport.h"
+
+// Private data
+static shmexport_header_t *header = NULL;
+
+static size_t _page_align(size_t size);
+
+
+size_t _page_align(size_t size)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    return (size + page - 1) & ~(page - 1);
+}
+
+/*
+***************************************************************************************************************
+ \fn      shmexport_open(const char* name, const char* target, int nb_registers, int defaults)
+ \brief   creates the shared memory segment name and returns the holding register map stored in it
+
+ Like a checkpoint (see checkpoint_open()) the register map, the battery state (see shmexport_battery())
+ and the lock of the register map live in the segment, nothing is copied to export them. Other processes
+ on the host map /dev/shm/name read only and follow the sequence in the header (see shmexport.h), they
+ never take the lock and never make a system call. The segment always starts afresh and is left behind
+ when the simulator exits, pid tells a reader whether its owner is still running.
+
+ \note    defaults is a file descriptor from regstore_defaults() or -1
+**************************************************************************************************************
+*/
+modbus_mapping_t* shmexport_open(const char* name, const char* target, int nb_registers, int defaults)
+{
+    size_t offset = _page_align(sizeof(shmexport_header_t));
+    size_t size = offset + _page_align(nb_registers * sizeof(uint16_t));
+    modbus_mapping_t *mb_mapping;
+    uint16_t *registers;
+    char path[256];
+    int fd;
+
+    snprintf(path, sizeof(path), "%s%s", name[0] == '/' ? "" : "/", name);
+    fd = shm_open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if ( fd < 0 || ftruncate(fd, 0) != 0 || ftruncate(fd, size) != 0 )
+    {
+        printf("%s unable to create %s: %s\n", __PRETTY_FUNCTION__, path, strerror(errno));
+        if ( fd >= 0 ) close(fd);
+        return NULL;
+    }
+    header = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    mb_mapping = calloc(1, sizeof(modbus_mapping_t));
+    if ( header == MAP_FAILED || mb_mapping == NULL || regmap_share(header->regmap) != 0 )
+    {
+        printf("%s unable to map %s\n", __PRETTY_FUNCTION__, path);
+        header = NULL;
+        free(mb_mapping);
+        return NULL;
+    }
+    registers = (uint16_t*)((uint8_t*)header + offset);
+    if ( defaults >= 0 && pread(defaults, registers, nb_registers * sizeof(uint16_t), 0) < 0 )
+    {
+        printf("%s unable to read the register defaults: %s\n", __PRETTY_FUNCTION__, strerror(errno));
+    }
+    header->version = SHMEXPORT_VERSION;
+    header->header_size = offset;
+    header->start_registers = 0;
+    header->nb_registers = nb_registers;
+    header->battery_size = sizeof(battery_t);
+    header->sequence_offset = (const uint8_t*)regmap_sequence() - (const uint8_t*)header;
+    header->pid = getpid();
+    strncpy(header->target, target, sizeof(header->target) - 1);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(header->magic, SHMEXPORT_MAGIC, sizeof(header->magic));   // last, a reader checks it first
+
+    mb_mapping->start_registers = 0;
+    mb_mapping->nb_registers = nb_registers;
+    mb_mapping->tab_registers = registers;
+    return mb_mapping;
+}
+
+battery_t* shmexport_battery()
+{
+    return header ? &header->battery : NULL;
+}
@@ -0,0 +1,45 @@
+/*
+ * Copyright © kiwipower 2017
+ *
+ * Header file for the register map and model state exported in a named shared memory segment
+ */
+#ifndef SHMEXPORT_DOT_H
+#define SHMEXPORT_DOT_H
+
+#include <stdint.h>
+#include <modbus/modbus.h>
+#include "battery.h"
+#include "regmap.h"
+
+#define SHMEXPORT_MAGIC         "BSIMSHM1"
+#define SHMEXPORT_VERSION       1
+
+//
+// First page of the segment, the holding registers follow at header_size in host order. A reader loads
+// the sequence at sequence_offset, copies what it needs and loads the sequence again: the copy is
+// consistent if both loads returned the same even value, otherwise it tries again. Only layout fields
+// and the sequence are meant to be read directly, battery fields are each updated atomically but not
+// together
+//
+typedef struct shmexport_header_struct
+{
+    char     magic[8];
+    uint32_t version;
+    uint32_t header_size;                       // offset of the registers, a whole number of pages
+    uint32_t start_registers;
+    uint32_t nb_registers;
+    uint32_t battery_size;                      // sizeof(battery_t), catches a layout change
+    uint32_t sequence_offset;                   // uint32_t register map sequence, odd while a write is in progress
+    int32_t  pid;                               // simulator that owns the segment
+    char     target[32];
+    battery_t battery;                          // live model state, updated in place
+    uint8_t  regmap[REGMAP_SHARED_SIZE];        // register map lock and sequence, see regmap_share()
+}shmexport_header_t;
+
+//
+// Public functions
+//
+modbus_mapping_t* shmexport_open(const char* name, const char* target, int nb_registers, int defaults);
+battery_t*        shmexport_battery();
+
+#endif
@@ -0,0 +1,219 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
+#include "supervisor.h"
+
+#define NSEC_PER_MSEC   1000000ULL
+#define NSEC_PER_SEC    1000000000ULL
+
+// Private data
+static volatile sig_atomic_t terminate = 0;
+static volatile sig_atomic_t hangup = 0;
+static pid_t children[SUPERVISOR_MAX_WORKERS];
+static uint32_t restarts = 0;
+static uint64_t history[SUPERVISOR_BURST];    // CLOCK_MONOTONIC of the last exits, a ring
+
+static uint64_t _now();
+static void     _terminate(int sig);
+static void     _hangup(int sig);
+static void     _sleep(uint64_t ms);
+static uint32_t _recent(uint64_t now);
+static pid_t    _fork(int index);
+static void     _forward();
+
+
+uint64_t _now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+void _terminate(int sig)
+{
+    terminate = sig;
+}
+
+void _hangup(int sig)
+{
+    hangup = 1;
+}
+
+void _sleep(uint64_t ms)
+{
+    struct timespec ts = { ms / 1000, (ms % 1000) * NSEC_PER_MSEC };
+    nanosleep(&ts, NULL);                       // a signal cuts the backoff short
+}
+
+//
+// Exits within the last SUPERVISOR_WINDOW seconds
+//
+uint32_t _recent(uint64_t now)
+{
+    uint32_t i, count = 0;
+
+    for ( i = 0; i < SUPERVISOR_BURST; i++ )
+    {
+        if ( history[i] && now - history[i] < SUPERVISOR_WINDOW * NSEC_PER_SEC )
+        {
+            count++;
+        }
+    }
+    return count;
+}
+
+pid_t _fork(int index)
+{
+    sigset_t set;
+    pid_t pid;
+
+    fflush(stdout);                             // or the child inherits and repeats buffered output
+    pid = fork();
+    if ( pid < 0 )
+    {
+        printf("%s fork failed: %s\n", __PRETTY_FUNCTION__, strerror(errno));
+        exit(1);
+    }
+    if ( pid == 0 )
+    {
+        sigemptyset(&set);
+        sigaddset(&set, SIGHUP);
+        sigprocmask(SIG_BLOCK, &set, NULL);     // a forwarded reload waits for the reload thread
+        signal(SIGTERM, SIG_DFL);
+        signal(SIGINT, SIG_DFL);
+        signal(SIGHUP, SIG_DFL);
+        prctl(PR_SET_PDEATHSIG, SIGTERM);       // never outlive the supervisor
+        return 0;
+    }
+    children[index] = pid;
+    return pid;
+}
+
+//
+// Passes the signals the supervisor caught on to every child
+//
+void _forward()
+{
+    int i, sig = terminate ? terminate : (hangup ? SIGHUP : 0);
+
+    hangup = 0;
+    for ( i = 0; sig && i < SUPERVISOR_MAX_WORKERS; i++ )
+    {
+        if ( children[i] )
+        {
+            kill(children[i], sig);
+        }
+    }
+}
+
+/*
+***************************************************************************************************************
+ \fn      supervisor_run(int count)
+ \brief   forks count simulator processes and restarts each as soon as it dies
+
+ Returns in the children, with the index of the worker, 0 to count - 1, which goes on to run the simulator.
+ The supervisor itself never returns: it waits for the children and forks a replacement with the same index
+ immediately. Sockets opened before the call, the modbus listen sockets in particular, are inherited by every
+ child, so clients queue in the listen backlog during a restart instead of being refused.
+
+ A child that exits with status 0 is not restarted, the supervisor exits once none is left. Once
+ SUPERVISOR_BURST restarts happen within SUPERVISOR_WINDOW seconds the restart is delayed, doubling from
+ SUPERVISOR_BACKOFF_MIN up to SUPERVISOR_BACKOFF_MAX, and the delay resets once the crash rate drops.
+
+ \note    SIGTERM and SIGINT are forwarded to the children before the supervisor exits, SIGHUP is forwarded
+          so a configuration reload reaches the simulators.
+**************************************************************************************************************
+*/
+int supervisor_run(int count)
+{
+    struct sigaction sa;
+    uint64_t backoff = 0, now;
+    int i, status, running = 0;
+    pid_t pid;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = _terminate;                 // no SA_RESTART, waitpid() must return on a signal
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
+    sa.sa_handler = _hangup;
+    sigaction(SIGHUP, &sa, NULL);
+
+    if ( count < 1 ) count = 1;
+    if ( count > SUPERVISOR_MAX_WORKERS ) count = SUPERVISOR_MAX_WORKERS;
+    for ( i = 0; i < count; i++, running++ )
+    {
+        if ( _fork(i) == 0 )
+        {
+            return i;
+        }
+    }
+
+    while ( running > 0 )
+    {
+        pid = waitpid(-1, &status, 0);
+        if ( pid < 0 )
+        {
+            if ( errno != EINTR )
+            {
+                break;
+            }
+            _forward();
+            continue;
+        }
+        for ( i = 0; i < count && children[i] != pid; i++ )
+        ;
+        if ( i == count )
+        {
+            continue;
+        }
+        children[i] = 0;
+        running--;
+        if ( terminate || (WIFEXITED(status) && WEXITSTATUS(status) == 0) )
+        {
+            continue;
+        }
+
+        now = _now();
+        history[restarts % SUPERVISOR_BURST] = now;
+        restarts++;
+        if ( _recent(now) < SUPERVISOR_BURST )
+        {
+            backoff = 0;
+        }
+        else
+        {
+            backoff = backoff ? backoff * 2 : SUPERVISOR_BACKOFF_MIN;
+            if ( backoff > SUPERVISOR_BACKOFF_MAX ) backoff = SUPERVISOR_BACKOFF_MAX;
+        }
+        if ( WIFSIGNALED(status) )
+        {
+            printf("%s simulator %d killed by signal %d, restart %u (%u in the last %ds), delay %llu ms\n",
+                   __PRETTY_FUNCTION__, i, WTERMSIG(status), restarts, _recent(now), SUPERVISOR_WINDOW, (unsigned long long)backoff);
+        }
+        else
+        {
+            printf("%s simulator %d exited with %d, restart %u (%u in the last %ds), delay %llu ms\n",
+                   __PRETTY_FUNCTION__, i, WEXITSTATUS(status), restarts, _recent(now), SUPERVISOR_WINDOW, (unsigned long long)backoff);
+        }
+        if ( backoff )
+        {
+            _sleep(backoff);
+        }
+        if ( !terminate )
+        {
+            if ( _fork(i) == 0 )
+            {
+                return i;
+            }
+            running++;
+        }
+    }
+    exit(0);
+}
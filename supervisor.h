@@ -0,0 +1,22 @@
+/*
+ * Copyright © kiwipower 2017
+ *
+ * Header file for the in process supervisor that restarts a crashed simulator
+ */
+#ifndef SUPERVISOR_DOT_H
+#define SUPERVISOR_DOT_H
+
+#include <stdint.h>
+
+#define SUPERVISOR_WINDOW           60            // seconds the crash loop rate is measured over
+#define SUPERVISOR_BURST            5             // restarts within the window before backing off
+#define SUPERVISOR_BACKOFF_MIN      100           // milliseconds
+#define SUPERVISOR_BACKOFF_MAX      10000         // milliseconds
+#define SUPERVISOR_MAX_WORKERS      64
+
+//
+// Public functions
+//
+int      supervisor_run(int count);
+
+#endif
@@ -0,0 +1,301 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "telemetry.h"
+#include "metrics.h"
+
+#define TELEMETRY_PATH          1024
+#define TELEMETRY_RETRY_MIN     1             // seconds before making a segment is tried again, doubling
+#define TELEMETRY_RETRY_MAX     60
+
+typedef struct telemetry_segment_struct
+{
+    telemetry_header_t *header;
+    size_t size;
+    char filename[TELEMETRY_PATH];
+    uint8_t *column[TelemetryColumnCount];
+}telemetry_segment_t;
+
+// Private data, rows are written by the tick and modbus threads, files are made by the segment thread
+static const uint32_t widths[TelemetryColumnCount] =
+{
+    sizeof(int64_t), sizeof(uint16_t), sizeof(uint8_t), sizeof(int8_t), sizeof(int32_t), sizeof(float), sizeof(float)
+};
+static char prefix[TELEMETRY_PATH - 16];
+static char target_name[32];
+static uint16_t device = 0;
+static uint32_t next_segment = 0;
+static telemetry_segment_t *active = NULL;      // rows go here
+static telemetry_segment_t *spare = NULL;       // ready to take over when active fills up
+static telemetry_segment_t *retired = NULL;     // filled up, kept mapped for one more rotation since a
+                                                // writer may still be finishing its row
+static telemetry_segment_t *released = NULL;    // for the segment thread to unmap
+static uint32_t dropped = 0;
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static pthread_t thread1;
+static bool started = false;
+static bool terminate1 = false;
+
+static telemetry_segment_t* _create();
+static void  _release(telemetry_segment_t* segment);
+static bool  _rotate(telemetry_segment_t* full);
+static void* _thread_handler(void* ptr);
+
+
+//
+// Makes the next segment file. Its blocks are allocated and every page is written once here, so the
+// threads recording into it never wait for the file system or a page fault
+//
+telemetry_segment_t* _create()
+{
+    telemetry_segment_t *segment = calloc(1, sizeof(telemetry_segment_t));
+    size_t page = sysconf(_SC_PAGESIZE), offset;
+    struct stat st;
+    int fd, i, rc;
+
+    if ( segment == NULL )
+    {
+        return NULL;
+    }
+    do
+    {
+        snprintf(segment->filename, sizeof(segment->filename), "%s.%06u.tlm", prefix, next_segment++);
+    } while ( stat(segment->filename, &st) == 0 );       // a restarted simulator carries on after the last one
+
+    offset = (sizeof(telemetry_header_t) + page - 1) & ~(page - 1);
+    segment->size = offset;
+    for ( i = 0; i < TelemetryColumnCount; i++ )
+    {
+        segment->size += ((size_t)TELEMETRY_ROWS * widths[i] + page - 1) & ~(page - 1);
+    }
+    fd = open(segment->filename, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    rc = fd < 0 ? errno : posix_fallocate(fd, 0, segment->size);
+    if ( rc == 0 )
+    {
+        segment->header = mmap(NULL, segment->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        rc = segment->header == MAP_FAILED ? errno : 0;
+    }
+    if ( rc != 0 )
+    {
+        printf("%s unable to create %s: %s\n", __PRETTY_FUNCTION__, segment->filename, strerror(rc));
+        if ( fd >= 0 )
+        {
+            unlink(segment->filename);          // no half made segment for battlog, the next try reuses the name
+            close(fd);
+        }
+        next_segment--;
+        free(segment);
+        return NULL;
+    }
+    close(fd);
+    memset(segment->header, 0, segment->size);
+
+    memcpy(segment->header->magic, TELEMETRY_MAGIC, sizeof(segment->header->magic));
+    segment->header->version = TELEMETRY_VERSION;
+    segment->header->capacity = TELEMETRY_ROWS;
+    segment->header->segment = next_segment - 1;
+    strncpy(segment->header->target, target_name, sizeof(segment->header->target) - 1);
+    for ( i = 0; i < TelemetryColumnCount; i++ )
+    {
+        segment->header->width[i] = widths[i];
+        segment->header->offset[i] = offset;
+        segment->column[i] = (uint8_t*)segment->header + offset;
+        offset += ((size_t)TELEMETRY_ROWS * widths[i] + page - 1) & ~(page - 1);
+    }
+    return segment;
+}
+
+void _release(telemetry_segment_t* segment)
+{
+    if ( segment )
+    {
+        msync(segment->header, segment->size, MS_ASYNC);
+        munmap(segment->header, segment->size);
+        free(segment);
+    }
+}
+
+//
+// Called by the writers that find full at capacity, true once another segment has taken over. The first
+// one to get here swaps the spare in, nothing happens if the segment thread has not made one yet. Never
+// waits for the thread
+//
+bool _rotate(telemetry_segment_t* full)
+{
+    if ( pthread_mutex_trylock(&mutex) == 0 )
+    {
+        if ( spare && __atomic_load_n(&active, __ATOMIC_RELAXED) == full )
+        {
+            spare->header->dropped = __atomic_exchange_n(&dropped, 0, __ATOMIC_RELAXED);
+            __atomic_store_n(&active, spare, __ATOMIC_RELEASE);
+            released = retired;
+            retired = full;
+            spare = NULL;
+            pthread_cond_signal(&cond);
+        }
+        pthread_mutex_unlock(&mutex);
+    }
+    return __atomic_load_n(&active, __ATOMIC_ACQUIRE) != full;
+}
+
+//
+// Keeps a spare segment ready and unmaps the ones that are done with. While a segment cannot be made, for
+// instance with the disk full, rows are dropped from the end of the active one on and the segment is tried
+// again after a growing delay
+//
+void* _thread_handler(void* ptr)
+{
+    telemetry_segment_t *done, *segment;
+    struct timespec ts;
+    int retry = TELEMETRY_RETRY_MIN;
+
+    pthread_mutex_lock(&mutex);
+    while ( !terminate1 )
+    {
+        if ( spare == NULL )
+        {
+            done = released;
+            released = NULL;
+            pthread_mutex_unlock(&mutex);
+            _release(done);
+            segment = _create();
+            pthread_mutex_lock(&mutex);
+            spare = segment;
+            if ( segment == NULL && !terminate1 )
+            {
+                clock_gettime(CLOCK_REALTIME, &ts);
+                ts.tv_sec += retry;
+                retry = retry * 2 < TELEMETRY_RETRY_MAX ? retry * 2 : TELEMETRY_RETRY_MAX;
+                pthread_cond_timedwait(&cond, &mutex, &ts);      // telemetry_stop() cuts it short
+            }
+            else
+            {
+                retry = TELEMETRY_RETRY_MIN;
+            }
+            continue;
+        }
+        pthread_cond_wait(&cond, &mutex);
+    }
+    pthread_mutex_unlock(&mutex);
+    return 0;
+}
+
+/*
+***************************************************************************************************************
+ \fn      telemetry_start(const char* prefix, const char* target, uint16_t device)
+ \brief   records a row to prefix.NNNNNN.tlm segment files on every tick and set point change
+
+ Each segment holds TELEMETRY_ROWS rows stored column by column (see telemetry.h), memory mapped and
+ written in place. Recording a row is a handful of stores into the mapping, it takes no lock and makes no
+ system call. When a segment is full the next one, made ahead of time by a background thread, takes over;
+ if it is not ready yet the row is dropped and counted rather than the tick waiting. Decode the segments
+ with battlog.
+
+ \note    device identifies the simulator in the rows, the modbus port. Call after config_block_signals(),
+          the segment thread inherits the signal mask of the caller
+**************************************************************************************************************
+*/
+int telemetry_start(const char* file_prefix, const char* target, uint16_t device_id)
+{
+    telemetry_segment_t *segment;
+
+    if ( file_prefix == NULL || started )
+    {
+        return 0;
+    }
+    strncpy(prefix, file_prefix, sizeof(prefix) - 1);
+    strncpy(target_name, target ? target : "", sizeof(target_name) - 1);
+    device = device_id;
+    segment = _create();
+    if ( segment == NULL )
+    {
+        return -1;
+    }
+    terminate1 = false;
+    if ( pthread_create(&thread1, NULL, _thread_handler, NULL) != 0 )
+    {
+        _release(segment);
+        return -1;
+    }
+    __atomic_store_n(&active, segment, __ATOMIC_RELEASE);
+    started = true;
+    return 0;
+}
+
+void telemetry_stop()
+{
+    telemetry_segment_t *segment;
+
+    if ( !started )
+    {
+        return;
+    }
+    pthread_mutex_lock(&mutex);
+    terminate1 = true;
+    pthread_cond_signal(&cond);
+    pthread_mutex_unlock(&mutex);
+    pthread_join(thread1, NULL);
+    segment = __atomic_exchange_n(&active, NULL, __ATOMIC_ACQ_REL);
+    _release(segment);
+    if ( spare )
+    {
+        unlink(spare->filename);                // never written to
+    }
+    _release(spare);
+    _release(retired);
+    _release(released);
+    spare = retired = released = NULL;
+    started = false;
+}
+
+//
+// One row, from the tick thread or the thread that changed the set point
+//
+void telemetry_record(int kind, const battery_t* battery, float heartbeat_age)
+{
+    telemetry_segment_t *segment = __atomic_load_n(&active, __ATOMIC_ACQUIRE);
+    struct timespec ts;
+    uint32_t row;
+    int8_t state;
+    int attempt;
+
+    if ( segment == NULL )
+    {
+        return;
+    }
+    for ( attempt = 0; ; attempt++ )
+    {
+        row = __atomic_fetch_add(&segment->header->rows, 1, __ATOMIC_RELAXED);
+        if ( row < TELEMETRY_ROWS )
+        {
+            break;
+        }
+        if ( attempt > 0 || !_rotate(segment) )
+        {
+            __atomic_fetch_add(&dropped, 1, __ATOMIC_RELAXED);
+            metrics_add(MetricTelemetryDropped, 1);
+            return;
+        }
+        segment = __atomic_load_n(&active, __ATOMIC_ACQUIRE);
+    }
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    state = battery->charging ? 1 : battery->discharging ? -1 : 0;
+    ((int64_t*)segment->column[TelemetryColumnTimestamp])[row] = (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+    ((uint16_t*)segment->column[TelemetryColumnDevice])[row] = device;
+    ((int8_t*)segment->column[TelemetryColumnState])[row] = state;
+    ((int32_t*)segment->column[TelemetryColumnSetpoint])[row] = battery->setpoint;
+    ((float*)segment->column[TelemetryColumnSoc])[row] = battery->state_of_charge;
+    ((float*)segment->column[TelemetryColumnHeartbeat])[row] = heartbeat_age;
+    __atomic_store_n(&((uint8_t*)segment->column[TelemetryColumnKind])[row], (uint8_t)kind, __ATOMIC_RELEASE);
+}
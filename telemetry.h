@@ -0,0 +1,60 @@
+/*
+ * Copyright © kiwipower 2017
+ *
+ * Header file for the columnar telemetry recorded on every tick and set point change
+ */
+#ifndef TELEMETRY_DOT_H
+#define TELEMETRY_DOT_H
+
+#include <stdint.h>
+#include "battery.h"
+
+#define TELEMETRY_MAGIC         "BSIMTLM1"
+#define TELEMETRY_VERSION       1
+#define TELEMETRY_ROWS          65536         // per segment, 1.5 MB and almost two hours at 10 Hz
+
+enum TelemetryKind
+{
+    TelemetryNone = 0,                          // row reserved but not complete yet
+    TelemetryTick,
+    TelemetrySetpoint
+};
+
+enum TelemetryColumn
+{
+    TelemetryColumnTimestamp = 0,               // int64_t, CLOCK_REALTIME in nanoseconds
+    TelemetryColumnDevice,                      // uint16_t, the modbus port of the simulator
+    TelemetryColumnKind,                        // uint8_t, TelemetryKind, written last
+    TelemetryColumnState,                       // int8_t, 1 charging, -1 discharging, 0 idle
+    TelemetryColumnSetpoint,                    // int32_t, kW, negative charges
+    TelemetryColumnSoc,                         // float, %
+    TelemetryColumnHeartbeat,                   // float, seconds since the last heartbeat, -1 without one
+    TelemetryColumnCount
+};
+
+//
+// File layout: this header in the first page, then each column as an array of capacity values at
+// offset[column]. rows counts the rows handed out and may run past capacity, only rows below capacity
+// whose kind is not TelemetryNone hold a complete record
+//
+typedef struct telemetry_header_struct
+{
+    char     magic[8];
+    uint32_t version;
+    uint32_t capacity;
+    uint32_t rows;
+    uint32_t segment;                           // sequence number of the file
+    uint32_t dropped;                           // rows lost before this segment, no segment was ready
+    uint32_t width[TelemetryColumnCount];       // bytes per value
+    uint64_t offset[TelemetryColumnCount];      // of the first value
+    char     target[32];
+}telemetry_header_t;
+
+//
+// Public functions
+//
+int  telemetry_start(const char* prefix, const char* target, uint16_t device);
+void telemetry_stop();
+void telemetry_record(int kind, const battery_t* battery, float heartbeat_age);
+
+#endif
@@ -4,17 +4,19 @@
 #include <byteswap.h>
 #include "tesla.h"
 #include "typedefs.h"
+#include "battery.h"
+#include "tick.h"
+#include "rt.h"
+#include "telemetry.h"
+#include "regmap.h"
+#include "trace.h"
 #include <unistd.h>
 #include <modbus/modbus.h>
 #include <string.h>
 #include <time.h>
 #include <pthread.h>
 
-#define BATTERY_POWER_RATING            230           // kW
-#define TIME_CHARGE_FROM_0_TO_100       3000          // seconds
-#define TIME_DISCHARGE_FROM_100_TO_0    2800          // seconds
 #define HEARTBEAT_TIMEOUT_DEFAULT       60
-#define STATE_OF_CHARGET_DEFAULT        50.0
 
 // Private data
 static modbus_t* ctx;
@@ -24,40 +26,36 @@ static pthread_t thread1;
 static uint8_t terminate1;
 static bool debug = false;
 
-static uint16_t heartbeatTimeout = HEARTBEAT_TIMEOUT_DEFAULT;
-static uint16_t heartbeat = 0;
 
 static int32_t StatusFullChargeEnergy = 100;
 static int32_t StatusNorminalEnergy   = 50;
 
-static float battery_discharge_decrement = 0.0;
-static float battery_charge_increment = 0.0;
-static bool battery_charging = false;
-static bool battery_discharging = false;
+static battery_t *battery;
+static device_state_t *device;                                  // heartbeat and its timeout, see device_state_t
 
 static const uint16_t POWER_BLOCK_ALL = 2;
-static const uint32_t sign_bit_mask             = 0x80000000;
-
-static const float battery_charge_resolution    = 100.00 / (BATTERY_POWER_RATING * TIME_CHARGE_FROM_0_TO_100);     // % increase in charge per sec
-static const float battery_discharge_resolution = 100.00 / (BATTERY_POWER_RATING * TIME_DISCHARGE_FROM_100_TO_0);  // % decrease in charge per sec
-static const float battery_fully_charged        = 100.00;
-static const float battery_fully_discharged     = 0.0;
-static const float state_of_charge_default      = 50.00;
-static float state_of_charge = 0;
 
 // proclet
 static int _enableDebugTrace (uint16_t );
 static int _dumpMemory (uint16_t, uint16_t );
-static int _firmwareVersion (uint16_t );
+static int _firmwareVersion ();
 static int _directRealTimeout (uint16_t );
 static int _directRealHeartbeat(uint16_t );
 static int _statusFullChargeEnergy();
 static int _statusNorminalEnergy ();
-static int _directPower( uint16_t, uint16_t  );
+static int _directPower( int32_t );
+static int _directPowerLow( uint16_t );
 static int _realMode(uint16_t  );
 static int _alwaysActive (uint16_t value);
 static int _powerBlock(uint16_t);
 
+static const read_hook_t read_hooks[] =
+{
+    { firmwareVersion,        firmwareVersionQuantity, _firmwareVersion },
+    { statusFullChargeEnergy, REGMAP_U32_QUANTITY,     _statusFullChargeEnergy },
+    { statusNorminalEnergy,   REGMAP_U32_QUANTITY,     _statusNorminalEnergy }
+};
+
 int tesla_process_single_register(uint16_t address, uint16_t data)
 {
     int retval;
@@ -68,10 +66,6 @@ int tesla_process_single_register(uint16_t address, uint16_t data)
             retval = _enableDebugTrace(data);
             break;
 
-        case firmwareVersion:
-            retval = _firmwareVersion(data);
-            break;
-
         case directRealTimeout:
             retval = _directRealTimeout(data);
             break;
@@ -80,16 +74,12 @@ int tesla_process_single_register(uint16_t address, uint16_t data)
             retval = _directRealHeartbeat(data);
             break;
 
-        case statusFullChargeEnergy:
-            retval = _statusFullChargeEnergy();
+        case directPower:                          // high word is latched until the low word arrives
+            retval = MODBUS_SUCCESS;
             break;
 
-        case statusNorminalEnergy:
-            retval = _statusNorminalEnergy();
-            break;
-
-        case directPower:
-            retval = _realMode(data);
+        case directPower + 1:
+            retval = _directPowerLow(data);
             break;
 
         case realMode:
@@ -119,53 +109,38 @@ int tesla_process_single_register(uint16_t address, uint16_t data)
 int _enableDebugTrace (uint16_t value)
 {
     debug =  value & 0x0001;
-    uint16_t *address;
-    uint16_t address_offset;
 
-    if (debug) printf("%s - %s\n", __PRETTY_FUNCTION__, debug?"TRUE":"FALSE");
-    address_offset = mb_mapping->start_registers + enableDebugTrace;
-    address = mb_mapping->tab_registers + address_offset;
-    if ( address < (mb_mapping->tab_registers + mb_mapping-> nb_registers) )
-    {
-       *address = debug;
-    }
+    trace_debug(debug);
+    regmap_write16(mb_mapping, enableDebugTrace, debug);
     return MODBUS_SUCCESS;
 }
 
 //
 // report dummy version number
 //
-int _firmwareVersion (uint16_t count)
+int _firmwareVersion ()
 {
-    uint16_t *address;
-    uint16_t address_offset;
-    int i, retval = MODBUS_SUCCESS; // need to figure out what this constant is
-    const char version[] = "V0.1.3";
-    const char *p = version;
-
-    address_offset = mb_mapping->start_registers + firmwareVersion;
-    address = mb_mapping->tab_registers + address_offset;
-    for ( i = 0; i < count; i++ )
-    {
-        uint16_t value  =  *p++;
-        address[i] = (value << 8) | *p++;
-    }
+    int retval = MODBUS_SUCCESS; // need to figure out what this constant is
+    const char version[firmwareVersionQuantity * 2] = "V0.1.3";
+
+    // two characters per register, first one in the high byte: the string is the wire encoding already
+    regmap_write_block(mb_mapping, firmwareVersion, firmwareVersionQuantity, (const uint8_t*)version);
 
-    if (debug) printf("%s Version = %s \n", __PRETTY_FUNCTION__, version);
+    trace_event(TraceRegisterRead, firmwareVersion, (version[0] << 8) | version[1]);
 
     return retval;
 }
 
 int _realMode (uint16_t value)
 {
-    if (debug) printf("%s\n", __PRETTY_FUNCTION__);
+    trace_event(TraceRegisterWrite, realMode, value);
 
     return MODBUS_SUCCESS;
 }
 
 int _alwaysActive (uint16_t value)
 {
-    if (debug) printf("%s\n", __PRETTY_FUNCTION__);
+    trace_event(TraceRegisterWrite, alwaysActive, value);
 
     return MODBUS_SUCCESS;
 }
@@ -174,9 +149,9 @@ int _alwaysActive (uint16_t value)
 int _directRealTimeout (uint16_t value)
 {
     int retval = MODBUS_SUCCESS;
-    heartbeatTimeout = value;
-    if(debug) printf("%s heartbeatTimeout = %d\n", __PRETTY_FUNCTION__, heartbeatTimeout );
-    heartbeat = 0;
+    device->heartbeat_timeout = value;
+    trace_event(TraceRegisterWrite, directRealTimeout, value);
+    device->heartbeat = 0;
     return retval;
 }
 
@@ -186,118 +161,80 @@ int _directRealTimeout (uint16_t value)
 int _directRealHeartbeat (uint16_t value)
 {
     int retval = MODBUS_SUCCESS;
-    static uint16_t previous_value = 0;
 
-    if (debug) printf("%s - value:%04x \n", __PRETTY_FUNCTION__, value);
+    trace_event(TraceHeartbeat, directRealHeartbeat, value);
 
-    if ( previous_value == value )
+    if ( device->heartbeat_last == value )
     {
-        heartbeat = 0;
+        device->heartbeat = 0;
     }
-    previous_value = ~value;
+    device->heartbeat_last = ~value;
     return retval;
 }
 
 
 int _statusFullChargeEnergy()
 {
-    uint16_t *address;
-    uint16_t address_offset;
-
-    address_offset = mb_mapping->start_registers + statusFullChargeEnergy;
-    address = mb_mapping->tab_registers + address_offset;
-    if ( address < (mb_mapping->tab_registers + mb_mapping-> nb_registers) )
-    {
-        *address         = StatusFullChargeEnergy >> 16;
-        *(address+1)     = StatusFullChargeEnergy;
-    }
-    if (debug) printf("%s StatusFullChargeEnergy = %d\n", __PRETTY_FUNCTION__, StatusFullChargeEnergy );
+    regmap_write32(mb_mapping, statusFullChargeEnergy, StatusFullChargeEnergy);
+    trace_event(TraceRegisterRead, statusFullChargeEnergy, StatusFullChargeEnergy);
 
     return MODBUS_SUCCESS;
 }
 
 int _statusNorminalEnergy()
 {
-    uint16_t *address;
-    uint16_t address_offset;
-
-    address_offset = mb_mapping->start_registers + statusNorminalEnergy;
-    address = mb_mapping->tab_registers + address_offset;
-    if ( address < (mb_mapping->tab_registers + mb_mapping-> nb_registers) )
-    {
-        *address         = StatusNorminalEnergy >> 16;
-        *(address+1)     = StatusNorminalEnergy;
-
-    }
-    if (debug) printf("%s StatusNorminalEnergy = %d\n", __PRETTY_FUNCTION__, StatusNorminalEnergy );
+    regmap_write32(mb_mapping, statusNorminalEnergy, StatusNorminalEnergy);
+    trace_event(TraceRegisterRead, statusNorminalEnergy, StatusNorminalEnergy);
 
     return MODBUS_SUCCESS;
 }
 
 
 //
-// Total real power being delivered in kW: range(-32768  to 32767)
+// Total real power being delivered in kW, 32 bit signed, high word first
 //
-int _directPower(uint16_t index, uint16_t value)
+int _directPower(int32_t value)
 {
-    static uint32_t val;
-
-    if ( index == 0 )
-    {
-        val = value << 16;
-    }
-    else
-    {
-        val  += value;                             // store set point value
-        if ( val & sign_bit_mask )
-        {
-            val = ((~val) + 1);                     // get 2nd complement value
-            if (debug) printf("%s - battery charging val(-%d)\n", __PRETTY_FUNCTION__, val);
-            battery_charging = true;
-            battery_discharging = false;
-            battery_charge_increment = ( val * battery_charge_resolution);  ;
-        }
-        else if (val > 0)
-        {
-            if (debug) printf("%s - battery discharging val(%d)\n", __PRETTY_FUNCTION__, val);
-            battery_discharging = true;
-            battery_charging = false;
-            battery_discharge_decrement = (val * battery_discharge_resolution);
-        }
-        else
-        {
-            if (debug) printf("%s - not charging val(%d)\n", __PRETTY_FUNCTION__, val);
-            battery_discharging = false;
-            battery_charging = false;
-        }
-    }
+    trace_event(TraceSetpoint, directPower, value);
+    battery_setpoint(battery, value);
+    telemetry_record(TelemetrySetpoint, battery, device->heartbeat);
 
     return MODBUS_SUCCESS;
 }
 
+//
+// FC 0x06 write of the low word completes the value with the high word already in the register map
+//
+int _directPowerLow(uint16_t value)
+{
+    uint32_t val = regmap_read32(mb_mapping, directPower);
+
+    return _directPower((int32_t)((val & 0xffff0000) | value));
+}
+
 int _powerBlock(uint16_t value)
 {
-    if (debug) printf("%s - value(%d)\n", __PRETTY_FUNCTION__, value);
+    trace_event(TraceRegisterWrite, powerBlock, value);
 
     return MODBUS_SUCCESS;
 }
 
-int tesla_write_multiple_addresses(uint16_t start_address, uint16_t quantity, uint8_t* pdata)
+//
+// Refreshes the computed registers within the range of a read
+//
+int tesla_read_registers(uint16_t start_address, uint16_t quantity)
 {
-    int retval = MODBUS_SUCCESS;
+    return regmap_read_hooks(read_hooks, sizeof(read_hooks) / sizeof(read_hooks[0]), start_address, quantity);
+}
 
-    int i;
-    uint16_t *address;
-    uint16_t address_offset;
+int tesla_write_multiple_addresses(uint16_t start_address, uint16_t quantity, uint8_t* pdata)
+{
+    int retval;
 
-    address_offset = mb_mapping->start_registers + start_address;
-    address = mb_mapping->tab_registers + address_offset;
-    for ( i = 0; i < quantity; i++ )
+    retval = regmap_write_block(mb_mapping, start_address, quantity, pdata);
+    if ( retval == MODBUS_SUCCESS && regmap_overlaps(start_address, quantity, directPower, REGMAP_U32_QUANTITY) )
     {
-        if ( address < (mb_mapping->tab_registers + mb_mapping-> nb_registers) )
-        {
-            *address++  = (*pdata++ << 8) | *pdata++;
-        }
+        _directPower((int32_t)regmap_read32(mb_mapping, directPower));
     }
 
     return retval;
@@ -306,12 +243,23 @@ int tesla_write_multiple_addresses(uint16_t start_address, uint16_t quantity, ui
 void tesla_init(init_param_t* param)
 {
     tesla_thread_param_t* tesla_thread_param;
-    tesla_disconnect();                                        // set default SoC
-    setvbuf(stdout, NULL, _IONBF, 0);                          // disable stdout buffering
+    battery = param->battery;
+    device = param->device;
+    if ( !param->passive )
+    {
+        battery_init(battery, &param->battery_param);          // set default SoC
+        memset(device, 0, sizeof(device_state_t));
+        device->heartbeat_timeout = HEARTBEAT_TIMEOUT_DEFAULT;
+    }
     mb_mapping = param->modbus_mapping;
     terminate1 = FALSE;
+    if ( param->headless || param->passive )
+    {
+        return;                                                // caller or worker 0 drives tesla_tick()
+    }
     tesla_thread_param = (tesla_thread_param_t*) malloc(sizeof (tesla_thread_param_t));
     tesla_thread_param -> terminate = &terminate1;
+    tesla_thread_param -> tick_rate = param->tick_rate;
     pthread_create( &thread1, NULL, tesla_thread_handler, tesla_thread_param);
 }
 
@@ -323,7 +271,22 @@ void tesla_dispose()
 
 void tesla_disconnect()
 {
-    state_of_charge = state_of_charge_default;
+    battery_reset(battery);
+}
+
+//
+// Advances the simulation by the given number of seconds
+//
+void tesla_tick(float seconds)
+{
+    if ( device->heartbeat > device->heartbeat_timeout )
+    {
+        trace_event(TraceHeartbeatExpired, device->heartbeat_timeout, 0);
+        device->heartbeat = 0;
+    }
+    battery_tick(battery, seconds);
+    device->heartbeat += seconds;
+    telemetry_record(TelemetryTick, battery, device->heartbeat);
 }
 
 
@@ -333,44 +296,17 @@ void tesla_disconnect()
 void *tesla_thread_handler( void *ptr )
 {
     uint8_t *terminate;
+    tick_t tick;
     tesla_thread_param_t* param = (tesla_thread_param_t*) ptr;
     terminate = param->terminate;
+    tick_init(&tick, "tesla", param->tick_rate);
     free(param);
+    rt_apply(RtTick);
 
     while ( *terminate == false )
     {
-        sleep(1);
-        if ( heartbeat > heartbeatTimeout )
-        {
-            if ( debug ) printf("%s: heartbeat expired, current timeout = %d\n", __PRETTY_FUNCTION__, heartbeatTimeout );
-            heartbeat = 0;
-        }
-
-        if (battery_charging)
-        {
-            if ( (state_of_charge + battery_charge_increment) <= battery_fully_charged )
-            {
-                state_of_charge += battery_charge_increment;
-            }
-            else
-            {
-                state_of_charge = battery_fully_charged;
-                battery_charging = false;
-            }
-        }
-        else if (battery_discharging)
-        {
-            if ( (state_of_charge - battery_discharge_decrement) >= battery_fully_discharged )
-            {
-                state_of_charge -= battery_discharge_decrement;
-            }
-            else
-            {
-                state_of_charge = battery_fully_discharged;
-                battery_discharging = false;
-            }
-        }
-        heartbeat++;
+        tesla_tick(tick_wait(&tick));
     }
+    tick_stats_print(&tick);
+    return 0;
 }
-
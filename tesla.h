@@ -11,6 +11,7 @@
 #include "typedefs.h"
 
 #define firmwareVersion               101
+#define firmwareVersionQuantity       3
 #define statusFullChargeEnergy        205
 #define statusNorminalEnergy          207
 #define realMode                      1000
@@ -32,7 +33,9 @@ void  tesla_init(init_param_t* );
 void  tesla_dispose();
 void  tesla_disconnect();
 void* tesla_thread_handler( void *ptr );
+void  tesla_tick(float seconds);
 int   tesla_process_single_register(uint16_t address, uint16_t data);
+int   tesla_read_registers(uint16_t start_address, uint16_t quantity);
 int   tesla_write_multiple_addresses(uint16_t start_address, uint16_t quantity, uint8_t* pdata);
 
 #endif
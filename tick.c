@@ -0,0 +1,151 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include "tick.h"
+#include "metrics.h"
+
+#define NSEC_PER_SEC    1000000000ULL
+#define NSEC_PER_USEC   1000ULL
+
+// Private data
+static volatile sig_atomic_t dump_requested = 0;
+
+static uint64_t _now();
+static int      _bucket(uint64_t value);
+static void     _sigusr1(int sig);
+static void     _print_histogram(const char* title, const uint64_t* histogram, const char* unit);
+
+
+uint64_t _now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+//
+// log2 bucket: 0 for value 0, n for value < 2^n
+//
+int _bucket(uint64_t value)
+{
+    int bucket = 0;
+
+    while ( value && bucket < TICK_HISTOGRAM_BUCKETS - 1 )
+    {
+        value >>= 1;
+        bucket++;
+    }
+    return bucket;
+}
+
+void _sigusr1(int sig)
+{
+    dump_requested = 1;
+}
+
+void tick_init(tick_t* tick, const char* name, unsigned int rate)
+{
+    struct sigaction sa;
+
+    if ( rate == 0 || rate > TICK_RATE_MAX )
+    {
+        rate = TICK_RATE_DEFAULT;
+    }
+    memset(tick, 0, sizeof(tick_t));
+    tick->name = name;
+    tick->period = NSEC_PER_SEC / rate;
+    tick->last = tick->deadline = _now();
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = _sigusr1;                   // kill -USR1 prints the tick statistics
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGUSR1, &sa, NULL);
+}
+
+/*
+***************************************************************************************************************
+ \fn      tick_wait(tick_t* tick)
+ \brief   sleeps until the next tick
+
+ Deadlines are absolute, one period apart, so the time spent processing a tick does not stretch the period.
+ If processing ran past the next deadline the missed periods are counted as an overrun and the schedule
+ restarts from now rather than firing a burst of late ticks.
+
+ \note    Returns the seconds actually elapsed since the previous tick, which the caller integrates over.
+**************************************************************************************************************
+*/
+float tick_wait(tick_t* tick)
+{
+    struct timespec ts;
+    uint64_t now, late, elapsed;
+
+    tick->deadline += tick->period;
+    now = _now();
+    if ( now >= tick->deadline )
+    {
+        tick->stats.overruns++;
+        metrics_add(MetricTickOverruns, 1);
+        tick->stats.overrun[_bucket((now - tick->deadline) / tick->period + 1)]++;
+        tick->deadline = now;
+    }
+    else
+    {
+        ts.tv_sec  = tick->deadline / NSEC_PER_SEC;
+        ts.tv_nsec = tick->deadline % NSEC_PER_SEC;
+        while ( clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR )
+        ;
+        now = _now();
+    }
+
+    late = now - tick->deadline;
+    tick->stats.jitter[_bucket(late / NSEC_PER_USEC)]++;
+    if ( late > tick->stats.jitter_max ) tick->stats.jitter_max = late;
+    tick->stats.ticks++;
+    metrics_add(MetricTicks, 1);
+
+    elapsed = now - tick->last;
+    tick->last = now;
+
+    if ( dump_requested )
+    {
+        dump_requested = 0;
+        tick_stats_print(tick);
+    }
+    return (float)elapsed / NSEC_PER_SEC;
+}
+
+void _print_histogram(const char* title, const uint64_t* histogram, const char* unit)
+{
+    int i;
+
+    printf("  %s\n", title);
+    for ( i = 0; i < TICK_HISTOGRAM_BUCKETS; i++ )
+    {
+        if ( histogram[i] == 0 )
+        {
+            continue;
+        }
+        if ( i == TICK_HISTOGRAM_BUCKETS - 1 )
+        {
+            printf("    >= %6llu %s : %llu\n", 1ULL << (i - 1), unit, (unsigned long long)histogram[i]);
+        }
+        else
+        {
+            printf("    <  %6llu %s : %llu\n", 1ULL << i, unit, (unsigned long long)histogram[i]);
+        }
+    }
+}
+
+void tick_stats_print(const tick_t* tick)
+{
+    printf("%s tick: period %llu us, ticks %llu, overruns %llu, max jitter %llu us\n", tick->name,
+           (unsigned long long)(tick->period / NSEC_PER_USEC), (unsigned long long)tick->stats.ticks,
+           (unsigned long long)tick->stats.overruns, (unsigned long long)(tick->stats.jitter_max / NSEC_PER_USEC));
+    _print_histogram("jitter", tick->stats.jitter, "us");
+    if ( tick->stats.overruns )
+    {
+        _print_histogram("overrun", tick->stats.overrun, "periods");
+    }
+}
@@ -0,0 +1,40 @@
+/*
+ * Copyright © kiwipower 2017
+ *
+ * Header file for the fixed rate simulation tick
+ */
+#ifndef TICK_DOT_H
+#define TICK_DOT_H
+
+#include <stdint.h>
+
+#define TICK_RATE_DEFAULT           10            // Hz
+#define TICK_RATE_MAX               1000          // Hz
+#define TICK_HISTOGRAM_BUCKETS      16
+
+typedef struct tick_stats_struct
+{
+    uint64_t ticks;
+    uint64_t overruns;                          // ticks whose deadline had passed before the wait started
+    uint64_t jitter_max;                        // nanoseconds
+    uint64_t jitter[TICK_HISTOGRAM_BUCKETS];    // wake up lateness, bucket n counts < 2^n us, the last one the rest
+    uint64_t overrun[TICK_HISTOGRAM_BUCKETS];   // periods lost per overrun, bucket n counts < 2^n periods
+}tick_stats_t;
+
+typedef struct tick_struct
+{
+    const char *name;
+    uint64_t period;                            // nanoseconds
+    uint64_t deadline;                          // CLOCK_MONOTONIC nanoseconds
+    uint64_t last;                              // CLOCK_MONOTONIC nanoseconds of the previous wake up
+    tick_stats_t stats;
+}tick_t;
+
+//
+// Public functions
+//
+void   tick_init(tick_t* tick, const char* name, unsigned int rate);
+float  tick_wait(tick_t* tick);
+void   tick_stats_print(const tick_t* tick);
+
+#endif
@@ -0,0 +1,256 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "trace.h"
+
+typedef struct trace_ring_struct
+{
+    struct trace_ring_struct *next;
+    uint16_t thread;
+    _Atomic uint32_t head;                      // next slot the owning thread writes
+    _Atomic uint32_t tail;                      // next slot the flusher reads
+    _Atomic uint32_t dropped;
+    trace_event_t events[TRACE_RING_EVENTS];
+}trace_ring_t;
+
+// Private data
+static const char* formats[TraceEventCount] =
+{
+    [TraceNone]             = "",
+    [TraceDebug]            = "debug %d",
+    [TraceRequest]          = "request fc 0x%02x address %d quantity %d exception %d",
+    [TraceRegisterWrite]    = "write register %d value %d",
+    [TraceRegisterRead]     = "read register %d value %d",
+    [TraceSetpoint]         = "set point register %d %d kW",
+    [TraceHeartbeat]        = "heartbeat register %d value 0x%04x",
+    [TraceHeartbeatExpired] = "heartbeat expired, timeout %d s",
+    [TraceDropped]          = "%d events dropped"
+};
+
+static _Atomic(trace_ring_t*) rings = NULL;
+static _Atomic uint16_t ring_count = 0;
+static __thread trace_ring_t *ring = NULL;
+static _Atomic bool active = false;            // events are recorded
+static FILE *fp = NULL;
+static pthread_t thread1;
+static _Atomic bool terminate1 = false;
+static bool started = false;
+
+static trace_ring_t* _register();
+static void          _drain(trace_ring_t* r);
+static void*         _thread_handler(void* ptr);
+
+
+//
+// First event of a thread: a ring of its own, pushed on the lock free list the flusher walks
+//
+trace_ring_t* _register()
+{
+    trace_ring_t *r = calloc(1, sizeof(trace_ring_t));
+
+    if ( r == NULL )
+    {
+        return NULL;
+    }
+    r->thread = atomic_fetch_add(&ring_count, 1);
+    r->next = atomic_load(&rings);
+    while ( !atomic_compare_exchange_weak(&rings, &r->next, r) )
+    ;
+    ring = r;
+    return r;
+}
+
+/*
+***************************************************************************************************************
+ \fn      trace_event4(uint16_t id, int32_t a, int32_t b, int32_t c, int32_t d)
+ \brief   records an event in the calling thread's ring
+
+ Costs a clock read and a 32 byte store: no lock, no system call, nothing shared with other threads but
+ the ring indices the flusher reads. A full ring drops the event and counts it, the caller never waits.
+**************************************************************************************************************
+*/
+void trace_event4(uint16_t id, int32_t a, int32_t b, int32_t c, int32_t d)
+{
+    trace_ring_t *r = ring;
+    trace_event_t *e;
+    struct timespec ts;
+    uint32_t head;
+
+    if ( !atomic_load_explicit(&active, memory_order_relaxed) )
+    {
+        return;
+    }
+    if ( r == NULL && (r = _register()) == NULL )
+    {
+        return;
+    }
+    head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    if ( head - atomic_load_explicit(&r->tail, memory_order_acquire) >= TRACE_RING_EVENTS )
+    {
+        atomic_fetch_add_explicit(&r->dropped, 1, memory_order_relaxed);
+        return;
+    }
+    clock_gettime(CLOCK_REALTIME, &ts);
+    e = &r->events[head & (TRACE_RING_EVENTS - 1)];
+    e->timestamp = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    e->id = id;
+    e->thread = r->thread;
+    e->arg[0] = a;
+    e->arg[1] = b;
+    e->arg[2] = c;
+    e->arg[3] = d;
+    e->reserved = 0;
+    atomic_store_explicit(&r->head, head + 1, memory_order_release);
+}
+
+void trace_event(uint16_t id, int32_t a, int32_t b)
+{
+    trace_event4(id, a, b, 0, 0);
+}
+
+//
+// Formats an event the way the console and battrace print it, returns the length
+//
+int trace_format(const trace_event_t* event, char* buf, int size)
+{
+    time_t seconds = event->timestamp / 1000000000ULL;
+    struct tm tm;
+    int n;
+
+    localtime_r(&seconds, &tm);
+    n = strftime(buf, size, "%H:%M:%S", &tm);
+    n += snprintf(buf + n, size - n, ".%09llu [%u] ", (unsigned long long)(event->timestamp % 1000000000ULL), event->thread);
+    if ( event->id < TraceEventCount )
+    {
+        n += snprintf(buf + n, size - n, formats[event->id], event->arg[0], event->arg[1], event->arg[2], event->arg[3]);
+    }
+    else
+    {
+        n += snprintf(buf + n, size - n, "unknown event %u", event->id);
+    }
+    return n < size ? n : size - 1;
+}
+
+void _drain(trace_ring_t* r)
+{
+    uint32_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    uint32_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+    uint32_t dropped = atomic_exchange_explicit(&r->dropped, 0, memory_order_relaxed);
+    trace_event_t lost;
+    char line[160];
+
+    for ( ; tail != head; tail++ )
+    {
+        const trace_event_t *e = &r->events[tail & (TRACE_RING_EVENTS - 1)];
+        if ( fp )
+        {
+            fwrite(e, sizeof(trace_event_t), 1, fp);
+        }
+        else
+        {
+            trace_format(e, line, sizeof(line));
+            puts(line);
+        }
+    }
+    atomic_store_explicit(&r->tail, tail, memory_order_release);
+
+    if ( dropped )
+    {
+        memset(&lost, 0, sizeof(lost));
+        lost.timestamp = time(NULL) * 1000000000ULL;
+        lost.id = TraceDropped;
+        lost.thread = r->thread;
+        lost.arg[0] = dropped;
+        if ( fp )
+        {
+            fwrite(&lost, sizeof(trace_event_t), 1, fp);
+        }
+        else
+        {
+            trace_format(&lost, line, sizeof(line));
+            puts(line);
+        }
+    }
+}
+
+//
+// Thread handler, moves the rings to the file or the console off the request path
+//
+void* _thread_handler(void* ptr)
+{
+    struct timespec ts = { 0, TRACE_FLUSH_INTERVAL * 1000000L };
+    trace_ring_t *r;
+
+    while ( !atomic_load(&terminate1) )
+    {
+        nanosleep(&ts, NULL);
+        for ( r = atomic_load(&rings); r; r = r->next )
+        {
+            _drain(r);
+        }
+        fflush(fp ? fp : stdout);
+    }
+    for ( r = atomic_load(&rings); r; r = r->next )
+    {
+        _drain(r);
+    }
+    return 0;
+}
+
+//
+// Starts the flusher. With a file name every event is recorded to it, decode it with battrace. Without,
+// events are only recorded while debug is on and are printed to stdout
+//
+int trace_start(const char* filename)
+{
+    trace_header_t header;
+
+    if ( filename )
+    {
+        fp = fopen(filename, "wb");
+        if ( fp == NULL )
+        {
+            printf("%s unable to open %s: %s\n", __PRETTY_FUNCTION__, filename, strerror(errno));
+            return -1;
+        }
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+        header.version = TRACE_VERSION;
+        header.event_size = sizeof(trace_event_t);
+        fwrite(&header, sizeof(header), 1, fp);
+        atomic_store(&active, true);
+    }
+    started = pthread_create(&thread1, NULL, _thread_handler, NULL) == 0;
+    return started ? 0 : -1;
+}
+
+void trace_stop()
+{
+    if ( started )
+    {
+        atomic_store(&terminate1, true);
+        pthread_join(thread1, NULL);
+        started = false;
+    }
+    if ( fp )
+    {
+        fclose(fp);
+        fp = NULL;
+    }
+}
+
+//
+// The simulators' debug register. Without a trace file it turns recording on and off
+//
+void trace_debug(bool on)
+{
+    if ( fp == NULL )
+    {
+        atomic_store(&active, on);
+    }
+    trace_event(TraceDebug, on, 0);
+}
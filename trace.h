@@ -0,0 +1,60 @@
+/*
+ * Copyright © kiwipower 2017
+ *
+ * Header file for the binary event trace
+ */
+#ifndef TRACE_DOT_H
+#define TRACE_DOT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define TRACE_MAGIC             "BSIMTRC1"
+#define TRACE_VERSION           1
+#define TRACE_RING_EVENTS       4096          // per thread, a power of 2
+#define TRACE_FLUSH_INTERVAL    100           // milliseconds
+
+enum TraceEvent
+{
+    TraceNone = 0,
+    TraceDebug,                                 // a = on
+    TraceRequest,                               // a = function code, b = address, c = quantity, d = exception
+    TraceRegisterWrite,                         // a = address, b = value
+    TraceRegisterRead,                          // a = address, b = value
+    TraceSetpoint,                              // a = address, b = kW, negative charges
+    TraceHeartbeat,                             // a = address, b = value
+    TraceHeartbeatExpired,                      // a = timeout in seconds
+    TraceDropped,                               // a = events lost to a full ring
+    TraceEventCount
+};
+
+//
+// File layout: trace_header_t followed by trace_event_t records, ordered per thread only
+//
+typedef struct trace_header_struct
+{
+    char     magic[8];
+    uint32_t version;
+    uint32_t event_size;                        // sizeof(trace_event_t)
+}__attribute__((packed))trace_header_t;
+
+typedef struct trace_event_struct
+{
+    uint64_t timestamp;                         // CLOCK_REALTIME in nanoseconds
+    uint16_t id;                                // TraceEvent
+    uint16_t thread;                            // order in which the thread first traced
+    int32_t  arg[4];
+    uint32_t reserved;
+}__attribute__((packed))trace_event_t;
+
+//
+// Public functions
+//
+int         trace_start(const char* filename);
+void        trace_stop();
+void        trace_debug(bool on);
+void        trace_event(uint16_t id, int32_t a, int32_t b);
+void        trace_event4(uint16_t id, int32_t a, int32_t b, int32_t c, int32_t d);
+int         trace_format(const trace_event_t* event, char* buf, int size);
+
+#endif
@@ -6,8 +6,10 @@
 #define TYPEDEFS_DOT_H
 
 
+#include <stdbool.h>
 #include <modbus/modbus.h>
 #include "queue.h"
+#include "battery.h"
 
 //typedef enum {false, true} bool;
 
@@ -17,7 +19,8 @@
 typedef enum CURL_MESSAGE_TYPE
 {
     CURL_PLAIN_TEXT = 100,
-    CURL_APPLICATION_JSON
+    CURL_APPLICATION_JSON,
+    CURL_READINGS_BINARY                        // sent as JSON, rendered by the uplink thread
 }curl_message_type_t;
 
 
@@ -28,6 +31,17 @@ typedef struct process_table_struct
 }process_table_t;
 
 
+//
+// Computes registers on read, sorted by address
+//
+typedef struct read_hook_struct
+{
+    uint16_t address;
+    uint16_t quantity;                          // number of registers the hook fills in
+    int (*hook)();
+}read_hook_t;
+
+
 typedef struct optargs_struct
 {
     unsigned int port;                           // port number for modbus server to listen
@@ -35,6 +49,18 @@ typedef struct optargs_struct
     unsigned int NumberHoldingRegisters;         // Number of read - write registers
 }optargs_t;
 
+//
+// Simulator state besides the battery that the requests change. Worker processes share it like the battery,
+// whichever process takes the write, and worker 0 advances the heartbeat on its tick
+//
+typedef struct device_state_struct
+{
+    float    heartbeat;                         // seconds since the last heartbeat
+    uint16_t heartbeat_last;                    // heartbeat register bits as last written
+    uint16_t heartbeat_timeout;                 // seconds, simulators without a timeout register ignore it
+    uint16_t setpoint;                          // set point register as last written
+}device_state_t;
+
 typedef struct init_param_struct
 {
     uint8_t  *terminate;
@@ -43,6 +69,15 @@ typedef struct init_param_struct
     modbus_mapping_t *modbus_mapping;
     char powerToDeliverURL[128];                // powerToDeliverURL = ipaddress:port
     char submitReadingsURL[128];               // submitReadingsURL = ipaddress/endpoint
+    int  uplink_encoding;                       // CompressNone, CompressGzip or CompressZstd
+    unsigned int aggregate_window;              // seconds per forwarded aggregate, 0 = forward every upload
+    float aggregate_jump;                       // SoC change forwarded at once while aggregating, 0 = none
+    bool headless;                              // no threads, the caller drives the model tick
+    bool passive;                               // worker process, worker 0 owns the battery and the tick
+    unsigned int tick_rate;                     // simulation ticks per second, 0 = TICK_RATE_DEFAULT
+    battery_param_t battery_param;
+    battery_t *battery;
+    device_state_t *device;
 }init_param_t;
 
 typedef struct thread_param_struct
@@ -50,12 +85,14 @@ typedef struct thread_param_struct
     modbus_t *ctx;
     pthread_mutex_t* mutex;
     uint8_t *terminate;
+    unsigned int tick_rate;
 }thread_param_t;
 
 typedef struct tesla_params_struct
 {
     modbus_t *ctx;
     uint8_t *terminate;
+    unsigned int tick_rate;
 }tesla_thread_param_t;
 
 typedef struct mhttpd_thread_param_struct
@@ -91,6 +128,8 @@ typedef struct
 {
     char status;
     char *buff;
+    size_t length;                              // bytes of the body received so far
+    bool overflow;                              // the body exceeded the ingest limit
 }post_data_t;
 
 typedef struct curl_data_struct
@@ -99,6 +138,7 @@ typedef struct curl_data_struct
     curl_message_type_t type;
     int length;
     char* payload;
+    uint64_t enqueued;                          // metrics_now() when pushed
 }queue_item_t;
 
 typedef struct {